@@ -0,0 +1,230 @@
+#!/usr/bin/env python3
+
+"""
+Binary scan events from the M4 core
+The M4 sends one frame per event, one frame per RPMsg message, on its
+"rpmsg-raw" endpoint. Linux hands that to the rpmsg char driver as
+/dev/rpmsgN; the text console stays on /dev/ttyRPMSG0 for debugging.
+Commands written to the endpoint are handled like console commands,
+the first one also tells the M4 where to send events. Up to 4 wait
+while one runs; one more is answered with EVENT_NAK and not run.
+ack and replay are handled on arrival.
+
+The M4 keeps the last 32 events until they are acknowledged with
+"ack:SEQ" (everything up to SEQ) and sends the unacknowledged ones again
+on "replay", which open() asks for. They survive a remoteproc
+stop/start, a firmware update included; sequence numbers then carry on,
+ticks do not. Events can therefore arrive twice; EventParser drops what
+it has seen. Frame, little-endian:
+
+    sync 0xA5, version, length (2) of type up to the last block byte,
+    type, reader, sequence number (4), tick in ms (4), status,
+    completed steps, SAK, UID length (0: none), UID,
+    block address, block count, 16 bytes per block,
+    CRC_A (2) of version up to the last block byte
+"""
+
+import fcntl
+import glob
+import os
+import select
+import struct
+from collections import namedtuple
+
+EVENT_SERVICE = 'rpmsg-raw'
+RPMSG_CTRL = '/dev/rpmsg_ctrl0'
+# _IOW(0xb5, 1, struct rpmsg_endpoint_info), linux/rpmsg.h
+RPMSG_CREATE_EPT_IOCTL = 0x4028b501
+RPMSG_ADDR_ANY = 0xFFFFFFFF
+
+EVENT_SYNC = 0xA5
+EVENT_VERSION = 2
+
+# Event types
+EVENT_CARD = 1      # Card scanned
+EVENT_REMOVED = 2   # A reported card left the field
+EVENT_PONG = 3      # Answer to ping, carries the next sequence number
+EVENT_NAK = 4       # A command was dropped, the M4 had too many waiting
+
+# Completed steps
+STEP_REQUEST = 0x01
+STEP_ANTICOLL = 0x02
+STEP_SELECT = 0x04
+STEP_AUTH = 0x08
+STEP_READ = 0x10
+
+# Status codes, as MFRC522_Status_t
+STATUS_NAMES = ['OK', 'no answer', 'error', 'chip timeout', 'collision',
+                'parity error', 'CRC error', 'buffer overflow', 'protocol error']
+
+# Type to UID length, after sync, version and length
+_FIXED = struct.Struct('<BBIIBBBB')
+_HEADER_LEN = 4
+_MAX_BODY = _FIXED.size + 10 + 2 + 16 * 16
+
+Event = namedtuple('Event', 'type reader seq tick status steps sak uid block_addr blocks')
+
+
+def crc_a(data):
+    """ISO/IEC 14443-3 CRC_A, as the M4 computes it"""
+    crc = 0x6363
+    for byte in data:
+        byte ^= crc & 0xFF
+        byte = (byte ^ (byte << 4)) & 0xFF
+        crc = (crc >> 8) ^ (byte << 8) ^ (byte << 3) ^ (byte >> 4)
+    return crc
+
+
+def uid_hex(uid):
+    """UID bytes as the backend expects them, e.g. '04A1B2C3'"""
+    return uid.hex().upper()
+
+
+class EventParser:
+    """Splits the event channel byte stream into frames"""
+
+    def __init__(self):
+        self.buffer = bytearray()
+        self.last_seq = None
+        self.dropped = 0     # Bytes skipped to find a frame again
+        self.missed = 0      # Events lost, from gaps in the sequence numbers
+        self.duplicates = 0  # Events replayed after they arrived once
+
+    def feed(self, data):
+        """Add received bytes, return the complete events"""
+        self.buffer += data
+        events = []
+
+        while True:
+            start = self.buffer.find(EVENT_SYNC)
+            if start < 0:
+                self.dropped += len(self.buffer)
+                self.buffer.clear()
+                break
+            if start > 0:
+                self.dropped += start
+                del self.buffer[:start]
+            if len(self.buffer) < _HEADER_LEN:
+                break
+
+            version = self.buffer[1]
+            length = self.buffer[2] | (self.buffer[3] << 8)
+            if version != EVENT_VERSION or length < _FIXED.size + 2 or length > _MAX_BODY:
+                # Not a frame start, look for the next sync byte
+                self.dropped += 1
+                del self.buffer[:1]
+                continue
+
+            end = _HEADER_LEN + length
+            if len(self.buffer) < end + 2:
+                break
+
+            crc = self.buffer[end] | (self.buffer[end + 1] << 8)
+            event = None
+            if crc == crc_a(self.buffer[1:end]):
+                event = self._decode(bytes(self.buffer[_HEADER_LEN:end]))
+            if event is None:
+                self.dropped += 1
+                del self.buffer[:1]
+                continue
+
+            del self.buffer[:end + 2]
+            if event.type not in (EVENT_PONG, EVENT_NAK):
+                if self.last_seq is not None:
+                    if event.seq <= self.last_seq:
+                        self.duplicates += 1
+                        continue
+                    self.missed += event.seq - self.last_seq - 1
+                self.last_seq = event.seq
+            events.append(event)
+
+        return events
+
+    def _decode(self, body):
+        """Fields of a frame body, None if they do not add up"""
+        type_, reader, seq, tick, status, steps, sak, uid_len = _FIXED.unpack_from(body)
+        pos = _FIXED.size
+        if uid_len > 10 or len(body) < pos + uid_len + 2:
+            return None
+
+        uid = body[pos:pos + uid_len]
+        pos += uid_len
+        block_addr, block_count = body[pos], body[pos + 1]
+        pos += 2
+        if len(body) != pos + 16 * block_count:
+            return None
+
+        blocks = [body[pos + 16 * i:pos + 16 * (i + 1)] for i in range(block_count)]
+        return Event(type_, reader, seq, tick, status, steps, sak, uid, block_addr, blocks)
+
+
+def _rpmsg_devices():
+    return set(glob.glob('/dev/rpmsg[0-9]*'))
+
+
+def find_event_device():
+    """Char device of the M4 event endpoint, created on older kernels"""
+    channels = glob.glob(f'/sys/bus/rpmsg/devices/*.{EVENT_SERVICE}.*')
+    if not channels:
+        raise OSError(f'M4 has not announced {EVENT_SERVICE}, is the firmware running?')
+
+    # Kernels with rpmsg-raw support bind the char driver to the channel
+    bound = glob.glob(os.path.join(channels[0], 'rpmsg', 'rpmsg[0-9]*'))
+    if bound:
+        return '/dev/' + os.path.basename(bound[0])
+
+    # Otherwise ask rpmsg_ctrl for an endpoint towards the M4 address,
+    # the last field of the channel name (virtio0.rpmsg-raw.-1.1025)
+    dst = int(channels[0].rsplit('.', 1)[1])
+    before = _rpmsg_devices()
+    info = struct.pack('<32sII', EVENT_SERVICE.encode(), RPMSG_ADDR_ANY, dst)
+    ctrl = os.open(RPMSG_CTRL, os.O_RDWR)
+    try:
+        fcntl.ioctl(ctrl, RPMSG_CREATE_EPT_IOCTL, info)
+    finally:
+        os.close(ctrl)
+    created = sorted(_rpmsg_devices() - before)
+    if not created:
+        raise OSError('rpmsg_ctrl created no endpoint device')
+    return created[0]
+
+
+class EventEndpoint:
+    """Events from the M4 through the rpmsg char driver, no TTY layer"""
+
+    def __init__(self):
+        self.fd = None
+        self.path = None
+        self.parser = EventParser()
+
+    def open(self):
+        self.path = find_event_device()
+        self.fd = os.open(self.path, os.O_RDWR)
+        self.parser = EventParser()
+        # Gives the M4 our address, and whatever was not acknowledged
+        self.send('replay')
+
+    def close(self):
+        if self.fd is not None:
+            os.close(self.fd)
+            self.fd = None
+
+    @property
+    def is_open(self):
+        return self.fd is not None
+
+    def send(self, command):
+        """One command per message"""
+        os.write(self.fd, command.encode())
+
+    def ack(self, seq):
+        """The M4 may forget events up to seq"""
+        self.send(f'ack:{seq}')
+
+    def read(self, timeout=None):
+        """Events of the next message, [] if none came within timeout seconds"""
+        poller = select.poll()
+        poller.register(self.fd, select.POLLIN)
+        if not poller.poll(None if timeout is None else int(timeout * 1000)):
+            return []
+        return self.parser.feed(os.read(self.fd, 512))
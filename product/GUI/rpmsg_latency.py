@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+
+"""
+M4 to user space latency, event endpoint vs console TTY
+Sends "ping" on each path and times the answer: an EVENT_PONG frame on
+the event endpoint (/dev/rpmsgN), a "pong" line on /dev/ttyRPMSG0 read
+the way the old scripts did (pyserial, in_waiting polling, readline).
+Half the round trip is the one-way latency; both directions go through
+the same IPCC doorbells, only the A7 side differs.
+
+Usage: rpmsg_latency.py [COUNT]
+Stop the attendance service first, only one reader per endpoint. Events
+replayed or scanned meanwhile are skipped and stay unacknowledged.
+"""
+
+import sys
+import time
+import statistics
+
+import serial
+
+from rfid_events import EventEndpoint, EVENT_PONG
+
+CONSOLE_PORT = '/dev/ttyRPMSG0'
+TIMEOUT = 1.0
+
+
+def ping_endpoint(endpoint):
+    """Round trip on the event endpoint in seconds, None on timeout"""
+    start = time.monotonic()
+    endpoint.send('ping')
+    while time.monotonic() - start < TIMEOUT:
+        for event in endpoint.read(timeout=TIMEOUT):
+            if event.type == EVENT_PONG:
+                return time.monotonic() - start
+    return None
+
+
+def ping_console(console):
+    """Round trip on the console TTY in seconds, None on timeout"""
+    start = time.monotonic()
+    console.write(b'ping\r\n')
+    while time.monotonic() - start < TIMEOUT:
+        if console.in_waiting > 0:
+            if console.readline().strip() == b'pong':
+                return time.monotonic() - start
+        else:
+            time.sleep(0.001)
+    return None
+
+
+def report(name, samples, count):
+    if not samples:
+        print(f'{name:10} no answer')
+        return
+    samples = sorted(s * 1e6 for s in samples)
+    p99 = samples[min(len(samples) - 1, int(len(samples) * 0.99))]
+    print(f'{name:10} {len(samples):4}/{count}  one-way us: min {samples[0] / 2:7.0f}  '
+          f'median {statistics.median(samples) / 2:7.0f}  p99 {p99 / 2:7.0f}  max {samples[-1] / 2:7.0f}')
+
+
+def main():
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else 200
+
+    endpoint = EventEndpoint()
+    endpoint.open()
+    console = serial.Serial(CONSOLE_PORT, 115200, timeout=TIMEOUT)
+    console.reset_input_buffer()
+
+    results = {'endpoint': [], 'tty': []}
+    for _ in range(count):
+        rtt = ping_endpoint(endpoint)
+        if rtt is not None:
+            results['endpoint'].append(rtt)
+        rtt = ping_console(console)
+        if rtt is not None:
+            results['tty'].append(rtt)
+
+    print(f'Endpoint {endpoint.path}, console {CONSOLE_PORT}')
+    for name, samples in results.items():
+        report(name, samples, count)
+
+    endpoint.close()
+    console.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -4,17 +4,18 @@
 
 """
 RFID Service for STM32MP1 A7 Core
-Communicates with M4 core via /dev/ttyRPMSG0
+Receives scan events from the M4 core on its event endpoint
+(/dev/rpmsgN), answers on its console /dev/ttyRPMSG0
 Sends RFID data to backend API
 """
 
 import serial
 import requests
-import re
 import logging
 import time
 import json
 from datetime import datetime
+from rfid_events import EventEndpoint, EVENT_CARD, EVENT_REMOVED, EVENT_PONG, EVENT_NAK, uid_hex
 
 # Configuration
 SERIAL_PORT = '/dev/ttyRPMSG0'
@@ -35,32 +36,37 @@ logging.basicConfig(
 class RFIDService:
     def __init__(self):
         self.serial_conn = None
+        self.event_conn = None
         self.last_uid = None
         self.last_scan_time = 0
         self.debounce_seconds = 3  # Prevent duplicate scans within 3 seconds
         
     def connect_serial(self):
         """Connect to M4 core via virtual UART"""
+        # Reconnecting after an M4 restart: let go of the old handles first
+        if self.serial_conn:
+            self.serial_conn.close()
+            self.serial_conn = None
+        if self.event_conn:
+            self.event_conn.close()
         try:
             self.serial_conn = serial.Serial(
                 SERIAL_PORT,
                 BAUD_RATE,
                 timeout=1
             )
-            logging.info(f"Connected to {SERIAL_PORT}")
+            self.event_conn = EventEndpoint()
+            self.event_conn.open()
+            logging.info(f"Connected to {SERIAL_PORT} and {self.event_conn.path}")
             return True
         except Exception as e:
             logging.error(f"Failed to connect to serial: {e}")
             return False
     
-    def parse_uid(self, line):
-        """Extract UID from M4 output"""
-        # Look for "Card UID: 04 A1 B2 C3"
-        match = re.search(r'Card UID:\s+((?:[0-9A-F]{2}\s*)+)', line)
-        if match:
-            uid_bytes = match.group(1).strip().split()
-            uid = ''.join(uid_bytes)
-            return uid
+    def parse_uid(self, event):
+        """Extract UID from a scan event"""
+        if event.type == EVENT_CARD and event.uid:
+            return uid_hex(event.uid)
         return None
     
     def send_to_api(self, rfid_uid):
@@ -124,38 +130,40 @@ class RFIDService:
         
         while True:
             try:
-                if not self.serial_conn or not self.serial_conn.is_open:
+                if not self.event_conn or not self.event_conn.is_open:
                     if not self.connect_serial():
                         time.sleep(5)
                         continue
                 
-                # Read line from M4
-                if self.serial_conn.in_waiting > 0:
-                    line = self.serial_conn.readline().decode('utf-8', errors='ignore').strip()
+                # Wait for event frames from M4
+                for event in self.event_conn.read(timeout=1):
+                    # Log all events from M4
+                    logging.debug(f"M4: {event}")
                     
-                    if line:
-                        # Log all output from M4
-                        logging.debug(f"M4: {line}")
-                        
-                        # Check if this line contains a UID
-                        uid = self.parse_uid(line)
+                    if event.type == EVENT_REMOVED:
+                        logging.info(f"Card removed: {uid_hex(event.uid)}")
+                    
+                    # Check if this event carries a UID
+                    uid = self.parse_uid(event)
+                    
+                    if uid:
+                        logging.info(f"Detected RFID: {uid}")
                         
-                        if uid:
-                            logging.info(f"Detected RFID: {uid}")
+                        # Debounce: prevent rapid duplicate scans
+                        if self.should_process_scan(uid):
+                            # Send to API
+                            result = self.send_to_api(uid)
                             
-                            # Debounce: prevent rapid duplicate scans
-                            if self.should_process_scan(uid):
-                                # Send to API
-                                result = self.send_to_api(uid)
-                                
-                                if result:
-                                    action = result.get('action', 'unknown')
-                                    user_name = result.get('user', {}).get('name', 'Unknown')
-                                    logging.info(f"Action: {action} for {user_name}")
-                            else:
-                                logging.debug(f"Debounced duplicate scan of {uid}")
-                
-                time.sleep(0.01)  # Small delay to prevent CPU spinning
+                            if result:
+                                action = result.get('action', 'unknown')
+                                user_name = result.get('user', {}).get('name', 'Unknown')
+                                logging.info(f"Action: {action} for {user_name}")
+                        else:
+                            logging.debug(f"Debounced duplicate scan of {uid}")
+                    
+                    # Handled, the M4 need not replay it
+                    if event.type not in (EVENT_PONG, EVENT_NAK):
+                        self.event_conn.ack(event.seq)
                 
             except KeyboardInterrupt:
                 logging.info("Service stopped by user")
@@ -163,10 +171,15 @@ class RFIDService:
                 
             except Exception as e:
                 logging.error(f"Error in main loop: {e}")
+                # Reopen, the endpoint goes away when the M4 restarts
+                if self.event_conn:
+                    self.event_conn.close()
                 time.sleep(1)
         
         if self.serial_conn:
             self.serial_conn.close()
+        if self.event_conn:
+            self.event_conn.close()
         logging.info("RFID Service stopped")
 
 if __name__ == '__main__':
@@ -14,17 +14,14 @@ from kivy.clock import Clock
 from kivy.graphics import Color, Rectangle
 from kivy.core.window import Window
 
-import serial
 import requests
-import re
 import logging
 import threading
 from datetime import datetime
 from queue import Queue
+from rfid_events import EventEndpoint, EVENT_CARD, EVENT_PONG, EVENT_NAK, uid_hex
 
-# Configuration
-SERIAL_PORT = '/dev/ttyRPMSG0'
-BAUD_RATE = 115200
+# Configuration, events arrive on the M4 event endpoint (rfid_events.py)
 API_URL = 'http://10.10.2.66:5000/api/scan'
 API_TIMEOUT = 5
 
@@ -175,7 +172,7 @@ class RFIDApp(App):
     
     def __init__(self, **kwargs):
         super().__init__(**kwargs)
-        self.serial_conn = None
+        self.event_conn = None
         self.rfid_queue = Queue()
         self.last_uid = None
         self.last_scan_time = 0
@@ -198,30 +195,24 @@ class RFIDApp(App):
     def on_stop(self):
         """Cleanup on app close"""
         self.is_running = False
-        if self.serial_conn and self.serial_conn.is_open:
-            self.serial_conn.close()
+        if self.event_conn and self.event_conn.is_open:
+            self.event_conn.close()
     
-    def _connect_serial(self):
-        """Connect to M4 core"""
+    def _connect_events(self):
+        """Connect to the M4 event endpoint"""
         try:
-            self.serial_conn = serial.Serial(
-                SERIAL_PORT,
-                BAUD_RATE,
-                timeout=1
-            )
-            logging.info(f"Connected to {SERIAL_PORT}")
+            self.event_conn = EventEndpoint()
+            self.event_conn.open()
+            logging.info(f"Connected to {self.event_conn.path}")
             return True
         except Exception as e:
-            logging.error(f"Failed to connect to serial: {e}")
+            logging.error(f"Failed to connect to the event endpoint: {e}")
             return False
     
-    def _parse_uid(self, line):
-        """Extract UID from M4 output"""
-        match = re.search(r'Card UID:\s+((?:[0-9A-F]{2}\s*)+)', line)
-        if match:
-            uid_bytes = match.group(1).strip().split()
-            uid = ''.join(uid_bytes)
-            return uid
+    def _parse_uid(self, event):
+        """Extract UID from a scan event"""
+        if event.type == EVENT_CARD and event.uid:
+            return uid_hex(event.uid)
         return None
     
     def _should_process_scan(self, uid):
@@ -265,32 +256,35 @@ class RFIDApp(App):
         
         while self.is_running:
             try:
-                if not self.serial_conn or not self.serial_conn.is_open:
-                    if not self._connect_serial():
+                if not self.event_conn or not self.event_conn.is_open:
+                    if not self._connect_events():
                         time.sleep(5)
                         continue
                 
-                if self.serial_conn.in_waiting > 0:
-                    line = self.serial_conn.readline().decode('utf-8', errors='ignore').strip()
+                # Blocks until the M4 sends, the timeout lets is_running be seen
+                for event in self.event_conn.read(timeout=1):
+                    logging.debug(f"M4: {event}")
                     
-                    if line:
-                        logging.debug(f"M4: {line}")
-                        
-                        uid = self._parse_uid(line)
+                    uid = self._parse_uid(event)
+                    
+                    if uid:
+                        logging.info(f"Detected RFID: {uid}")
                         
-                        if uid:
-                            logging.info(f"Detected RFID: {uid}")
-                            
-                            if self._should_process_scan(uid):
-                                # Put in queue for main thread to process
-                                self.rfid_queue.put(('scan', uid))
-                            else:
-                                logging.debug(f"Debounced duplicate scan of {uid}")
-                
-                time.sleep(0.01)
+                        if self._should_process_scan(uid):
+                            # Put in queue for main thread to process
+                            self.rfid_queue.put(('scan', uid))
+                        else:
+                            logging.debug(f"Debounced duplicate scan of {uid}")
+                    
+                    # Handled, the M4 need not replay it
+                    if event.type not in (EVENT_PONG, EVENT_NAK):
+                        self.event_conn.ack(event.seq)
                 
             except Exception as e:
                 logging.error(f"Error in RFID thread: {e}")
+                # Reopen, the endpoint goes away when the M4 restarts
+                if self.event_conn:
+                    self.event_conn.close()
                 time.sleep(1)
     
     def _check_queue(self, dt):
@@ -59,6 +59,9 @@ void Error_Handler(void);
 /* Private defines -----------------------------------------------------------*/
 
 /* USER CODE BEGIN Private defines */
+#define RFID_IRQ_Pin GPIO_PIN_13
+#define RFID_IRQ_GPIO_Port GPIOD
+#define RFID_IRQ_EXTI_IRQn EXTI13_IRQn
 
 /* USER CODE END Private defines */
 
@@ -49,6 +49,8 @@
 #define MFRC522_REG_T_COUNTER_VAL_L 0x2F
 #define MFRC522_REG_VERSION       0x37
 
+#define MFRC522_FIFO_SIZE         64
+
 /* MFRC522 Commands */
 #define MFRC522_CMD_IDLE          0x00
 #define MFRC522_CMD_MEM           0x01
@@ -73,14 +75,40 @@
 #define PICC_CMD_MF_AUTH_KEY_B    0x61
 #define PICC_CMD_MF_READ          0x30
 #define PICC_CMD_MF_WRITE         0xA0
+#define PICC_CMD_UL_GET_VERSION   0x60  // Ultralight EV1 / NTAG, same code as AUTH key A
+#define PICC_CMD_UL_FAST_READ     0x3A
+#define PICC_CMD_RATS             0xE0
+#define PICC_CMD_PPS              0xD0  // PPSS, CID 0
+
+/* Type 2 tags: 4-byte pages, READ returns 4 of them */
+#define MFRC522_PAGE_SIZE         4
+#define MFRC522_UL_PAGES          16    // Ultralight without GET_VERSION
+/* Pages per FAST_READ frame, the answer streams through the FIFO */
+#define MFRC522_FAST_READ_PAGES   32
+
+/* FIFO level that triggers a refill (transmit) or a drain (receive) of frames
+ * longer than the FIFO, see MFRC522_TransceiveLong */
+#define MFRC522_WATER_LEVEL       16
+
+/* ISO/IEC 14443-4 */
+#define MFRC522_ISODEP_FSDI       8     // We accept frames of up to 256 bytes
+#define MFRC522_ISODEP_FSD        256
+#define MFRC522_ISODEP_ATS_MAX    32
+#define MFRC522_ISODEP_RETRIES    2     // R(NAK) or retransmissions per block before giving up
+#define MFRC522_SEQ_RETRIES       2     // Steps repeated after RF errors per sequence
 
 /* Status codes */
 typedef enum {
     MFRC522_OK = 0,
-    MFRC522_NOTAGERR,
-    MFRC522_ERR,
-    MFRC522_TIMEOUT,
-    MFRC522_COLLISION
+    MFRC522_NOTAGERR,       // No answer before the chip timer ran out
+    MFRC522_ERR,            // Unexpected answer (NAK, wrong state) or bad arguments
+    MFRC522_TIMEOUT,        // The chip did not finish the command
+    MFRC522_COLLISION,      // CollErr: several cards answered
+    MFRC522_PARITY_ERR,     // ParityErr in the answer
+    MFRC522_CRC_ERR,        // CRC_A (or BCC) of the answer does not match
+    MFRC522_OVERFLOW,       // BufferOvfl, or an answer longer than the buffer
+    MFRC522_PROTOCOL_ERR,   // ProtocolErr, or an answer of the wrong length
+    MFRC522_STATUS_COUNT
 } MFRC522_Status_t;
 
 /* MIFARE Card types */
@@ -92,6 +120,7 @@ typedef enum {
     PICC_TYPE_MIFARE_UL,
     PICC_TYPE_MIFARE_PLUS,
     PICC_TYPE_TNP3XXX,
+    PICC_TYPE_ISO_14443_4,      // ISO-DEP, e.g. DESFire
     PICC_TYPE_NOT_COMPLETE
 } PICC_Type_t;
 
@@ -102,6 +131,167 @@ typedef struct {
     uint8_t sak;
 } Uid_t;
 
+/* Transceive completion modes */
+typedef enum {
+    MFRC522_WAIT_POLL = 0,  // Busy-poll COMM_IRQ over SPI
+    MFRC522_WAIT_IRQ        // Sleep until the IRQ pin fires (EXTI)
+} MFRC522_WaitMode_t;
+
+/* CRC_A sources */
+typedef enum {
+    MFRC522_CRC_SOFTWARE = 0,  // Table-driven on the M4
+    MFRC522_CRC_CHIP           // CalcCRC command on the MFRC522
+} MFRC522_CrcMode_t;
+
+/* ISO/IEC 14443 type A bit rates, TxSpeed/RxSpeed encoding */
+typedef enum {
+    MFRC522_BITRATE_106 = 0,
+    MFRC522_BITRATE_212,
+    MFRC522_BITRATE_424,
+    MFRC522_BITRATE_848
+} MFRC522_BitRate_t;
+
+/* Frame wait time profiles loaded into the chip timer */
+typedef enum {
+    MFRC522_FWT_SHORT = 0,  // REQA, WUPA, HLTA
+    MFRC522_FWT_MEDIUM,     // Anticollision, SELECT, AUTH, READ
+    MFRC522_FWT_LONG        // WRITE, the PICC programs EEPROM before its ACK
+} MFRC522_Fwt_t;
+
+#define MFRC522_KEYS_MAX        8     // Keys in the dictionary
+#define MFRC522_KEY_SLOTS       4     // Preferred keys per sector
+#define MFRC522_SECTORS_MAX     40    // MIFARE Classic 4K
+#define MFRC522_KEY_CACHE_SIZE  8     // Cards whose working keys are remembered
+#define MFRC522_KEY_NONE        0xFF  // Empty slot, unknown key
+
+/* One dictionary key */
+typedef struct {
+    uint8_t authMode;           // PICC_CMD_MF_AUTH_KEY_A or PICC_CMD_MF_AUTH_KEY_B
+    uint8_t key[6];
+} MFRC522_Key_t;
+
+/* Key dictionary. A sector tries its slots first, then falls back to the
+ * other keys in dictionary order. */
+typedef struct {
+    MFRC522_Key_t keys[MFRC522_KEYS_MAX];
+    uint8_t count;
+    uint8_t slots[MFRC522_SECTORS_MAX][MFRC522_KEY_SLOTS];  // Dictionary indices, MFRC522_KEY_NONE for empty
+} MFRC522_KeyTable_t;
+
+/* Dictionary index that opened each sector of one card */
+typedef struct {
+    uint8_t uidSize;            // 0 for a free entry
+    uint8_t uidByte[10];
+    uint8_t keyIndex[MFRC522_SECTORS_MAX];  // MFRC522_KEY_NONE while unknown
+    uint32_t lastUse;
+} MFRC522_KeyCacheEntry_t;
+
+/* Least recently used cards and the keys that worked for them, so a card
+ * seen before authenticates on the first try */
+typedef struct {
+    MFRC522_KeyCacheEntry_t entries[MFRC522_KEY_CACHE_SIZE];
+    uint32_t clock;
+    uint32_t hits;              // AUTHs that succeeded with the remembered key
+    uint32_t misses;            // AUTHs with nothing remembered, or a stale key
+} MFRC522_KeyCache_t;
+
+/* Steps of the asynchronous card sequence */
+typedef enum {
+    MFRC522_STEP_IDLE = 0,
+    MFRC522_STEP_REQUEST,
+    MFRC522_STEP_ANTICOLL,
+    MFRC522_STEP_SELECT,
+    MFRC522_STEP_AUTH,
+    MFRC522_STEP_READ,
+    MFRC522_STEP_DONE
+} MFRC522_Step_t;
+
+/* Steps to run, in this order */
+#define MFRC522_SEQ_REQUEST   0x01  // REQA/WUPA
+#define MFRC522_SEQ_ANTICOLL  0x02  // All cascade levels, intermediate SELECTs included
+#define MFRC522_SEQ_SELECT    0x04  // SELECT of the last cascade level
+#define MFRC522_SEQ_AUTH      0x08  // MIFARE Classic authentication of blockAddr
+#define MFRC522_SEQ_READ      0x10  // 16-byte READ of blockAddr
+
+/* Asynchronous REQA -> anticoll -> select -> auth -> read sequence.
+ * Fill in the inputs, start it with MFRC522_SeqStart and call MFRC522_Poll
+ * until step is MFRC522_STEP_DONE. */
+typedef struct {
+    uint8_t steps;              // MFRC522_SEQ_* mask
+    uint8_t reqMode;            // PICC_CMD_REQA or PICC_CMD_WUPA
+    uint8_t authMode;           // PICC_CMD_MF_AUTH_KEY_A or PICC_CMD_MF_AUTH_KEY_B
+    uint8_t blockAddr;
+    const uint8_t *key;         // 6-byte MIFARE key
+    Uid_t uid;                  // Input when ANTICOLL is not part of the sequence
+    const Uid_t *skipUids;      // Optional: known cards, their sequence ends after SELECT
+    uint8_t skipCount;
+    uint8_t atqa[2];
+    uint8_t data[16];           // READ result
+    uint8_t completed;          // MFRC522_SEQ_* steps that succeeded
+    MFRC522_Status_t status;    // Overall result once done
+    MFRC522_Step_t step;
+    // Progress, owned by the driver
+    bool busy;                  // A frame is in flight
+    uint8_t level;              // Cascade level being resolved
+    uint8_t knownBits;          // UID bits of that level known so far
+    uint8_t frame[9];           // SEL, NVB, UID CLn, BCC, CRC_A
+    // Dictionary AUTH: with keys set, key and authMode are picked from it and
+    // every failed AUTH re-selects the card (WUPA, SELECT of its UID) and
+    // tries the next key
+    const MFRC522_KeyTable_t *keys;
+    MFRC522_KeyCache_t *cache;  // Optional
+    uint8_t keyIndex;           // Dictionary index that opened the sector
+    uint8_t keyOrder[MFRC522_KEYS_MAX];
+    uint8_t keyCount;
+    uint8_t keyTry;
+    uint8_t retries;            // RF errors recovered from, up to MFRC522_SEQ_RETRIES
+    uint8_t reselect;           // Frame of the re-selection after an error, 0 when none runs
+} MFRC522_Seq_t;
+
+/* MIFARE Classic card session: the card stays selected and one Crypto1
+ * session is kept per sector, blocks of the open sector need no new AUTH */
+typedef struct {
+    Uid_t uid;
+    uint8_t atqa[2];
+    uint8_t authMode;           // PICC_CMD_MF_AUTH_KEY_A or PICC_CMD_MF_AUTH_KEY_B
+    const uint8_t *key;         // 6-byte MIFARE key, used for every sector
+    const MFRC522_KeyTable_t *keys;  // Replaces authMode/key when set
+    MFRC522_KeyCache_t *cache;
+    int16_t authSector;         // Sector with an open Crypto1 session, -1 when none
+    bool needSelect;            // A failed AUTH or READ sent the card back to IDLE
+    uint16_t auths;             // Authentications run since MFRC522_SessionBegin
+    uint16_t blocksRead;
+} MFRC522_Session_t;
+
+/* ISO-DEP link to one card, from RATS to S(DESELECT). Owns the block
+ * buffer, so keep it static rather than on the stack. */
+typedef struct {
+    uint8_t ats[MFRC522_ISODEP_ATS_MAX];
+    uint8_t atsLen;
+    uint16_t fsc;               // Largest frame the card accepts, CRC_A included
+    uint32_t fwtUs;             // Frame waiting time from FWI
+    MFRC522_BitRate_t txRate;   // Reader to card (DRI), after PPS
+    MFRC522_BitRate_t rxRate;   // Card to reader (DSI)
+    uint8_t blockNum;           // Block number of the next I-block
+    bool active;
+    uint16_t wtx;               // Waiting time extensions granted
+    uint16_t retries;           // Blocks sent again after an error
+    uint8_t frame[MFRC522_ISODEP_FSD];
+} MFRC522_IsoDep_t;
+
+/* SPI traffic and RF error counters */
+typedef struct {
+    uint32_t spiTransactions;  // CS-framed transfers
+    uint32_t spiBytes;         // Bytes clocked on the bus
+    uint32_t spiCycles;        // CPU cycles from CS low to CS high
+    uint32_t idleCycles;       // Cycles handed to the idle hook while waiting
+    uint32_t crcCycles;        // CPU cycles spent computing CRC_A
+    uint32_t cacheHits;        // Register reads and writes served by the shadow cache
+    uint32_t rfErrors[MFRC522_STATUS_COUNT];  // Failed frames by status; NOTAGERR only once a card answered
+    uint32_t retries;          // Steps and ISO-DEP blocks repeated after an RF error
+    uint32_t recovered;        // Sequences that succeeded after a retry
+} MFRC522_Stats_t;
+
 /* Configuration structure */
 typedef struct {
     SPI_HandleTypeDef *hspi;
@@ -109,33 +299,142 @@ typedef struct {
     uint16_t CS_Pin;
     GPIO_TypeDef *RST_GPIO_Port;
     uint16_t RST_Pin;
+    GPIO_TypeDef *IRQ_GPIO_Port;  // NULL if the IRQ pin is not wired
+    uint16_t IRQ_Pin;
 } MFRC522_Config_t;
 
+/* One reader: its wiring plus all driver state, so several MFRC522 can
+ * share an SPI bus with their own CS/RST/IRQ pins */
+typedef struct {
+    MFRC522_Config_t config;
+    MFRC522_WaitMode_t waitMode;
+    volatile uint8_t irqFlag;
+    bool useDma;
+    MFRC522_CrcMode_t crcMode;
+    bool poweredDown;
+    MFRC522_Stats_t stats;
+    // Shadow copy of configuration registers that only change through our writes
+    uint8_t shadow[0x40];
+    uint64_t shadowValid;
+    // Command in flight on the chip
+    uint8_t cmdCommand;
+    uint8_t cmdIrqEn;
+    uint8_t cmdWaitIRq;
+    uint8_t cmdIrq;             // Last COMM_IRQ value read while polling
+    uint32_t cmdStart;
+    MFRC522_Seq_t *seq;         // Sequence advanced by MFRC522_Poll, NULL when none
+} MFRC522_Handle_t;
+
+#define MFRC522_SCHED_MAX_READERS 4
+
+/* Round-robin probe slots for readers sharing one SPI bus. Every reader
+ * gets one slot per period whatever the reader count, so its detection
+ * latency stays at about one period as long as the slots fit. */
+typedef struct {
+    MFRC522_Handle_t *readers[MFRC522_SCHED_MAX_READERS];
+    uint8_t count;
+    uint8_t next;               // Reader owning the next slot
+    uint32_t periodMs;          // Time between two slots of the same reader
+    uint32_t nextSlot;          // Tick of the next slot
+    uint32_t lastSlot[MFRC522_SCHED_MAX_READERS];
+    uint32_t maxGapMs[MFRC522_SCHED_MAX_READERS];  // Worst slot-to-slot gap per reader
+} MFRC522_Sched_t;
+
 /* Function prototypes */
-void MFRC522_Init(MFRC522_Config_t *config);
-void MFRC522_Reset(void);
-bool MFRC522_Check(uint8_t *version);
-void MFRC522_AntennaOn(void);
-void MFRC522_AntennaOff(void);
-
-MFRC522_Status_t MFRC522_Request(uint8_t reqMode, uint8_t *tagType);
-MFRC522_Status_t MFRC522_Anticoll(Uid_t *uid);
-MFRC522_Status_t MFRC522_SelectTag(Uid_t *uid);
-MFRC522_Status_t MFRC522_Auth(uint8_t authMode, uint8_t blockAddr, uint8_t *key, Uid_t *uid);
-MFRC522_Status_t MFRC522_Read(uint8_t blockAddr, uint8_t *recvData);
-MFRC522_Status_t MFRC522_Write(uint8_t blockAddr, uint8_t *writeData);
-void MFRC522_Halt(void);
+void MFRC522_Init(MFRC522_Handle_t *dev, const MFRC522_Config_t *config);
+void MFRC522_Reset(MFRC522_Handle_t *dev);
+bool MFRC522_Check(MFRC522_Handle_t *dev, uint8_t *version);
+bool MFRC522_SpiTest(MFRC522_Handle_t *dev, uint16_t iterations);
+void MFRC522_AntennaOn(MFRC522_Handle_t *dev);
+void MFRC522_AntennaOff(MFRC522_Handle_t *dev);
+void MFRC522_SoftPowerDown(MFRC522_Handle_t *dev);
+void MFRC522_SoftWakeUp(MFRC522_Handle_t *dev);
+bool MFRC522_IsPoweredDown(MFRC522_Handle_t *dev);
+bool MFRC522_ProbePresence(MFRC522_Handle_t *dev);
+
+void MFRC522_SetWaitMode(MFRC522_Handle_t *dev, MFRC522_WaitMode_t mode);
+MFRC522_WaitMode_t MFRC522_GetWaitMode(MFRC522_Handle_t *dev);
+void MFRC522_IRQHandler(MFRC522_Handle_t *dev);
+
+void MFRC522_SetDMA(MFRC522_Handle_t *dev, bool enable);
+bool MFRC522_GetDMA(MFRC522_Handle_t *dev);
+void MFRC522_SetIdleHook(void (*hook)(void));
+void MFRC522_SPI_CpltHandler(SPI_HandleTypeDef *hspi);
+void MFRC522_SPI_ErrorHandler(SPI_HandleTypeDef *hspi);
+
+MFRC522_Status_t MFRC522_Request(MFRC522_Handle_t *dev, uint8_t reqMode, uint8_t *tagType);
+MFRC522_Status_t MFRC522_Anticoll(MFRC522_Handle_t *dev, Uid_t *uid);
+MFRC522_Status_t MFRC522_SelectTag(MFRC522_Handle_t *dev, Uid_t *uid);
+MFRC522_Status_t MFRC522_Auth(MFRC522_Handle_t *dev, uint8_t authMode, uint8_t blockAddr, uint8_t *key, Uid_t *uid);
+MFRC522_Status_t MFRC522_Read(MFRC522_Handle_t *dev, uint8_t blockAddr, uint8_t *recvData);
+MFRC522_Status_t MFRC522_Write(MFRC522_Handle_t *dev, uint8_t blockAddr, uint8_t *writeData);
+void MFRC522_Halt(MFRC522_Handle_t *dev);
+uint8_t MFRC522_Inventory(MFRC522_Handle_t *dev, Uid_t *uids, uint8_t maxCards);
+bool MFRC522_CheckCard(MFRC522_Handle_t *dev, const Uid_t *uid);
+void MFRC522_HaltCard(MFRC522_Handle_t *dev, const Uid_t *uid);
+MFRC522_Status_t MFRC522_SessionBegin(MFRC522_Handle_t *dev, MFRC522_Session_t *sess, uint8_t reqMode,
+                                      uint8_t authMode, const uint8_t *key);
+MFRC522_Status_t MFRC522_SessionReadBlock(MFRC522_Handle_t *dev, MFRC522_Session_t *sess, uint8_t blockAddr,
+                                          uint8_t *recvData);
+MFRC522_Status_t MFRC522_SessionReadSector(MFRC522_Handle_t *dev, MFRC522_Session_t *sess, uint8_t sector,
+                                           uint8_t *recvData);
+MFRC522_Status_t MFRC522_SessionWriteBlock(MFRC522_Handle_t *dev, MFRC522_Session_t *sess, uint8_t blockAddr,
+                                           uint8_t *writeData);
+void MFRC522_SessionUseKeys(MFRC522_Session_t *sess, const MFRC522_KeyTable_t *keys, MFRC522_KeyCache_t *cache);
+void MFRC522_SessionEnd(MFRC522_Handle_t *dev, MFRC522_Session_t *sess);
+void MFRC522_SeqStart(MFRC522_Handle_t *dev, MFRC522_Seq_t *seq);
+MFRC522_Step_t MFRC522_Poll(MFRC522_Handle_t *dev);
+void MFRC522_Abort(MFRC522_Handle_t *dev);
+MFRC522_Status_t MFRC522_RunSequence(MFRC522_Handle_t *dev, MFRC522_Seq_t *seq);
+
+void MFRC522_KeyTableInit(MFRC522_KeyTable_t *table);
+int8_t MFRC522_KeyTableSet(MFRC522_KeyTable_t *table, uint8_t index, uint8_t authMode, const uint8_t *key);
+bool MFRC522_KeyTableSetSlots(MFRC522_KeyTable_t *table, uint8_t sector, const uint8_t *indices, uint8_t count);
+void MFRC522_KeyCacheInit(MFRC522_KeyCache_t *cache);
+
+void MFRC522_SchedInit(MFRC522_Sched_t *sched, uint32_t periodMs);
+bool MFRC522_SchedAdd(MFRC522_Sched_t *sched, MFRC522_Handle_t *dev);
+int8_t MFRC522_SchedNext(MFRC522_Sched_t *sched);
+void MFRC522_SchedResetStats(MFRC522_Sched_t *sched);
 
 PICC_Type_t MFRC522_GetType(uint8_t sak);
 const char* MFRC522_GetTypeName(PICC_Type_t type);
+const char* MFRC522_GetStatusName(MFRC522_Status_t status);
+uint16_t MFRC522_GetBlockCount(PICC_Type_t type);
+uint8_t MFRC522_GetSupportedSteps(PICC_Type_t type);
+MFRC522_Status_t MFRC522_GetVersion(MFRC522_Handle_t *dev, uint8_t *version);
+uint16_t MFRC522_GetPageCount(const uint8_t *version);
+MFRC522_Status_t MFRC522_FastRead(MFRC522_Handle_t *dev, uint8_t startPage, uint8_t endPage, uint8_t *recvData);
+MFRC522_Status_t MFRC522_IsoDepActivate(MFRC522_Handle_t *dev, MFRC522_IsoDep_t *iso, MFRC522_BitRate_t maxRate);
+MFRC522_Status_t MFRC522_IsoDepTransceive(MFRC522_Handle_t *dev, MFRC522_IsoDep_t *iso, const uint8_t *apdu,
+                                          uint16_t apduLen, uint8_t *resp, uint16_t respMax, uint16_t *respLen);
+void MFRC522_IsoDepDeselect(MFRC522_Handle_t *dev, MFRC522_IsoDep_t *iso);
+uint8_t MFRC522_SectorOfBlock(uint8_t blockAddr);
+uint8_t MFRC522_SectorFirstBlock(uint8_t sector);
+uint8_t MFRC522_SectorBlockCount(uint8_t sector);
+
+const MFRC522_Stats_t* MFRC522_GetStats(MFRC522_Handle_t *dev);
+void MFRC522_ResetStats(MFRC522_Handle_t *dev);
 
 /* Low-level functions */
-void MFRC522_WriteRegister(uint8_t reg, uint8_t value);
-uint8_t MFRC522_ReadRegister(uint8_t reg);
-void MFRC522_SetBitMask(uint8_t reg, uint8_t mask);
-void MFRC522_ClearBitMask(uint8_t reg, uint8_t mask);
-MFRC522_Status_t MFRC522_ToCard(uint8_t command, uint8_t *sendData, uint8_t sendLen,
+void MFRC522_WriteRegister(MFRC522_Handle_t *dev, uint8_t reg, uint8_t value);
+uint8_t MFRC522_ReadRegister(MFRC522_Handle_t *dev, uint8_t reg);
+void MFRC522_WriteFIFO(MFRC522_Handle_t *dev, const uint8_t *data, uint8_t len);
+void MFRC522_ReadFIFO(MFRC522_Handle_t *dev, uint8_t *data, uint8_t len);
+void MFRC522_ReadRegisters(MFRC522_Handle_t *dev, const uint8_t *regs, uint8_t *values, uint8_t count);
+void MFRC522_SetBitMask(MFRC522_Handle_t *dev, uint8_t reg, uint8_t mask);
+void MFRC522_ClearBitMask(MFRC522_Handle_t *dev, uint8_t reg, uint8_t mask);
+void MFRC522_SetFWT(MFRC522_Handle_t *dev, MFRC522_Fwt_t fwt);
+void MFRC522_SetFWTUs(MFRC522_Handle_t *dev, uint32_t us);
+void MFRC522_SetBitRate(MFRC522_Handle_t *dev, MFRC522_BitRate_t txRate, MFRC522_BitRate_t rxRate);
+MFRC522_Status_t MFRC522_ToCard(MFRC522_Handle_t *dev, uint8_t command, uint8_t *sendData, uint8_t sendLen,
                                  uint8_t *backData, uint16_t *backLen);
-void MFRC522_CalculateCRC(uint8_t *data, uint8_t len, uint8_t *result);
+MFRC522_Status_t MFRC522_TransceiveLong(MFRC522_Handle_t *dev, const uint8_t *sendData, uint16_t sendLen,
+                                        uint8_t *backData, uint16_t backMax, uint16_t *backLen);
+void MFRC522_CalculateCRC(MFRC522_Handle_t *dev, uint8_t *data, uint8_t len, uint8_t *result);
+void MFRC522_CalculateCRC_Software(const uint8_t *data, uint16_t len, uint8_t *result);
+void MFRC522_CalculateCRC_Chip(MFRC522_Handle_t *dev, const uint8_t *data, uint8_t len, uint8_t *result);
+void MFRC522_SetCRCMode(MFRC522_Handle_t *dev, MFRC522_CrcMode_t mode);
+MFRC522_CrcMode_t MFRC522_GetCRCMode(MFRC522_Handle_t *dev);
 
 #endif /* MFRC522_H */
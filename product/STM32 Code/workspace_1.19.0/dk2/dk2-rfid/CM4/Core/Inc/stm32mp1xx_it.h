@@ -59,6 +59,10 @@ void IPCC_RX1_IRQHandler(void);
 void IPCC_TX1_IRQHandler(void);
 void RCC_WAKEUP_IRQHandler(void);
 /* USER CODE BEGIN EFP */
+void EXTI13_IRQHandler(void);
+void DMA2_Stream0_IRQHandler(void);
+void DMA2_Stream1_IRQHandler(void);
+void SPI5_IRQHandler(void);
 
 /* USER CODE END EFP */
 
@@ -23,6 +23,7 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include <string.h>
+#include <stddef.h>
 #include "virt_uart.h"
 #include <stdio.h>
 #include <stdarg.h>
@@ -31,6 +32,23 @@
 
 /* Private typedef -----------------------------------------------------------*/
 /* USER CODE BEGIN PTD */
+// Cards per reader whose presence is followed after they were reported
+#define TRACKED_CARDS 8
+// Event frame: sync, version, length, 14 fixed bytes, UID, blocks, CRC_A
+#define EVENT_SYNC 0xA5
+#define EVENT_VERSION 2
+#define EVENT_HEADER_LEN 18
+// Largest sector, MIFARE Classic 4K sectors 32-39
+#define EVENT_MAX_BLOCKS 16
+#define EVENT_FRAME_MAX (EVENT_HEADER_LEN + 10 + 2 + EVENT_MAX_BLOCKS * 16 + 2)
+// Events kept until the A7 acknowledges them
+#define EVENT_RING_SIZE 32
+// Commands from the event endpoint waiting for the main loop
+#define EPT_CMD_QUEUE 4
+// Event store in RETRAM, "EVNT"; a new version drops what an older firmware left
+#define EVENT_STORE_MAGIC 0x45564E54
+#define EVENT_STORE_VERSION 1
+
 typedef enum {
     CMD_NONE = 0,
     CMD_READ_CARD,
@@ -39,11 +57,82 @@ typedef enum {
     CMD_WRITE_BLOCK,
     CMD_READ_BLOCK
 } Command_t;
+
+// How much of a card the auto-scan and scan read before reporting it
+typedef enum {
+    SCAN_PROFILE_UID = 0,     // REQA, anticoll, select, HLTA: enough for attendance
+    SCAN_PROFILE_BLOCK,       // Plus AUTH and READ of scanBlock
+    SCAN_PROFILE_SECTOR       // Plus every block of scanSector, one AUTH
+} ScanProfile_t;
+
+// Binary event frames on the event endpoint, see SendEvent
+typedef enum {
+    EVENT_CARD = 1,           // Card scanned: UID, SAK, status and the blocks the profile read
+    EVENT_REMOVED = 2,        // A reported card left the field
+    EVENT_PONG = 3,           // Answer to ping on the event endpoint, for latency tests; not kept
+    EVENT_NAK = 4             // Endpoint command dropped, EPT_CMD_QUEUE were waiting; not kept
+} EventType_t;
+
+// Encoded event frame waiting in the ring for its acknowledgement
+typedef struct {
+    uint16_t len;
+    uint8_t frame[EVENT_FRAME_MAX];
+} EventSlot_t;
+
+// Ring bookkeeping, rewritten with its CRC_A whenever an event is queued or acknowledged
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t slots;
+    uint16_t slotSize;
+    uint16_t reserved;
+    uint32_t next;
+    uint32_t oldest;
+    uint32_t lost;
+    uint8_t crc[2];           // Of the fields above
+} EventStoreHeader_t;
+
+// Event ring that outlives an M4 restart, see EventStoreLoad
+typedef struct {
+    EventStoreHeader_t header;
+    EventSlot_t ring[EVENT_RING_SIZE];
+} EventStore_t;
+
+// One reader on the shared SPI bus and its auto-scan progress
+typedef struct {
+    MFRC522_Handle_t dev;
+    const char *name;
+    MFRC522_Seq_t seq;        // Asynchronous scan advanced from the main loop
+    uint8_t scanActive;
+    uint8_t scanCards;
+    uint8_t cardInField;      // Low power: full-rate scanning until the card leaves
+    Uid_t tracked[TRACKED_CARDS];  // Cards reported and not seen leaving yet
+    uint8_t trackedCount;
+    uint8_t spiAbsent;        // Failed the SPI link test even at the slowest rate
+} RfidReader_t;
 /* USER CODE END PTD */
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
 #define RX_BUFFER_SIZE 256
+#define BENCH_ITERATIONS 20
+#define MAX_CARDS_PER_SCAN 4
+#define DUMP_MAX_BLOCKS 256
+#define DUMP_MAX_SECTORS 40
+// Longest command APDU that fits a command line as hex
+#define APDU_MAX_LEN ((RX_BUFFER_SIZE - 5) / 2)
+#define RFID_READER_COUNT 1
+#define SCAN_INTERVAL_MS 100
+// Boot-time SPI calibration: link test runs per prescaler step, MFRC522 limit
+#define SPI_CAL_ITERATIONS 100
+#define SPI_MAX_HZ 10000000
+// Every step a scan can take; ScanSeqInit drops what the scan profile does not need
+#define SCAN_STEPS (MFRC522_SEQ_REQUEST | MFRC522_SEQ_ANTICOLL | MFRC522_SEQ_SELECT | \
+                    MFRC522_SEQ_AUTH | MFRC522_SEQ_READ)
+// Event endpoint; Linux binds its rpmsg char driver to this name, /dev/rpmsgN
+#define EVENT_SERVICE_NAME "rpmsg-raw"
+// Console output sent as one RPMsg message: the 512-byte buffer minus its header
+#define CONSOLE_BUF_SIZE (512 - 16)
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -57,21 +146,97 @@ IPCC_HandleTypeDef hipcc;
 SPI_HandleTypeDef hspi5;
 
 /* USER CODE BEGIN PV */
+DMA_HandleTypeDef hdma_spi5_rx;
+DMA_HandleTypeDef hdma_spi5_tx;
 VIRT_UART_HandleTypeDef huart0;
-MFRC522_Config_t mfrc522;
+// Event frames out, commands in, without the TTY layer of huart0
+struct rpmsg_endpoint eventEpt;
+RfidReader_t readers[RFID_READER_COUNT];
+MFRC522_Sched_t scanSched;
+// Reader that commands act on, see reader:N
+RfidReader_t *cmdReader = &readers[0];
+MFRC522_Handle_t *rfid = &readers[0].dev;
 Uid_t uid;
-uint8_t keyA[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+// Key dictionary: transport and well-known MAD/NDEF keys; site keys are
+// added here or at run time with key:N:A|B:KEY
+const MFRC522_Key_t defaultKeys[] = {
+    {PICC_CMD_MF_AUTH_KEY_A, {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}},
+    {PICC_CMD_MF_AUTH_KEY_A, {0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5}},
+    {PICC_CMD_MF_AUTH_KEY_A, {0xD3, 0xF7, 0xD3, 0xF7, 0xD3, 0xF7}},
+    {PICC_CMD_MF_AUTH_KEY_A, {0x00, 0x00, 0x00, 0x00, 0x00, 0x00}},
+};
+MFRC522_KeyTable_t keyTable;
+// Key that worked per card and sector, so repeat visitors need one AUTH
+MFRC522_KeyCache_t keyCache;
 uint8_t readBuffer[18];
+// Whole card read by the dump command before it is sent, up to MIFARE Classic 4K
+uint8_t dumpBuffer[DUMP_MAX_BLOCKS * 16];
+// ISO-DEP link of the apdu command, holds a 256-byte block buffer
+MFRC522_IsoDep_t isoDep;
 
 // Command processing variables
 volatile Command_t pendingCommand = CMD_NONE;
 char rxBuffer[RX_BUFFER_SIZE];
 volatile uint16_t rxIndex = 0;
 volatile uint8_t commandReady = 0;
+// A finished console line waits in consoleLine and runs from consoleCmd. Both
+// are apart from rxBuffer: the console callback also runs while a command
+// waits on the SPI bus, and keeps filling rxBuffer then.
+char consoleLine[RX_BUFFER_SIZE];
+char consoleCmd[RX_BUFFER_SIZE];
+// A line was finished while another one still waited, it was not run
+volatile uint8_t consoleDropped = 0;
+// The running command came from the event endpoint instead of the console
+uint8_t cmdFromEndpoint = 0;
+// Endpoint commands, run in order after any console command. Their own
+// buffers: the callback also runs while a command waits on the SPI bus.
+char eptCmdQueue[EPT_CMD_QUEUE][RX_BUFFER_SIZE];
+volatile uint8_t eptCmdHead = 0;
+volatile uint8_t eptCmdTail = 0;
 
 // Additional command parameters
 uint8_t cmdBlockAddr = 4;
 uint8_t cmdWriteData[16];
+
+// Scan profile, set with profile:uid|block:N|sector:S
+ScanProfile_t scanProfile = SCAN_PROFILE_BLOCK;
+uint8_t scanBlock = 4;
+uint8_t scanSector = 1;
+
+// Blocks the last scan read, sent with its event
+uint8_t scanData[EVENT_MAX_BLOCKS * 16];
+// Pong frames, they bypass the ring
+uint8_t eventFrame[EVENT_FRAME_MAX];
+// RETRAM past the vector table, defined by the linker script; loader and startup code leave it alone
+extern int __EVENT_STORE_region_start__[];
+extern int __EVENT_STORE_region_end__[];
+EventStore_t *const eventStore = (EventStore_t *)__EVENT_STORE_region_start__;
+// Event ring, slot seq % EVENT_RING_SIZE. Sequence numbers from eventOldest
+// to eventNext - 1 are unacknowledged, from eventSent on not sent yet.
+// A slot with len 0 did not survive a restart and is skipped.
+EventSlot_t *const eventRing = eventStore->ring;
+uint32_t eventNext = 1;
+volatile uint32_t eventOldest = 1;
+uint32_t eventSent = 1;
+// Unacknowledged events overwritten because the ring was full
+uint32_t eventsLost = 0;
+// Unacknowledged events found in the store at boot
+uint32_t eventsRestored = 0;
+// Send every unacknowledged event again: the A7 asked, or a new endpoint wrote
+volatile uint8_t eventReplay = 0;
+uint32_t eventPeer = RPMSG_ADDR_ANY;
+// Human-readable scan reports on the console next to the events, see console:on|off
+uint8_t consoleReports = 1;
+// Console output collected by qprint and friends until qflush
+char consoleBuf[CONSOLE_BUF_SIZE];
+uint16_t consoleLen = 0;
+
+// RF duty cycling: field only on for presence probes while no card is around
+uint8_t lowPowerEnabled = 1;
+// SPI5 clock picked by SpiCalibrate, and the fastest one that passed before the margin
+uint32_t spiClockHz = 0;
+uint32_t spiFastestHz = 0;
+uint16_t spiDivider = 8;
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -84,11 +249,50 @@ static void MX_SPI5_Init(void);
 int MX_OPENAMP_Init(int RPMsgRole, rpmsg_ns_bind_cb ns_bind_cb);
 /* USER CODE BEGIN PFP */
 void VIRT_UART_RxCpltCallback(VIRT_UART_HandleTypeDef *huart);
+int EventEndpointCallback(struct rpmsg_endpoint *ept, void *data, size_t len, uint32_t src, void *priv);
 void qprint(const char* format, ...);
+void qputc(char c);
+void qputs(const char *str);
+void qhex(const uint8_t *data, uint16_t len);
+void qbyte(uint8_t value);
+void qdec(uint32_t value);
+void qflush(void);
 void ProcessCommand(char* cmd);
+void RunCommand(char *cmd, uint8_t fromEndpoint);
 void ExecuteScanOnce(void);
+void ScanSeqInit(MFRC522_Seq_t *seq, uint8_t steps);
+uint8_t ReportScanResult(RfidReader_t *reader, const MFRC522_Seq_t *seq);
+void PrintScanResult(const RfidReader_t *reader, const MFRC522_Seq_t *seq, MFRC522_Status_t status,
+                     uint8_t blockCount);
+void SendEvent(EventType_t type, const RfidReader_t *reader, MFRC522_Status_t status, uint8_t completed,
+               const Uid_t *uid, uint8_t blockAddr, uint8_t blockCount, const uint8_t *data);
+void EventTask(void);
+void EventStoreLoad(void);
+void EventStoreSave(void);
+void PrintBlockData(const uint8_t *data);
+void PrintScanProfile(const char *prefix);
+void ScanTask(void);
+void ReaderScanTask(RfidReader_t *reader, uint8_t slot);
+void ReaderSeqInit(RfidReader_t *reader, uint8_t steps);
+uint8_t TrackCard(RfidReader_t *reader, const MFRC522_Seq_t *seq);
+void CheckTrackedCards(RfidReader_t *reader);
+uint8_t ReadersIdle(void);
 void ExecuteReadBlock(uint8_t blockAddr);
 void ExecuteWriteBlock(uint8_t blockAddr, uint8_t* data);
+void ExecuteDump(void);
+void ExecuteApdu(const uint8_t *apdu, uint8_t len);
+void DumpHeader(const MFRC522_Session_t *session);
+void DumpClassic(MFRC522_Session_t *session);
+void DumpType2(MFRC522_Session_t *session);
+MFRC522_Status_t CardSessionBegin(MFRC522_Session_t *session);
+void ExecuteKeyList(void);
+uint8_t ParseHex(const char *str, uint8_t *out, uint8_t len);
+void ExecuteBenchmark(void);
+void ExecuteCrcTest(void);
+void ExecuteInventory(void);
+static void CycleCounter_Init(void);
+void SpiCalibrate(void);
+static void SpiSetPrescaler(uint32_t prescaler);
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -147,35 +351,83 @@ int main(void)
   MX_SPI5_Init();
   /* USER CODE BEGIN 2 */
   // Initialize MFRC522
+   // Readers share hspi5, each one has its own CS/RST/IRQ pins. To add one,
+   // raise RFID_READER_COUNT, configure its pins (CS idle high) before any
+   // reader is initialised, and MFRC522_Init it with its own config before
+   // SpiCalibrate. SpiCalibrate skips readers that were never initialised.
+   MFRC522_Config_t mfrc522 = {0};
    mfrc522.hspi = &hspi5;
    mfrc522.CS_GPIO_Port = GPIOD;
    mfrc522.CS_Pin = GPIO_PIN_14;
    mfrc522.RST_GPIO_Port = GPIOD;
    mfrc522.RST_Pin = GPIO_PIN_15;
+   mfrc522.IRQ_GPIO_Port = RFID_IRQ_GPIO_Port;
+   mfrc522.IRQ_Pin = RFID_IRQ_Pin;
+
+   readers[0].name = "in";
+   MFRC522_Init(&readers[0].dev, &mfrc522);
+   // Replace the prescaler from MX_SPI5_Init with the fastest one the wiring takes
+   SpiCalibrate();
+
+   // Every reader is probed once per scan interval, in round-robin slots
+   MFRC522_SchedInit(&scanSched, SCAN_INTERVAL_MS);
+   for (uint8_t r = 0; r < RFID_READER_COUNT; r++) {
+       MFRC522_SchedAdd(&scanSched, &readers[r].dev);
+   }
+   MFRC522_KeyTableInit(&keyTable);
+   for (uint8_t k = 0; k < sizeof(defaultKeys) / sizeof(defaultKeys[0]); k++) {
+       MFRC522_KeyTableSet(&keyTable, k, defaultKeys[k].authMode, defaultKeys[k].key);
+   }
+   MFRC522_KeyCacheInit(&keyCache);
+   CycleCounter_Init();
+   // Keep IPC serviced while SPI frames and transceives are in flight
+   MFRC522_SetIdleHook(OPENAMP_check_for_message);
 
-   MFRC522_Init(&mfrc522);
+   // Events a previous run queued but the A7 never acknowledged go out first
+   EventStoreLoad();
 
    // Initialize Virtual UART
    VIRT_UART_Init(&huart0);
    if(VIRT_UART_RegisterCallback(&huart0, VIRT_UART_RXCPLT_CB_ID, VIRT_UART_RxCpltCallback) != VIRT_UART_OK) {
        Error_Handler();
    }
+   // Events can go out once the A7 sent its first command, that gives their destination
+   if (OPENAMP_create_endpoint(&eventEpt, EVENT_SERVICE_NAME, RPMSG_ADDR_ANY, EventEndpointCallback, NULL) < 0) {
+       Error_Handler();
+   }
 
    // Send startup message
    qprint("\r\n=== M4 Core Started ===\r\n");
    qprint("RFID Reader Ready\r\n");
    qprint("Available commands:\r\n");
    qprint("  scan        - Scan for card once\r\n");
+   qprint("  inventory   - List every card in the field\r\n");
    qprint("  status      - Get system status\r\n");
    qprint("  read:N      - Read block N (e.g., read:4)\r\n");
    qprint("  write:N:DATA - Write to block N\r\n");
+   qprint("  dump        - Read the whole card\r\n");
+   qprint("  apdu:HEX    - Send an APDU to an ISO 14443-4 card\r\n");
+   qprint("  keys        - List the key dictionary\r\n");
+   qprint("  mode:irq|poll - Select transceive wait mode\r\n");
+   qprint("  dma:on|off  - Use DMA for SPI bursts\r\n");
+   qprint("  crc:soft|chip - Select CRC_A implementation\r\n");
+   qprint("  crctest     - Check CRC_A vectors, soft vs chip\r\n");
+   qprint("  bench       - Compare poll/IRQ/DMA cycles\r\n");
+   qprint("  lowpower:on|off - RF duty cycling while idle\r\n");
+   qprint("  reader:N    - Reader used by commands\r\n");
+   qprint("  profile:uid|block:N|sector:S - What a scan reads\r\n");
+   qprint("  console:on|off - Scan reports as text here\r\n");
+   qprint("  ping        - Round trip test\r\n");
    qprint("===================\r\n\r\n");
+   if (eventsRestored > 0) {
+       qprint("%lu unacknowledged events kept from before the restart\r\n\r\n", eventsRestored);
+   }
+   qflush();
 
   /* USER CODE END 2 */
 
   /* Infinite loop */
   /* USER CODE BEGIN WHILE */
-   uint32_t lastAutoScan = 0;
    uint8_t autoScanEnabled = 1; // Auto-scan by default
   while (1)
   {
@@ -186,23 +438,32 @@ int main(void)
 
       // Process any pending commands from A7
       if (commandReady) {
+          // Copied out first, so the next line can wait while this one runs
+          memcpy(consoleCmd, consoleLine, RX_BUFFER_SIZE);
           commandReady = 0;
-          ProcessCommand(rxBuffer);
-          rxIndex = 0;
-          memset(rxBuffer, 0, RX_BUFFER_SIZE);
+          RunCommand(consoleCmd, 0);
+      } else if (eptCmdHead != eptCmdTail) {
+          // The slot stays taken until the command returned
+          RunCommand(eptCmdQueue[eptCmdHead % EPT_CMD_QUEUE], 1);
+          eptCmdHead++;
       }
 
       // Auto-scan mode (can be disabled via command)
-      if (autoScanEnabled && (HAL_GetTick() - lastAutoScan > 100)) {
-          lastAutoScan = HAL_GetTick();
-
-          //uint8_t tagType[2];
-          //MFRC522_Status_t status = MFRC522_Request(PICC_CMD_REQA, tagType);
-          ExecuteScanOnce();
-          /*
-          if (status == MFRC522_OK) {
-              ExecuteScanOnce();
-          }*/
+      if (autoScanEnabled) {
+          ScanTask();
+      }
+      // Events not sent yet: the endpoint was not open, out of buffers, or a replay
+      EventTask();
+      if (consoleDropped) {
+          consoleDropped = 0;
+          qputs("ERROR: Console busy, a command was dropped\r\n");
+      }
+      // Whatever was printed outside a scan report or a command goes out before sleeping
+      qflush();
+
+      if (lowPowerEnabled && ReadersIdle() && !commandReady && (eptCmdHead == eptCmdTail)) {
+          // Nothing to do until SysTick or IPCC wakes us
+          __WFI();
       }
   }
   /* USER CODE END 3 */
@@ -415,6 +676,18 @@ static void MX_GPIO_Init(void)
   __HAL_RCC_GPIOA_CLK_ENABLE();
 
   /* USER CODE BEGIN MX_GPIO_Init_2 */
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+  __HAL_RCC_GPIOD_CLK_ENABLE();
+
+  /* MFRC522 IRQ pin is active low (IRqInv set in COMM_IEN) */
+  GPIO_InitStruct.Pin = RFID_IRQ_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_IT_FALLING;
+  GPIO_InitStruct.Pull = GPIO_PULLUP;
+  HAL_GPIO_Init(RFID_IRQ_GPIO_Port, &GPIO_InitStruct);
+
+  HAL_NVIC_SetPriority(RFID_IRQ_EXTI_IRQn, 1, 0);
+  HAL_NVIC_EnableIRQ(RFID_IRQ_EXTI_IRQn);
 
   /* USER CODE END MX_GPIO_Init_2 */
 }
@@ -432,7 +705,13 @@ void VIRT_UART_RxCpltCallback(VIRT_UART_HandleTypeDef *huart)
             // End of command
             if (rxIndex > 0) {
                 rxBuffer[rxIndex] = '\0';
-                commandReady = 1;
+                if (commandReady) {
+                    // One line waits already
+                    consoleDropped = 1;
+                } else {
+                    memcpy(consoleLine, rxBuffer, rxIndex + 1);
+                    commandReady = 1;
+                }
                 rxIndex = 0;  // Reset for next command
             }
         } else if (rxIndex < RX_BUFFER_SIZE - 1) {
@@ -442,6 +721,83 @@ void VIRT_UART_RxCpltCallback(VIRT_UART_HandleTypeDef *huart)
     }
 }
 
+/**
+ * @brief Command from the event endpoint, one per message. ack:N and replay
+ *        are handled here, the rest like console commands.
+ */
+int EventEndpointCallback(struct rpmsg_endpoint *ept, void *data, size_t len, uint32_t src, void *priv)
+{
+    const char *cmd = data;
+
+    (void)priv;
+
+    // A reopened char device can be a new endpoint: follow it and give it the backlog
+    if (src != eventPeer) {
+        eventPeer = src;
+        ept->dest_addr = src;
+        eventReplay = 1;
+    }
+
+    if ((len > 4) && (strncmp(cmd, "ack:", 4) == 0)) {
+        // Everything up to N arrived; the message has no terminating NUL
+        char number[11] = {0};
+        memcpy(number, cmd + 4, (len - 4 < sizeof(number) - 1) ? len - 4 : sizeof(number) - 1);
+        uint32_t acked = strtoul(number, NULL, 10);
+        if ((acked >= eventOldest) && (acked < eventNext)) {
+            eventOldest = acked + 1;
+            EventStoreSave();
+        }
+        return RPMSG_SUCCESS;
+    }
+    if ((len >= 6) && (strncmp(cmd, "replay", 6) == 0)) {
+        eventReplay = 1;
+        return RPMSG_SUCCESS;
+    }
+
+    while ((len > 0) && ((cmd[len - 1] == '\n') || (cmd[len - 1] == '\r') || (cmd[len - 1] == '\0'))) {
+        len--;
+    }
+    if ((len == 0) || (len >= RX_BUFFER_SIZE)) {
+        return RPMSG_SUCCESS;
+    }
+
+    // Queue full: say so instead of dropping it silently, the A7 may send it again
+    if ((uint8_t)(eptCmdTail - eptCmdHead) == EPT_CMD_QUEUE) {
+        SendEvent(EVENT_NAK, cmdReader, MFRC522_OK, 0, NULL, 0, 0, NULL);
+        return RPMSG_SUCCESS;
+    }
+
+    char *slot = eptCmdQueue[eptCmdTail % EPT_CMD_QUEUE];
+    memcpy(slot, cmd, len);
+    slot[len] = '\0';
+    eptCmdTail++;
+    return RPMSG_SUCCESS;
+}
+
+/**
+ * @brief Run one command from the console or the event endpoint. It owns
+ *        the bus until it returns: scans in flight are dropped and the
+ *        field comes back on.
+ */
+void RunCommand(char *cmd, uint8_t fromEndpoint)
+{
+    for (uint8_t r = 0; r < RFID_READER_COUNT; r++) {
+        if (readers[r].scanActive) {
+            MFRC522_Abort(&readers[r].dev);
+            readers[r].scanActive = 0;
+        }
+    }
+    if (MFRC522_IsPoweredDown(rfid)) {
+        MFRC522_SoftWakeUp(rfid);
+        MFRC522_AntennaOn(rfid);
+    }
+
+    cmdFromEndpoint = fromEndpoint;
+    ProcessCommand(cmd);
+    cmdFromEndpoint = 0;
+    qflush();
+}
+
 /**
  * @brief Process incoming command from A7
  */
@@ -456,10 +812,47 @@ void ProcessCommand(char* cmd)
         qprint(">> Scanning for card...\r\n");
         ExecuteScanOnce();
 
+    } else if (strncmp(cmd, "inventory", 9) == 0) {
+        qprint(">> Inventory...\r\n");
+        ExecuteInventory();
+
     } else if (strncmp(cmd, "status", 6) == 0) {
         qprint(">> Status:\r\n");
         qprint("   M4 Core: Running\r\n");
         qprint("   RFID: OK\r\n");
+        qprint("   Wait mode: %s\r\n",
+               MFRC522_GetWaitMode(rfid) == MFRC522_WAIT_IRQ ? "irq" : "poll");
+        qprint("   SPI DMA: %s\r\n", MFRC522_GetDMA(rfid) ? "on" : "off");
+        if (spiFastestHz != 0) {
+            qprint("   SPI clock: %lu kHz (/%d), fastest passing %lu kHz\r\n",
+                   spiClockHz / 1000, spiDivider, spiFastestHz / 1000);
+        } else {
+            qprint("   SPI clock: %lu kHz (/%d), link test failed at every rate\r\n",
+                   spiClockHz / 1000, spiDivider);
+        }
+        qprint("   CRC_A: %s\r\n", MFRC522_GetCRCMode(rfid) == MFRC522_CRC_CHIP ? "chip" : "soft");
+        qprint("   Low power: %s\r\n", lowPowerEnabled ? "on" : "off");
+        PrintScanProfile("   ");
+        qprint("   Events: %lu, %lu unacknowledged, %lu lost, %lu restored at boot; console reports %s\r\n",
+               eventNext - 1, eventNext - eventOldest, eventsLost, eventsRestored,
+               consoleReports ? "on" : "off");
+        qprint("   Keys: %d, cache %lu hits, %lu misses\r\n",
+               keyTable.count, keyCache.hits, keyCache.misses);
+        qprint("   SPI: %lu frames, %lu bytes, %lu cache hits\r\n",
+               MFRC522_GetStats(rfid)->spiTransactions, MFRC522_GetStats(rfid)->spiBytes,
+               MFRC522_GetStats(rfid)->cacheHits);
+        const uint32_t *rfErrors = MFRC522_GetStats(rfid)->rfErrors;
+        qprint("   RF errors: %lu no answer, %lu collision, %lu parity, %lu CRC, %lu overflow, %lu protocol\r\n",
+               rfErrors[MFRC522_NOTAGERR], rfErrors[MFRC522_COLLISION], rfErrors[MFRC522_PARITY_ERR],
+               rfErrors[MFRC522_CRC_ERR], rfErrors[MFRC522_OVERFLOW], rfErrors[MFRC522_PROTOCOL_ERR]);
+        qprint("   Retries: %lu, %lu scans recovered\r\n",
+               MFRC522_GetStats(rfid)->retries, MFRC522_GetStats(rfid)->recovered);
+        // Worst-case detection latency is the probe gap plus one probe
+        for (uint8_t r = 0; r < RFID_READER_COUNT; r++) {
+            qprint("   Reader %d (%s)%s: worst probe gap %lu ms, %d card(s) present%s\r\n", r, readers[r].name,
+                   (&readers[r] == cmdReader) ? "*" : "", scanSched.maxGapMs[r], readers[r].trackedCount,
+                   readers[r].spiAbsent ? ", no SPI answer at boot" : "");
+        }
         qprint("   Uptime: %lu ms\r\n", HAL_GetTick());
 
     } else if (strncmp(cmd, "read:", 5) == 0) {
@@ -489,12 +882,175 @@ void ProcessCommand(char* cmd)
             qprint("ERROR: Invalid write format. Use: write:BLOCK:DATA\r\n");
         }
 
+    } else if (strncmp(cmd, "dump", 4) == 0) {
+        qprint(">> Dumping card...\r\n");
+        ExecuteDump();
+
+    } else if (strncmp(cmd, "apdu:", 5) == 0) {
+        // Parse: apdu:00B0000010
+        uint8_t apdu[APDU_MAX_LEN];
+        uint8_t len = ParseHex(cmd + 5, apdu, sizeof(apdu));
+
+        if (len >= 4) {
+            ExecuteApdu(apdu, len);
+        } else {
+            qprint("ERROR: Invalid APDU. Use: apdu:HEX (at least CLA INS P1 P2)\r\n");
+        }
+
+    } else if ((strncmp(cmd, "keys", 4) == 0) && (strncmp(cmd, "keyslot:", 8) != 0)) {
+        ExecuteKeyList();
+
+    } else if (strncmp(cmd, "key:", 4) == 0) {
+        // Parse: key:4:B:A0B1C2D3E4F5
+        char* modeStr = strchr(cmd + 4, ':');
+        uint8_t key[6];
+
+        if ((modeStr != NULL) && ((modeStr[1] == 'A') || (modeStr[1] == 'B')) && (modeStr[2] == ':') &&
+            (ParseHex(modeStr + 3, key, 6) == 6) &&
+            (MFRC522_KeyTableSet(&keyTable, atoi(cmd + 4),
+                                 (modeStr[1] == 'B') ? PICC_CMD_MF_AUTH_KEY_B : PICC_CMD_MF_AUTH_KEY_A,
+                                 key) >= 0)) {
+            // Remembered indices may point at the old key
+            MFRC522_KeyCacheInit(&keyCache);
+            qprint(">> Key %d set\r\n", atoi(cmd + 4));
+        } else {
+            qprint("ERROR: Invalid key. Use: key:0..%d:A|B:12 hex digits\r\n", keyTable.count);
+        }
+
+    } else if (strncmp(cmd, "keyslot:", 8) == 0) {
+        // Parse: keyslot:1:4,0 (sector 1 tries key 4, then key 0, then the rest)
+        char* listStr = strchr(cmd + 8, ':');
+        uint8_t slots[MFRC522_KEY_SLOTS];
+        uint8_t count = 0;
+        uint8_t ok = (listStr != NULL);
+
+        while (ok && (*++listStr != '\0')) {
+            if (count == MFRC522_KEY_SLOTS) {
+                ok = 0;
+                break;
+            }
+            slots[count] = atoi(listStr);
+            ok = (slots[count] < keyTable.count);
+            count++;
+            listStr = strchr(listStr, ',');
+            if (listStr == NULL) {
+                break;
+            }
+        }
+
+        if (ok && MFRC522_KeyTableSetSlots(&keyTable, atoi(cmd + 8), slots, count)) {
+            qprint(">> Sector %d: %d key slot(s)\r\n", atoi(cmd + 8), count);
+        } else {
+            qprint("ERROR: Invalid slots. Use: keyslot:SECTOR:I,J,.. (up to %d keys)\r\n", MFRC522_KEY_SLOTS);
+        }
+
+    } else if (strncmp(cmd, "mode:", 5) == 0) {
+        if (strncmp(cmd + 5, "irq", 3) == 0) {
+            MFRC522_SetWaitMode(rfid, MFRC522_WAIT_IRQ);
+        } else if (strncmp(cmd + 5, "poll", 4) == 0) {
+            MFRC522_SetWaitMode(rfid, MFRC522_WAIT_POLL);
+        } else {
+            qprint("ERROR: Invalid mode. Use: mode:irq or mode:poll\r\n");
+        }
+        qprint(">> Wait mode: %s\r\n",
+               MFRC522_GetWaitMode(rfid) == MFRC522_WAIT_IRQ ? "irq" : "poll");
+
+    } else if (strncmp(cmd, "dma:", 4) == 0) {
+        MFRC522_SetDMA(rfid, strncmp(cmd + 4, "on", 2) == 0);
+        qprint(">> SPI DMA: %s\r\n", MFRC522_GetDMA(rfid) ? "on" : "off");
+
+    } else if (strncmp(cmd, "crc:", 4) == 0) {
+        MFRC522_SetCRCMode(rfid, strncmp(cmd + 4, "chip", 4) == 0 ? MFRC522_CRC_CHIP : MFRC522_CRC_SOFTWARE);
+        qprint(">> CRC_A: %s\r\n", MFRC522_GetCRCMode(rfid) == MFRC522_CRC_CHIP ? "chip" : "soft");
+
+    } else if (strncmp(cmd, "crctest", 7) == 0) {
+        qprint(">> CRC_A test vectors...\r\n");
+        ExecuteCrcTest();
+
+    } else if (strncmp(cmd, "bench", 5) == 0) {
+        qprint(">> Benchmarking REQA/anticoll/select...\r\n");
+        ExecuteBenchmark();
+
+    } else if (strncmp(cmd, "lowpower:", 9) == 0) {
+        lowPowerEnabled = (strncmp(cmd + 9, "on", 2) == 0);
+        for (uint8_t r = 0; r < RFID_READER_COUNT; r++) {
+            // Tracked cards keep the field on, they are re-checked every slot
+            readers[r].cardInField = (readers[r].trackedCount > 0);
+            // Full-rate scanning needs every field back on
+            if (!lowPowerEnabled && MFRC522_IsPoweredDown(&readers[r].dev)) {
+                MFRC522_SoftWakeUp(&readers[r].dev);
+                MFRC522_AntennaOn(&readers[r].dev);
+            }
+        }
+        qprint(">> Low power: %s\r\n", lowPowerEnabled ? "on" : "off");
+
+    } else if (strncmp(cmd, "reader:", 7) == 0) {
+        uint8_t r = atoi(cmd + 7);
+        if (r < RFID_READER_COUNT) {
+            cmdReader = &readers[r];
+            rfid = &cmdReader->dev;
+        } else {
+            qprint("ERROR: Invalid reader. Use: reader:0..%d\r\n", RFID_READER_COUNT - 1);
+        }
+        qprint(">> Reader: %d (%s)\r\n", (int)(cmdReader - readers), cmdReader->name);
+
+    } else if (strncmp(cmd, "profile:", 8) == 0) {
+        // Parse: profile:uid, profile:block:N, profile:sector:S
+        const char *arg = strchr(cmd + 8, ':');
+        int value = (arg != NULL) ? atoi(arg + 1) : -1;
+
+        if (strncmp(cmd + 8, "uid", 3) == 0) {
+            scanProfile = SCAN_PROFILE_UID;
+            PrintScanProfile(">> ");
+        } else if ((strncmp(cmd + 8, "block:", 6) == 0) && (value >= 0) && (value < DUMP_MAX_BLOCKS)) {
+            scanProfile = SCAN_PROFILE_BLOCK;
+            scanBlock = value;
+            PrintScanProfile(">> ");
+        } else if ((strncmp(cmd + 8, "sector:", 7) == 0) && (value >= 0) && (value < DUMP_MAX_SECTORS)) {
+            scanProfile = SCAN_PROFILE_SECTOR;
+            scanSector = value;
+            PrintScanProfile(">> ");
+        } else {
+            qprint("ERROR: Invalid profile. Use: profile:uid, profile:block:0..%d or profile:sector:0..%d\r\n",
+                   DUMP_MAX_BLOCKS - 1, DUMP_MAX_SECTORS - 1);
+        }
+
+    } else if (strncmp(cmd, "console:", 8) == 0) {
+        consoleReports = (strncmp(cmd + 8, "on", 2) == 0);
+        qprint(">> Console reports: %s\r\n", consoleReports ? "on" : "off");
+
+    } else if (strncmp(cmd, "ping", 4) == 0) {
+        // Answered on the path it came in on, rpmsg_latency.py times both
+        if (cmdFromEndpoint) {
+            SendEvent(EVENT_PONG, cmdReader, MFRC522_OK, 0, NULL, 0, 0, NULL);
+        } else {
+            qprint("pong\r\n");
+        }
+
     } else if (strncmp(cmd, "help", 4) == 0) {
         qprint(">> Available commands:\r\n");
         qprint("   scan           - Scan for card once\r\n");
+        qprint("   inventory      - List every card in the field\r\n");
         qprint("   status         - Get system status\r\n");
         qprint("   read:N         - Read block N\r\n");
         qprint("   write:N:DATA   - Write DATA to block N\r\n");
+        qprint("   dump           - Read every block, one AUTH per sector\r\n");
+        qprint("   apdu:HEX       - Send an APDU to an ISO 14443-4 card\r\n");
+        qprint("   keys           - List the key dictionary and cache\r\n");
+        qprint("   key:N:A|B:KEY  - Set dictionary key N (12 hex digits)\r\n");
+        qprint("   keyslot:S:I,J  - Keys sector S tries first\r\n");
+        qprint("   mode:irq|poll  - Select transceive wait mode\r\n");
+        qprint("   dma:on|off     - Use DMA for SPI bursts\r\n");
+        qprint("   crc:soft|chip  - Select CRC_A implementation\r\n");
+        qprint("   crctest        - Check CRC_A vectors, soft vs chip\r\n");
+        qprint("   bench          - Compare poll/IRQ/DMA cycles\r\n");
+        qprint("   lowpower:on|off - RF duty cycling while idle\r\n");
+        qprint("   reader:N       - Reader used by commands\r\n");
+        qprint("   profile:uid    - Scans report the UID only (fastest)\r\n");
+        qprint("   profile:block:N  - Scans also read block N\r\n");
+        qprint("   profile:sector:S - Scans also read sector S\r\n");
+        qprint("   console:on|off - Scan reports as text here, events always go to the event endpoint\r\n");
+        qprint("   ping           - pong here, or an event frame when sent on the event endpoint\r\n");
         qprint("   help           - Show this help\r\n");
 
     } else {
@@ -503,134 +1059,580 @@ void ProcessCommand(char* cmd)
 }
 
 /**
- * @brief Execute a single card scan
+ * @brief Fill in the auto-scan sequence: UID, then what the scan profile reads
  */
-void ExecuteScanOnce(void)
+void ScanSeqInit(MFRC522_Seq_t *seq, uint8_t steps)
 {
-    uint8_t tagType[2];
-    MFRC522_Status_t status = MFRC522_Request(PICC_CMD_REQA, tagType);
+    memset(seq, 0, sizeof(*seq));
+    seq->steps = steps;
+    seq->reqMode = PICC_CMD_REQA;
+    if (scanProfile == SCAN_PROFILE_UID) {
+        // Select and HLTA only, about half the time of a block read
+        seq->steps &= ~(MFRC522_SEQ_AUTH | MFRC522_SEQ_READ);
+    }
+    // The sector profile reads the first block here and the rest in ReportScanResult
+    seq->blockAddr = (scanProfile == SCAN_PROFILE_SECTOR) ? MFRC522_SectorFirstBlock(scanSector) : scanBlock;
+    seq->keys = &keyTable;
+    seq->cache = &keyCache;
+}
 
-    if (status == MFRC522_OK) {
-        qprint("\r\n=== Card Detected ===\r\n");
+/**
+ * @brief Print 16 bytes as hex, then as ASCII
+ */
+void PrintBlockData(const uint8_t *data)
+{
+    qhex(data, 16);
+    qputs("\r\n");
+
+    // Print as ASCII (if printable)
+    qputs("ASCII: ");
+    for (uint8_t i = 0; i < 16; i++) {
+        if (data[i] >= 0x20 && data[i] <= 0x7E) {
+            qputc(data[i]);
+        } else {
+            qputc('.');
+        }
+    }
+    qputs("\r\n");
+}
 
-        // Anti-collision detection, get card UID
-        status = MFRC522_Anticoll(&uid);
+/**
+ * @brief Print the scan profile after a prefix
+ */
+void PrintScanProfile(const char *prefix)
+{
+    switch (scanProfile) {
+        case SCAN_PROFILE_UID:
+            qprint("%sScan profile: uid\r\n", prefix);
+            break;
+        case SCAN_PROFILE_BLOCK:
+            qprint("%sScan profile: block %d\r\n", prefix, scanBlock);
+            break;
+        default:
+            qprint("%sScan profile: sector %d\r\n", prefix, scanSector);
+            break;
+    }
+}
 
-        if (status == MFRC522_OK) {
-            qprint("Card UID: ");
-            for (uint8_t i = 0; i < uid.size; i++) {
-                qprint("%02X ", uid.uidByte[i]);
+/**
+ * @brief Send the outcome of a finished scan sequence as an event and halt
+ *        the card. With the sector profile the rest of the opened sector is
+ *        read first.
+ * @retval 1 if a card answered, 0 if the field was empty
+ */
+uint8_t ReportScanResult(RfidReader_t *reader, const MFRC522_Seq_t *seq)
+{
+    MFRC522_Status_t status = seq->status;
+    uint8_t blockCount = 0;
+
+    if ((seq->steps & MFRC522_SEQ_REQUEST) && !(seq->completed & MFRC522_SEQ_REQUEST)) {
+        return 0;
+    }
+
+    if (seq->completed & MFRC522_SEQ_READ) {
+        memcpy(scanData, seq->data, 16);
+        blockCount = 1;
+
+        if ((scanProfile == SCAN_PROFILE_SECTOR) && (seq->completed & MFRC522_SEQ_AUTH)) {
+            // The sector is open, its other blocks need no new AUTH
+            uint8_t sector = MFRC522_SectorOfBlock(seq->blockAddr);
+            uint16_t end = MFRC522_SectorFirstBlock(sector) + MFRC522_SectorBlockCount(sector);
+
+            for (uint16_t block = seq->blockAddr + 1; block < end; block++) {
+                status = MFRC522_Read(&reader->dev, block, readBuffer);
+                if (status != MFRC522_OK) {
+                    break;
+                }
+                memcpy(&scanData[blockCount++ * 16], readBuffer, 16);
             }
-            qprint("\r\n");
+        }
+    }
 
-            // Select the card
-            status = MFRC522_SelectTag(&uid);
+    // CRITICAL: Halt the card and stop crypto
+    MFRC522_Halt(&reader->dev);
 
-            if (status == MFRC522_OK) {
-                PICC_Type_t cardType = MFRC522_GetType(uid.sak);
-                qprint("Card Type: %s\r\n", MFRC522_GetTypeName(cardType));
-                qprint("SAK: 0x%02X\r\n", uid.sak);
-
-                // Example: Read block 4 (first data block of sector 1)
-                uint8_t blockAddr = 4;
-
-                // Authenticate with Key A
-                status = MFRC522_Auth(PICC_CMD_MF_AUTH_KEY_A, blockAddr, keyA, &uid);
-
-                if (status == MFRC522_OK) {
-                    qprint("Authentication successful!\r\n");
-
-                    // Read the block
-                    status = MFRC522_Read(blockAddr, readBuffer);
-
-                    if (status == MFRC522_OK) {
-                        qprint("Block %d data: ", blockAddr);
-                        for (uint8_t i = 0; i < 16; i++) {
-                            qprint("%02X ", readBuffer[i]);
-                        }
-                        qprint("\r\n");
-
-                        // Print as ASCII (if printable)
-                        qprint("ASCII: ");
-                        for (uint8_t i = 0; i < 16; i++) {
-                            if (readBuffer[i] >= 0x20 && readBuffer[i] <= 0x7E) {
-                                qprint("%c", readBuffer[i]);
-                            } else {
-                                qprint(".");
-                            }
-                        }
-                        qprint("\r\n");
-
-                    } else {
-                        qprint("Failed to read block %d\r\n", blockAddr);
-                    }
+    // Clear the MFCrypto1On bit to stop encryption
+    MFRC522_ClearBitMask(&reader->dev, MFRC522_REG_STATUS_2, 0x08);
+
+    SendEvent(EVENT_CARD, reader, status, seq->completed,
+              (seq->completed & MFRC522_SEQ_ANTICOLL) ? &seq->uid : NULL, seq->blockAddr, blockCount, scanData);
+    if (consoleReports) {
+        PrintScanResult(reader, seq, status, blockCount);
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Print a scan sent by ReportScanResult on the console
+ */
+void PrintScanResult(const RfidReader_t *reader, const MFRC522_Seq_t *seq, MFRC522_Status_t status,
+                     uint8_t blockCount)
+{
+    qputs("\r\n=== Card Detected ===\r\n");
+    if (RFID_READER_COUNT > 1) {
+        qputs("Reader: ");
+        qputs(reader->name);
+        qputs("\r\n");
+    }
+
+    if (seq->completed & MFRC522_SEQ_ANTICOLL) {
+        qputs("Card UID: ");
+        qhex(seq->uid.uidByte, seq->uid.size);
+        qputs("\r\n");
+    }
 
+    if (seq->completed & MFRC522_SEQ_SELECT) {
+        PICC_Type_t cardType = MFRC522_GetType(seq->uid.sak);
+        qputs("Card Type: ");
+        qputs(MFRC522_GetTypeName(cardType));
+        qputs("\r\n");
+        qputs("SAK: 0x");
+        qbyte(seq->uid.sak);
+        qputs("\r\n");
+
+        // The sequence dropped the steps this card type cannot answer
+        if ((seq->steps & MFRC522_SEQ_AUTH) && !(seq->completed & MFRC522_SEQ_AUTH)) {
+            qputs("Authentication failed! (");
+            qputs(MFRC522_GetStatusName(seq->status));
+            qputs(")\r\n");
+        } else if (seq->steps & MFRC522_SEQ_READ) {
+            if (seq->steps & MFRC522_SEQ_AUTH) {
+                qputs("Authentication successful! (key ");
+                qdec(seq->keyIndex);
+                qputs(")\r\n");
+            }
+
+            for (uint8_t i = 0; i < blockCount; i++) {
+                if (seq->steps & MFRC522_SEQ_AUTH) {
+                    qputs("Block ");
+                    qdec(seq->blockAddr + i);
                 } else {
-                    qprint("Authentication failed!\r\n");
+                    qputs("Pages ");
+                    qdec(seq->blockAddr);
+                    qputc('-');
+                    qdec(seq->blockAddr + 3);
                 }
+                qputs(" data: ");
+                PrintBlockData(&scanData[i * 16]);
+            }
+            if (status != MFRC522_OK) {
+                qputs("Failed to read block ");
+                qdec(seq->blockAddr + blockCount);
+                qputs(" (");
+                qputs(MFRC522_GetStatusName(status));
+                qputs(")\r\n");
             }
         }
+    }
 
-        // CRITICAL: Halt the card and stop crypto
-        MFRC522_Halt();
+    qputs("=== End ===\r\n\r\n");
+    qflush();
+}
 
-        // Clear the MFCrypto1On bit to stop encryption
-        MFRC522_ClearBitMask(MFRC522_REG_STATUS_2, 0x08);
+/**
+ * @brief Execute a single card scan
+ */
+void ExecuteScanOnce(void)
+{
+    MFRC522_Seq_t seq;
+
+    // Each handled card is halted, so the next REQA reaches the others in the field
+    for (uint8_t cards = 0; cards < MAX_CARDS_PER_SCAN; cards++) {
+        ScanSeqInit(&seq, SCAN_STEPS);
+        MFRC522_RunSequence(rfid, &seq);
+        if (!ReportScanResult(cmdReader, &seq)) {
+            break;
+        }
+        // Auto-scan reports it leaving instead of reading it again
+        TrackCard(cmdReader, &seq);
+    }
+}
 
-        qprint("=== End ===\r\n\r\n");
+/**
+ * @brief Advance the auto-scan of every reader without blocking the main loop
+ */
+void ScanTask(void)
+{
+    int8_t slot = MFRC522_SchedNext(&scanSched);
 
-        // Wait a bit to prevent multiple rapid reads of the same card
-        HAL_Delay(500);
+    for (uint8_t r = 0; r < RFID_READER_COUNT; r++) {
+        ReaderScanTask(&readers[r], slot == r);
+    }
+}
+
+/**
+ * @brief Auto-scan of one reader
+ * @param slot Non-zero when the scheduler gives this reader its probe slot
+ */
+void ReaderScanTask(RfidReader_t *reader, uint8_t slot)
+{
+    MFRC522_Handle_t *dev = &reader->dev;
+
+    if (!reader->scanActive) {
+        if (!slot) {
+            return;
+        }
 
+        if (reader->trackedCount > 0) {
+            // Reported cards are halted: a WUPA re-check per card instead of reading them again
+            CheckTrackedCards(reader);
+        }
+
+        if (lowPowerEnabled && !reader->cardInField) {
+            // Short probe, a card that answers is scanned right away at full rate
+            if (!MFRC522_ProbePresence(dev)) {
+                return;
+            }
+            reader->cardInField = 1;
+            // The probe already left the card in READY
+            ReaderSeqInit(reader, SCAN_STEPS & ~MFRC522_SEQ_REQUEST);
+        } else {
+            ReaderSeqInit(reader, SCAN_STEPS);
+        }
+
+        reader->scanCards = 0;
+        reader->scanActive = 1;
+        MFRC522_SeqStart(dev, &reader->seq);
+        return;
+    }
+
+    MFRC522_Poll(dev);
+    if (reader->seq.step != MFRC522_STEP_DONE) {
+        return;
+    }
+
+    uint8_t answered;
+    if (TrackCard(reader, &reader->seq)) {
+        answered = ReportScanResult(reader, &reader->seq);
     } else {
-        // No card detected, small delay before next attempt
-        HAL_Delay(50);
+        // Reported before and never seen leaving, e.g. it lost power for a moment.
+        // Its sequence ended after SELECT.
+        MFRC522_Halt(dev);
+        answered = 1;
+    }
+
+    if (answered && (++reader->scanCards < MAX_CARDS_PER_SCAN)) {
+        // Each handled card is halted, so the next REQA reaches the others in the field
+        ReaderSeqInit(reader, SCAN_STEPS);
+        MFRC522_SeqStart(dev, &reader->seq);
+        return;
+    }
+
+    reader->scanActive = 0;
+    if (lowPowerEnabled && reader->cardInField && (reader->trackedCount == 0)) {
+        reader->cardInField = 0;
+        MFRC522_SoftPowerDown(dev);
     }
 }
 
 /**
- * @brief Read a specific block
+ * @brief Fill in the auto-scan sequence of a reader: tracked cards are known,
+ *        their sequence ends after SELECT instead of spending AUTH and READ
  */
-void ExecuteReadBlock(uint8_t blockAddr)
+void ReaderSeqInit(RfidReader_t *reader, uint8_t steps)
 {
-    uint8_t tagType[2];
-    MFRC522_Status_t status = MFRC522_Request(PICC_CMD_REQA, tagType);
+    ScanSeqInit(&reader->seq, steps);
+    reader->seq.skipUids = reader->tracked;
+    reader->seq.skipCount = reader->trackedCount;
+}
 
-    if (status != MFRC522_OK) {
-        qprint("ERROR: No card present\r\n");
+/**
+ * @brief Add the card of a finished scan to the reader's tracked cards. When
+ *        all TRACKED_CARDS are taken, the oldest one makes room. The field
+ *        stays on while a card is tracked, so it is re-checked every slot.
+ * @retval 0 if the card is tracked already, 1 if it is new or its UID unknown
+ */
+uint8_t TrackCard(RfidReader_t *reader, const MFRC522_Seq_t *seq)
+{
+    if (!(seq->completed & MFRC522_SEQ_ANTICOLL)) {
+        return 1;
+    }
+
+    for (uint8_t i = 0; i < reader->trackedCount; i++) {
+        if ((reader->tracked[i].size == seq->uid.size) &&
+            (memcmp(reader->tracked[i].uidByte, seq->uid.uidByte, seq->uid.size) == 0)) {
+            return 0;
+        }
+    }
+
+    if (reader->trackedCount == TRACKED_CARDS) {
+        // Not re-checked any more: when it leaves there is no removal, and it is reported again on its return
+        memmove(&reader->tracked[0], &reader->tracked[1], (TRACKED_CARDS - 1) * sizeof(Uid_t));
+        reader->trackedCount--;
+    }
+    reader->tracked[reader->trackedCount++] = seq->uid;
+    reader->cardInField = 1;
+    return 1;
+}
+
+/**
+ * @brief Re-check the tracked cards of a reader and report the ones that left
+ */
+void CheckTrackedCards(RfidReader_t *reader)
+{
+    uint8_t kept = 0;
+
+    for (uint8_t i = 0; i < reader->trackedCount; i++) {
+        Uid_t card = reader->tracked[i];
+
+        // Second try so one RF error is not taken for a removal
+        if (MFRC522_CheckCard(&reader->dev, &card) || MFRC522_CheckCard(&reader->dev, &card)) {
+            reader->tracked[kept++] = card;
+            continue;
+        }
+
+        SendEvent(EVENT_REMOVED, reader, MFRC522_OK, 0, &card, 0, 0, NULL);
+        if (!consoleReports) {
+            continue;
+        }
+        // No "Card UID:" line, it reads as a new scan
+        qputs("\r\n=== Card Removed ===\r\n");
+        if (RFID_READER_COUNT > 1) {
+            qputs("Reader: ");
+            qputs(reader->name);
+            qputs("\r\n");
+        }
+        qputs("Removed UID: ");
+        qhex(card.uidByte, card.size);
+        qputs("\r\n");
+        qflush();
+    }
+
+    if (reader->trackedCount > 1) {
+        // The WUPA of each check woke the other halted cards and its SELECT
+        // left them in IDLE, where the next REQA would read them again
+        for (uint8_t i = 0; i < kept; i++) {
+            MFRC522_HaltCard(&reader->dev, &reader->tracked[i]);
+        }
+    }
+    reader->trackedCount = kept;
+}
+
+/**
+ * @brief Queue one event frame in the ring and send it, pongs and naks go
+ *        out directly. Fields, little-endian: sync 0xA5, version, length (2) of
+ *        type up to the last block byte, type, reader, sequence number (4),
+ *        tick in ms (4), status, completed MFRC522_SEQ_* steps, SAK, UID
+ *        length (0: none), UID, block address, block count, 16 bytes per
+ *        block, CRC_A (2) of version up to the last block byte. A pong
+ *        or nak carries the sequence number the next event will get.
+ * @param uid  NULL when the scan got no UID
+ * @param data blockCount blocks of 16 bytes from blockAddr
+ */
+void SendEvent(EventType_t type, const RfidReader_t *reader, MFRC522_Status_t status, uint8_t completed,
+               const Uid_t *uid, uint8_t blockAddr, uint8_t blockCount, const uint8_t *data)
+{
+    uint8_t *frame = eventFrame;
+    uint8_t uidLen = (uid != NULL) ? uid->size : 0;
+    uint32_t tick = HAL_GetTick();
+    uint16_t len = EVENT_HEADER_LEN;
+    uint8_t kept = (type != EVENT_PONG) && (type != EVENT_NAK);
+
+    if (kept) {
+        if (eventNext - eventOldest == EVENT_RING_SIZE) {
+            // Full: the oldest unacknowledged event makes room, the A7 sees the gap
+            eventOldest++;
+            eventsLost++;
+        }
+        frame = eventRing[eventNext % EVENT_RING_SIZE].frame;
+    }
+
+    frame[0] = EVENT_SYNC;
+    frame[1] = EVENT_VERSION;
+    frame[4] = type;
+    frame[5] = (uint8_t)(reader - readers);
+    for (uint8_t i = 0; i < 4; i++) {
+        frame[6 + i] = (eventNext >> (8 * i)) & 0xFF;
+        frame[10 + i] = (tick >> (8 * i)) & 0xFF;
+    }
+    frame[14] = status;
+    frame[15] = completed;
+    frame[16] = (uid != NULL) ? uid->sak : 0;
+    frame[17] = uidLen;
+    if (uidLen > 0) {
+        memcpy(&frame[len], uid->uidByte, uidLen);
+        len += uidLen;
+    }
+    frame[len++] = blockAddr;
+    frame[len++] = blockCount;
+    if (blockCount > 0) {
+        memcpy(&frame[len], data, blockCount * 16);
+        len += blockCount * 16;
+    }
+    frame[2] = (len - 4) & 0xFF;
+    frame[3] = (len - 4) >> 8;
+    MFRC522_CalculateCRC_Software(&frame[1], len - 1, &frame[len]);
+    len += 2;
+
+    if (!kept) {
+        if (is_rpmsg_ept_ready(&eventEpt)) {
+            // Nothing to keep it for: without a free buffer it is dropped
+            rpmsg_trysend(&eventEpt, frame, len);
+        }
         return;
     }
 
-    status = MFRC522_Anticoll(&uid);
-    if (status != MFRC522_OK) {
-        qprint("ERROR: Anticollision failed\r\n");
+    eventRing[eventNext % EVENT_RING_SIZE].len = len;
+    eventNext++;
+    // Slot first, then the header that makes it count: a stop in between loses only this event
+    EventStoreSave();
+    EventTask();
+}
+
+/**
+ * @brief Send the events the A7 has not got yet, in order. Until the A7
+ *        opened the endpoint they stay in the ring.
+ */
+void EventTask(void)
+{
+    // Acknowledged or overwritten events are not sent again
+    if (eventReplay || (eventSent < eventOldest)) {
+        eventReplay = 0;
+        eventSent = eventOldest;
+    }
+
+    while ((eventSent != eventNext) && is_rpmsg_ept_ready(&eventEpt)) {
+        const EventSlot_t *slot = &eventRing[eventSent % EVENT_RING_SIZE];
+        if (slot->len == 0) {
+            // Damaged when the M4 was stopped, already counted as lost
+            eventSent++;
+            continue;
+        }
+        // OPENAMP_send (rpmsg_send) would wait up to 15 s for a buffer
+        if (rpmsg_trysend(&eventEpt, slot->frame, slot->len) < 0) {
+            // No free buffer: the event stays in the ring, the main loop tries again
+            break;
+        }
+        eventSent++;
+    }
+}
+
+/**
+ * @brief Take over the event ring a previous run left in RETRAM. A
+ *        remoteproc stop/start keeps RETRAM, so events the A7 had not
+ *        acknowledged yet are sent again once it opens the endpoint, with
+ *        their sequence numbers and the ticks of the run that scanned them.
+ *        A header that does not check out (power-up, other layout) starts an
+ *        empty ring; a slot that does not, counts as lost.
+ */
+void EventStoreLoad(void)
+{
+    EventStoreHeader_t *header = &eventStore->header;
+    uint8_t crc[2];
+
+    // The ring grew past what the linker script reserves
+    if ((size_t)((uint8_t *)__EVENT_STORE_region_end__ - (uint8_t *)__EVENT_STORE_region_start__) <
+        sizeof(EventStore_t)) {
+        Error_Handler();
+    }
+
+    MFRC522_CalculateCRC_Software((const uint8_t *)header, offsetof(EventStoreHeader_t, crc), crc);
+    if ((header->magic != EVENT_STORE_MAGIC) || (header->version != EVENT_STORE_VERSION) ||
+        (header->slots != EVENT_RING_SIZE) || (header->slotSize != sizeof(EventSlot_t)) ||
+        (memcmp(crc, header->crc, 2) != 0) || (header->next - header->oldest > EVENT_RING_SIZE) ||
+        (header->oldest == 0)) {
+        EventStoreSave();
         return;
     }
 
-    status = MFRC522_SelectTag(&uid);
+    eventNext = header->next;
+    eventOldest = header->oldest;
+    eventSent = eventOldest;
+    eventsLost = header->lost;
+
+    for (uint32_t seq = eventOldest; seq != eventNext; seq++) {
+        EventSlot_t *slot = &eventRing[seq % EVENT_RING_SIZE];
+        const uint8_t *frame = slot->frame;
+        uint8_t valid = (slot->len >= EVENT_HEADER_LEN + 4) && (slot->len <= EVENT_FRAME_MAX) &&
+                        (frame[0] == EVENT_SYNC) && (frame[1] == EVENT_VERSION) &&
+                        (frame[2] == ((slot->len - 6) & 0xFF)) && (frame[3] == ((slot->len - 6) >> 8));
+        if (valid) {
+            uint32_t frameSeq = frame[6] | (frame[7] << 8) | (frame[8] << 16) | ((uint32_t)frame[9] << 24);
+            MFRC522_CalculateCRC_Software(&frame[1], slot->len - 3, crc);
+            valid = (frameSeq == seq) && (memcmp(crc, &frame[slot->len - 2], 2) == 0);
+        }
+        if (valid) {
+            eventsRestored++;
+        } else {
+            slot->len = 0;
+            eventsLost++;
+        }
+    }
+    EventStoreSave();
+}
+
+/**
+ * @brief Write the ring bookkeeping back to the store
+ */
+void EventStoreSave(void)
+{
+    EventStoreHeader_t *header = &eventStore->header;
+
+    header->magic = EVENT_STORE_MAGIC;
+    header->version = EVENT_STORE_VERSION;
+    header->slots = EVENT_RING_SIZE;
+    header->slotSize = sizeof(EventSlot_t);
+    header->reserved = 0;
+    header->next = eventNext;
+    header->oldest = eventOldest;
+    header->lost = eventsLost;
+    MFRC522_CalculateCRC_Software((const uint8_t *)header, offsetof(EventStoreHeader_t, crc), header->crc);
+}
+
+/**
+ * @brief Whether every reader sits between probes with its field off
+ */
+uint8_t ReadersIdle(void)
+{
+    for (uint8_t r = 0; r < RFID_READER_COUNT; r++) {
+        if (readers[r].scanActive || readers[r].cardInField) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Read a specific block
+ */
+void ExecuteReadBlock(uint8_t blockAddr)
+{
+    MFRC522_Session_t session;
+    MFRC522_Status_t status = CardSessionBegin(&session);
+
     if (status != MFRC522_OK) {
-        qprint("ERROR: Card select failed\r\n");
+        qprint("ERROR: No card present\r\n");
         return;
     }
 
-    // Authenticate
-    status = MFRC522_Auth(PICC_CMD_MF_AUTH_KEY_A, blockAddr, keyA, &uid);
-    if (status != MFRC522_OK) {
-        qprint("ERROR: Authentication failed\r\n");
-        MFRC522_Halt();
+    PICC_Type_t cardType = MFRC522_GetType(session.uid.sak);
+    uint8_t steps = MFRC522_GetSupportedSteps(cardType);
+    if (!(steps & MFRC522_SEQ_READ)) {
+        qprint("ERROR: %s cannot be read\r\n", MFRC522_GetTypeName(cardType));
+        MFRC522_SessionEnd(rfid, &session);
         return;
     }
 
-    // Read block
-    status = MFRC522_Read(blockAddr, readBuffer);
-    if (status == MFRC522_OK) {
-        qprint("Block %d HEX: ", blockAddr);
-        for (uint8_t i = 0; i < 16; i++) {
-            qprint("%02X ", readBuffer[i]);
+    if (steps & MFRC522_SEQ_AUTH) {
+        // Authenticates the block's sector, then reads
+        status = MFRC522_SessionReadBlock(rfid, &session, blockAddr, readBuffer);
+        if (session.authSector < 0) {
+            qprint("ERROR: Authentication failed\r\n");
+            MFRC522_SessionEnd(rfid, &session);
+            return;
         }
+    } else {
+        // Type 2 tag: pages N to N+3, no authentication
+        status = MFRC522_Read(rfid, blockAddr, readBuffer);
+    }
+
+    if (status == MFRC522_OK) {
+        qprint("%s %d HEX: ", (steps & MFRC522_SEQ_AUTH) ? "Block" : "Page", blockAddr);
+        qhex(readBuffer, 16);
         qprint("\r\n");
 
-        qprint("Block %d ASCII: ", blockAddr);
+        qprint("%s %d ASCII: ", (steps & MFRC522_SEQ_AUTH) ? "Block" : "Page", blockAddr);
         for (uint8_t i = 0; i < 16; i++) {
             if (readBuffer[i] >= 0x20 && readBuffer[i] <= 0x7E) {
                 qprint("%c", readBuffer[i]);
@@ -643,76 +1645,678 @@ void ExecuteReadBlock(uint8_t blockAddr)
         qprint("ERROR: Read failed\r\n");
     }
 
-    MFRC522_Halt();
+    MFRC522_SessionEnd(rfid, &session);
 }
 
 /**
- * @brief Write data to a specific block
+ * @brief Read a whole MIFARE Classic card, one authentication per sector,
+ *        and send it to the A7 as one framed response
  */
-void ExecuteWriteBlock(uint8_t blockAddr, uint8_t* data)
+void ExecuteDump(void)
 {
-    uint8_t tagType[2];
-    MFRC522_Status_t status = MFRC522_Request(PICC_CMD_REQA, tagType);
+    MFRC522_Session_t session;
+    MFRC522_Status_t status = CardSessionBegin(&session);
 
     if (status != MFRC522_OK) {
         qprint("ERROR: No card present\r\n");
         return;
     }
 
-    status = MFRC522_Anticoll(&uid);
+    // Pick the read path from the SAK
+    PICC_Type_t cardType = MFRC522_GetType(session.uid.sak);
+    if (cardType == PICC_TYPE_MIFARE_UL) {
+        DumpType2(&session);
+    } else if (MFRC522_GetBlockCount(cardType) != 0) {
+        DumpClassic(&session);
+    } else {
+        qprint("ERROR: %s cannot be dumped\r\n", MFRC522_GetTypeName(cardType));
+    }
+
+    MFRC522_SessionEnd(rfid, &session);
+}
+
+/**
+ * @brief RATS and PPS to the fastest common bit rate, then one APDU exchange
+ *        with ISO-DEP chaining; the card is deselected afterwards
+ */
+void ExecuteApdu(const uint8_t *apdu, uint8_t len)
+{
+    MFRC522_Session_t session;
+    MFRC522_Status_t status = CardSessionBegin(&session);
+
     if (status != MFRC522_OK) {
-        qprint("ERROR: Anticollision failed\r\n");
+        qprint("ERROR: No card present\r\n");
         return;
     }
 
-    status = MFRC522_SelectTag(&uid);
+    PICC_Type_t cardType = MFRC522_GetType(session.uid.sak);
+    if (cardType != PICC_TYPE_ISO_14443_4) {
+        qprint("ERROR: %s does not take APDUs\r\n", MFRC522_GetTypeName(cardType));
+        MFRC522_SessionEnd(rfid, &session);
+        return;
+    }
+
+    status = MFRC522_IsoDepActivate(rfid, &isoDep, MFRC522_BITRATE_848);
     if (status != MFRC522_OK) {
-        qprint("ERROR: Card select failed\r\n");
+        qprint("ERROR: RATS failed\r\n");
+        MFRC522_SessionEnd(rfid, &session);
         return;
     }
 
-    // Authenticate
-    status = MFRC522_Auth(PICC_CMD_MF_AUTH_KEY_A, blockAddr, keyA, &uid);
+    uint16_t respLen;
+    uint32_t start = DWT->CYCCNT;
+    status = MFRC522_IsoDepTransceive(rfid, &isoDep, apdu, len, dumpBuffer, sizeof(dumpBuffer), &respLen);
+    uint32_t us = (DWT->CYCCNT - start) / (SystemCoreClock / 1000000);
+
+    // S(DESELECT) halts the card, HLTA then finds nobody listening
+    MFRC522_IsoDepDeselect(rfid, &isoDep);
+    MFRC522_SessionEnd(rfid, &session);
+
+    qprint("\r\n=== APDU ===\r\n");
+    qprint("ATS: ");
+    qhex(isoDep.ats, isoDep.atsLen);
+    qprint("\r\n");
+    qprint("Bit rate: %d/%d kbit/s, FSC %d\r\n", 106 << isoDep.txRate, 106 << isoDep.rxRate, isoDep.fsc);
+
+    if ((status != MFRC522_OK) || (respLen < 2)) {
+        qprint("ERROR: No response (%d retries)\r\n", isoDep.retries);
+    } else {
+        qprint("Response: ");
+        qhex(dumpBuffer, respLen - 2);
+        qprint("\r\n");
+        qprint("SW: %02X%02X, %d bytes, %d WTX, %lu us\r\n",
+               dumpBuffer[respLen - 2], dumpBuffer[respLen - 1], respLen - 2, isoDep.wtx, us);
+    }
+    qprint("=== End ===\r\n\r\n");
+}
+
+/**
+ * @brief Start of a dump response
+ */
+void DumpHeader(const MFRC522_Session_t *session)
+{
+    // "Card UID:" is left out on purpose, the A7 takes that line as a check-in
+    qprint("\r\n=== Dump ===\r\n");
+    qprint("UID: ");
+    qhex(session->uid.uidByte, session->uid.size);
+    qprint("\r\n");
+}
+
+/**
+ * @brief Dump a MIFARE Classic card, one authentication per sector
+ */
+void DumpClassic(MFRC522_Session_t *session)
+{
+    // Blocks read per sector, a sector stops at its first failed block
+    uint8_t sectorRead[DUMP_MAX_SECTORS];
+    PICC_Type_t cardType = MFRC522_GetType(session->uid.sak);
+    uint16_t blocks = MFRC522_GetBlockCount(cardType);
+
+    // Read everything first, so the timing covers the card and not the RPMsg link
+    uint32_t start = DWT->CYCCNT;
+    uint8_t sectors = MFRC522_SectorOfBlock(blocks - 1) + 1;
+    for (uint8_t s = 0; s < sectors; s++) {
+        uint16_t before = session->blocksRead;
+        MFRC522_SessionReadSector(rfid, session, s, &dumpBuffer[MFRC522_SectorFirstBlock(s) * 16]);
+        sectorRead[s] = session->blocksRead - before;
+    }
+    uint32_t us = (DWT->CYCCNT - start) / (SystemCoreClock / 1000000);
+
+    DumpHeader(session);
+    qprint("Type: %s, %d blocks\r\n", MFRC522_GetTypeName(cardType), blocks);
+
+    for (uint8_t s = 0; s < sectors; s++) {
+        uint8_t first = MFRC522_SectorFirstBlock(s);
+        uint8_t count = MFRC522_SectorBlockCount(s);
+
+        for (uint8_t i = 0; i < count; i++) {
+            qprint("Block %03d: ", first + i);
+            if (i >= sectorRead[s]) {
+                qprint("-- not read\r\n");
+                continue;
+            }
+            qhex(&dumpBuffer[(first + i) * 16], 16);
+            qprint("\r\n");
+        }
+    }
+
+    qprint("Read %d/%d blocks, %d authentications, %lu us\r\n",
+           session->blocksRead, blocks, session->auths, us);
+    qprint("=== End ===\r\n\r\n");
+}
+
+/**
+ * @brief Dump a Type 2 tag: FAST_READ when GET_VERSION names the chip,
+ *        4-page READs of a plain Ultralight otherwise
+ */
+void DumpType2(MFRC522_Session_t *session)
+{
+    uint8_t version[8];
+    uint16_t pages = 0;
+    uint16_t pagesRead = 0;
+    uint8_t fast = 0;
+
+    uint32_t start = DWT->CYCCNT;
+    if (MFRC522_GetVersion(rfid, version) == MFRC522_OK) {
+        pages = MFRC522_GetPageCount(version);
+        fast = (pages != 0);
+    } else {
+        // The tag dropped back to IDLE on the unknown command
+        MFRC522_SessionBegin(rfid, session, PICC_CMD_REQA, PICC_CMD_MF_AUTH_KEY_A, NULL);
+    }
+
+    if (fast) {
+        if (MFRC522_FastRead(rfid, 0, pages - 1, dumpBuffer) == MFRC522_OK) {
+            pagesRead = pages;
+        }
+    } else {
+        pages = MFRC522_UL_PAGES;
+        while ((pagesRead < pages) && (MFRC522_Read(rfid, pagesRead, &dumpBuffer[pagesRead * 4]) == MFRC522_OK)) {
+            pagesRead += 4;
+        }
+    }
+    uint32_t us = (DWT->CYCCNT - start) / (SystemCoreClock / 1000000);
+
+    DumpHeader(session);
+    qprint("Type: %s, %d pages, %s\r\n", MFRC522_GetTypeName(PICC_TYPE_MIFARE_UL), pages,
+           fast ? "FAST_READ" : "READ");
+
+    for (uint16_t p = 0; p < pages; p++) {
+        qprint("Page %03d: ", p);
+        if (p >= pagesRead) {
+            qprint("-- not read\r\n");
+            continue;
+        }
+        qhex(&dumpBuffer[p * 4], 4);
+        qprint("\r\n");
+    }
+
+    qprint("Read %d/%d pages, %lu us\r\n", pagesRead, pages, us);
+    qprint("=== End ===\r\n\r\n");
+}
+
+/**
+ * @brief Write data to a specific block
+ */
+void ExecuteWriteBlock(uint8_t blockAddr, uint8_t* data)
+{
+    MFRC522_Session_t session;
+    MFRC522_Status_t status = CardSessionBegin(&session);
+
     if (status != MFRC522_OK) {
-        qprint("ERROR: Authentication failed\r\n");
-        MFRC522_Halt();
+        qprint("ERROR: No card present\r\n");
         return;
     }
 
-    // Write block
-    status = MFRC522_Write(blockAddr, data);
-    if (status == MFRC522_OK) {
+    status = MFRC522_SessionWriteBlock(rfid, &session, blockAddr, data);
+    if (session.authSector < 0) {
+        qprint("ERROR: Authentication failed\r\n");
+    } else if (status == MFRC522_OK) {
         qprint("SUCCESS: Block %d written\r\n", blockAddr);
 
-        // Verify by reading back
-        status = MFRC522_Read(blockAddr, readBuffer);
+        // Verify by reading back, same sector so no new AUTH
+        status = MFRC522_SessionReadBlock(rfid, &session, blockAddr, readBuffer);
         if (status == MFRC522_OK) {
             qprint("Verify: ");
-            for (uint8_t i = 0; i < 16; i++) {
-                qprint("%02X ", readBuffer[i]);
-            }
+            qhex(readBuffer, 16);
             qprint("\r\n");
         }
     } else {
         qprint("ERROR: Write failed\r\n");
     }
 
-    MFRC522_Halt();
+    MFRC522_SessionEnd(rfid, &session);
 }
 
 /**
- * @brief Print to A7 via Virtual UART
+ * @brief Select the card in the field for reads/writes with the key dictionary
+ */
+MFRC522_Status_t CardSessionBegin(MFRC522_Session_t *session)
+{
+    MFRC522_Status_t status = MFRC522_SessionBegin(rfid, session, PICC_CMD_REQA,
+                                                   PICC_CMD_MF_AUTH_KEY_A, NULL);
+    MFRC522_SessionUseKeys(session, &keyTable, &keyCache);
+    return status;
+}
+
+/**
+ * @brief List the key dictionary, the sector slots in use and the key cache
+ */
+void ExecuteKeyList(void)
+{
+    for (uint8_t k = 0; k < keyTable.count; k++) {
+        qprint("   Key %d (%c): ", k,
+               (keyTable.keys[k].authMode == PICC_CMD_MF_AUTH_KEY_B) ? 'B' : 'A');
+        for (uint8_t i = 0; i < 6; i++) {
+            qprint("%02X", keyTable.keys[k].key[i]);
+        }
+        qprint("\r\n");
+    }
+
+    for (uint8_t s = 0; s < MFRC522_SECTORS_MAX; s++) {
+        if (keyTable.slots[s][0] == MFRC522_KEY_NONE) {
+            continue;
+        }
+        qprint("   Sector %d tries:", s);
+        for (uint8_t i = 0; (i < MFRC522_KEY_SLOTS) && (keyTable.slots[s][i] != MFRC522_KEY_NONE); i++) {
+            qprint(" %d", keyTable.slots[s][i]);
+        }
+        qprint("\r\n");
+    }
+
+    uint8_t cards = 0;
+    for (uint8_t e = 0; e < MFRC522_KEY_CACHE_SIZE; e++) {
+        if (keyCache.entries[e].uidSize != 0) {
+            cards++;
+        }
+    }
+    qprint("   Cache: %d/%d cards, %lu hits, %lu misses\r\n",
+           cards, MFRC522_KEY_CACHE_SIZE, keyCache.hits, keyCache.misses);
+}
+
+/**
+ * @brief Parse up to len bytes of hex digits
+ * @retval Number of bytes parsed
+ */
+uint8_t ParseHex(const char *str, uint8_t *out, uint8_t len)
+{
+    uint8_t count = 0;
+
+    while ((count < len * 2) && (str[count] != '\0')) {
+        char c = str[count];
+        uint8_t nibble;
+
+        if ((c >= '0') && (c <= '9')) {
+            nibble = c - '0';
+        } else if ((c >= 'A') && (c <= 'F')) {
+            nibble = c - 'A' + 10;
+        } else if ((c >= 'a') && (c <= 'f')) {
+            nibble = c - 'a' + 10;
+        } else {
+            break;
+        }
+
+        out[count / 2] = (count % 2) ? ((out[count / 2] << 4) | nibble) : nibble;
+        count++;
+    }
+
+    return count / 2;
+}
+
+/**
+ * @brief Enumerate all cards in the field and report the inventory rate
+ */
+void ExecuteInventory(void)
+{
+    Uid_t cards[MAX_CARDS_PER_SCAN];
+    uint32_t start = DWT->CYCCNT;
+    uint8_t count = MFRC522_Inventory(rfid, cards, MAX_CARDS_PER_SCAN);
+    uint32_t us = (DWT->CYCCNT - start) / (SystemCoreClock / 1000000);
+
+    for (uint8_t c = 0; c < count; c++) {
+        qprint("   Card %d UID: ", c + 1);
+        qhex(cards[c].uidByte, cards[c].size);
+        qprint(" SAK: 0x%02X (%s)\r\n", cards[c].sak,
+               MFRC522_GetTypeName(MFRC522_GetType(cards[c].sak)));
+    }
+
+    qprint("   %d card(s) in %lu us", count, us);
+    if ((count > 0) && (us > 0)) {
+        qprint(", %lu cards/s", (uint32_t)count * 1000000 / us);
+    }
+    qprint("\r\n");
+}
+
+/**
+ * @brief Compare REQA/anticoll/select cost for each transceive/SPI configuration
+ */
+void ExecuteBenchmark(void)
+{
+    const struct {
+        const char* name;
+        MFRC522_WaitMode_t waitMode;
+        bool dma;
+        MFRC522_CrcMode_t crc;
+    } configs[] = {
+        {"poll",          MFRC522_WAIT_POLL, false, MFRC522_CRC_CHIP},
+        {"irq",           MFRC522_WAIT_IRQ,  false, MFRC522_CRC_CHIP},
+        {"irq+dma",       MFRC522_WAIT_IRQ,  true,  MFRC522_CRC_CHIP},
+        {"irq+dma+swcrc", MFRC522_WAIT_IRQ,  true,  MFRC522_CRC_SOFTWARE},
+    };
+    MFRC522_WaitMode_t savedMode = MFRC522_GetWaitMode(rfid);
+    bool savedDma = MFRC522_GetDMA(rfid);
+    MFRC522_CrcMode_t savedCrc = MFRC522_GetCRCMode(rfid);
+    uint8_t tagType[2];
+
+    for (uint8_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+        const char* name = configs[c].name;
+        uint32_t totalCycles = 0;
+        uint32_t startTick;
+        uint8_t done = 0;
+
+        MFRC522_SetWaitMode(rfid, configs[c].waitMode);
+        MFRC522_SetDMA(rfid, configs[c].dma);
+        MFRC522_SetCRCMode(rfid, configs[c].crc);
+        if ((MFRC522_GetWaitMode(rfid) != configs[c].waitMode) || (MFRC522_GetDMA(rfid) != configs[c].dma)) {
+            qprint("   %s: not available, skipped\r\n", name);
+            continue;
+        }
+
+        MFRC522_ResetStats(rfid);
+        startTick = HAL_GetTick();
+        for (uint8_t i = 0; i < BENCH_ITERATIONS; i++) {
+            uint32_t start = DWT->CYCCNT;
+
+            // WUPA so the card halted by the previous iteration answers again
+            MFRC522_Status_t status = MFRC522_Request(rfid, PICC_CMD_WUPA, tagType);
+            if (status == MFRC522_OK) {
+                status = MFRC522_Anticoll(rfid, &uid);
+            }
+            if (status == MFRC522_OK) {
+                status = MFRC522_SelectTag(rfid, &uid);
+            }
+
+            uint32_t cycles = DWT->CYCCNT - start;
+            MFRC522_Halt(rfid);
+
+            if (status == MFRC522_OK) {
+                totalCycles += cycles;
+                done++;
+            }
+        }
+
+        if (done == 0) {
+            qprint("   %s: no card answered\r\n", name);
+            continue;
+        }
+
+        const MFRC522_Stats_t* stats = MFRC522_GetStats(rfid);
+        uint32_t elapsed = HAL_GetTick() - startTick;
+        uint32_t kbps = 0;
+        if (stats->spiCycles != 0) {
+            kbps = (uint32_t)(((uint64_t)stats->spiBytes * 8 * SystemCoreClock) /
+                              ((uint64_t)stats->spiCycles * 1000));
+        }
+        uint32_t busyCycles = (uint32_t)((uint64_t)SystemCoreClock / 1000 * elapsed);
+        uint32_t idlePct = busyCycles ? (uint32_t)((uint64_t)stats->idleCycles * 100 / busyCycles) : 0;
+
+        qprint("   %s: %lu cycles/sequence (%d ok, %lu ms total)\r\n",
+               name, totalCycles / done, done, elapsed);
+        qprint("   %s: %lu SPI frames, %lu bytes per sequence incl. HLTA\r\n",
+               name, stats->spiTransactions / BENCH_ITERATIONS,
+               stats->spiBytes / BENCH_ITERATIONS);
+        qprint("   %s: SPI %lu kbit/s effective, %lu%% CPU idle for the application\r\n",
+               name, kbps, idlePct);
+        qprint("   %s: CRC_A %lu us per sequence\r\n",
+               name, stats->crcCycles / BENCH_ITERATIONS / (SystemCoreClock / 1000000));
+    }
+
+    MFRC522_SetWaitMode(rfid, savedMode);
+    MFRC522_SetDMA(rfid, savedDma);
+    MFRC522_SetCRCMode(rfid, savedCrc);
+}
+
+/**
+ * @brief Check both CRC_A implementations against ISO 14443-3 vectors
+ */
+void ExecuteCrcTest(void)
+{
+    static const struct {
+        uint8_t data[16];
+        uint8_t len;
+        uint8_t crc[2];
+    } vectors[] = {
+        {{0x00, 0x00}, 2, {0xA0, 0x1E}},
+        {{0x12, 0x34}, 2, {0x26, 0xCF}},
+        {{PICC_CMD_HLTA, 0x00}, 2, {0x57, 0xCD}},
+        {{PICC_CMD_MF_READ, 0x04}, 2, {0x26, 0xEE}},
+        {{PICC_CMD_SEL_CL1, 0x70, 0x11, 0x22, 0x33, 0x44, 0x44}, 7, {0x51, 0x9C}},
+        {{0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+          0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F}, 16, {0x77, 0xF5}},
+    };
+    uint32_t softCycles = 0;
+    uint32_t chipCycles = 0;
+    uint8_t failures = 0;
+    uint8_t count = sizeof(vectors) / sizeof(vectors[0]);
+
+    for (uint8_t v = 0; v < count; v++) {
+        uint8_t soft[2];
+        uint8_t chip[2];
+        uint32_t start = DWT->CYCCNT;
+        MFRC522_CalculateCRC_Software(vectors[v].data, vectors[v].len, soft);
+        softCycles += DWT->CYCCNT - start;
+
+        start = DWT->CYCCNT;
+        MFRC522_CalculateCRC_Chip(rfid, vectors[v].data, vectors[v].len, chip);
+        chipCycles += DWT->CYCCNT - start;
+
+        if ((memcmp(soft, vectors[v].crc, 2) != 0) || (memcmp(chip, vectors[v].crc, 2) != 0)) {
+            qprint("   FAIL vector %d: expected %02X %02X, soft %02X %02X, chip %02X %02X\r\n",
+                   v, vectors[v].crc[0], vectors[v].crc[1], soft[0], soft[1], chip[0], chip[1]);
+            failures++;
+        }
+    }
+
+    qprint("   %d/%d vectors passed\r\n", count - failures, count);
+    qprint("   soft: %lu cycles/CRC, chip: %lu cycles/CRC\r\n",
+           softCycles / count, chipCycles / count);
+}
+
+/**
+ * @brief Step the SPI5 prescaler from /256 towards /2 while every reader
+ *        passes MFRC522_SpiTest, without going over the MFRC522's 10 Mbit/s.
+ *        When a rate fails, the one just below it is marginal: settle one
+ *        step slower. Readers without a config (never initialised) are
+ *        skipped. A reader that fails already at /256 is taken for absent:
+ *        it is left out of the decision and flagged in status. A failed step
+ *        can garble register writes, so the readers are initialised again at
+ *        the chosen rate.
+ */
+void SpiCalibrate(void)
+{
+    static const uint32_t prescalers[8] = {
+        SPI_BAUDRATEPRESCALER_256, SPI_BAUDRATEPRESCALER_128, SPI_BAUDRATEPRESCALER_64,
+        SPI_BAUDRATEPRESCALER_32, SPI_BAUDRATEPRESCALER_16, SPI_BAUDRATEPRESCALER_8,
+        SPI_BAUDRATEPRESCALER_4, SPI_BAUDRATEPRESCALER_2,
+    };
+    uint32_t kernelHz = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_SPI45);
+    int8_t best = -1;
+    uint8_t failed = 0;
+    uint8_t tested = 0;
+
+    for (uint8_t r = 0; r < RFID_READER_COUNT; r++) {
+        readers[r].spiAbsent = 0;
+    }
+
+    for (uint8_t p = 0; p < 8; p++) {
+        if (kernelHz / (256 >> p) > SPI_MAX_HZ) {
+            break;
+        }
+
+        SpiSetPrescaler(prescalers[p]);
+        tested = 0;
+        for (uint8_t r = 0; r < RFID_READER_COUNT; r++) {
+            if ((readers[r].dev.config.hspi == NULL) || readers[r].spiAbsent) {
+                continue;
+            }
+            if (MFRC522_SpiTest(&readers[r].dev, SPI_CAL_ITERATIONS)) {
+                tested++;
+            } else if (p == 0) {
+                // Not even /256: a missing or unwired reader must not slow the others down
+                readers[r].spiAbsent = 1;
+            } else {
+                failed = 1;
+            }
+        }
+        if (failed || (tested == 0)) {
+            break;
+        }
+        best = p;
+    }
+
+    spiFastestHz = (best >= 0) ? kernelHz / (256 >> best) : 0;
+    if (failed && (best > 0)) {
+        best--;
+    }
+    if (best < 0) {
+        // Nothing passed: run at the slowest rate, status reports it
+        best = 0;
+    }
+
+    SpiSetPrescaler(prescalers[best]);
+    spiDivider = 256 >> best;
+    spiClockHz = kernelHz / spiDivider;
+
+    for (uint8_t r = 0; r < RFID_READER_COUNT; r++) {
+        if (readers[r].dev.config.hspi == NULL) {
+            continue;
+        }
+        MFRC522_Config_t config = readers[r].dev.config;
+        MFRC522_Init(&readers[r].dev, &config);
+    }
+}
+
+/**
+ * @brief Reprogram the SPI5 baud rate, the bus must be idle
+ */
+static void SpiSetPrescaler(uint32_t prescaler)
+{
+    hspi5.Init.BaudRatePrescaler = prescaler;
+    if (HAL_SPI_Init(&hspi5) != HAL_OK) {
+        Error_Handler();
+    }
+}
+
+/**
+ * @brief Enable the DWT cycle counter used for benchmarking
+ */
+static void CycleCounter_Init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+/**
+ * @brief EXTI falling edge callback, forwards the MFRC522 IRQ pin
+ */
+void HAL_GPIO_EXTI_Falling_Callback(uint16_t GPIO_Pin)
+{
+    for (uint8_t r = 0; r < RFID_READER_COUNT; r++) {
+        if ((readers[r].dev.config.IRQ_GPIO_Port != NULL) && (GPIO_Pin == readers[r].dev.config.IRQ_Pin)) {
+            MFRC522_IRQHandler(&readers[r].dev);
+        }
+    }
+}
+
+/**
+ * @brief SPI DMA completion callbacks, forwarded to the RFID driver
+ */
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    MFRC522_SPI_CpltHandler(hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    MFRC522_SPI_CpltHandler(hspi);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+    MFRC522_SPI_ErrorHandler(hspi);
+}
+
+/**
+ * @brief Print to A7 via Virtual UART. Output is collected in consoleBuf and
+ *        goes out with qflush, or when the next line does not fit.
  */
 void qprint(const char* format, ...) {
-    OPENAMP_check_for_message();
-    char buffer[256];
     va_list args;
     va_start(args, format);
-    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    int len = vsnprintf(&consoleBuf[consoleLen], CONSOLE_BUF_SIZE - consoleLen, format, args);
     va_end(args);
 
+    if ((len > 0) && (consoleLen + len >= CONSOLE_BUF_SIZE) && (consoleLen > 0)) {
+        // Send what is queued and format again at the start
+        qflush();
+        va_start(args, format);
+        len = vsnprintf(consoleBuf, CONSOLE_BUF_SIZE, format, args);
+        va_end(args);
+    }
+
     if (len > 0) {
-        VIRT_UART_Transmit(&huart0, (uint8_t*)buffer, len);
+        // vsnprintf truncated longer output and keeps one byte for the NUL
+        consoleLen += (consoleLen + len < CONSOLE_BUF_SIZE) ? len : CONSOLE_BUF_SIZE - 1 - consoleLen;
+    }
+}
+
+/**
+ * @brief Append one character to the console output
+ */
+void qputc(char c) {
+    if (consoleLen >= CONSOLE_BUF_SIZE - 1) {
+        qflush();
+    }
+    consoleBuf[consoleLen++] = c;
+}
+
+/**
+ * @brief Append a string to the console output, without formatting
+ */
+void qputs(const char *str) {
+    while (*str != '\0') {
+        qputc(*str++);
+    }
+}
+
+/**
+ * @brief Append bytes as "%02X " each, without vsnprintf
+ */
+void qhex(const uint8_t *data, uint16_t len) {
+    for (uint16_t i = 0; i < len; i++) {
+        qbyte(data[i]);
+        qputc(' ');
+    }
+}
+
+/**
+ * @brief Append one byte as "%02X", without vsnprintf
+ */
+void qbyte(uint8_t value) {
+    static const char digits[] = "0123456789ABCDEF";
+
+    qputc(digits[value >> 4]);
+    qputc(digits[value & 0x0F]);
+}
+
+/**
+ * @brief Append an unsigned decimal number, without vsnprintf
+ */
+void qdec(uint32_t value) {
+    char digits[10];
+    uint8_t count = 0;
+
+    do {
+        digits[count++] = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    while (count > 0) {
+        qputc(digits[--count]);
+    }
+}
+
+/**
+ * @brief Send the collected console output as one RPMsg message, without
+ *        waiting: VIRT_UART_Transmit ends in rpmsg_send, which waits up to
+ *        15 s for a buffer. With no free buffer the output is dropped, the
+ *        console is for debugging and scans reach the A7 as events.
+ */
+void qflush(void) {
+    if (consoleLen > 0) {
+        rpmsg_trysend(&huart0.ept, consoleBuf, consoleLen);
+        consoleLen = 0;
     }
 }
 /* USER CODE END 4 */
@@ -3,369 +3,2377 @@
 #include "mfrc522.h"
 #include <string.h>
 
-static MFRC522_Config_t mfrc522_config;
+/* Readers share the SPI bus, so only one DMA transfer is ever in flight */
+static SPI_HandleTypeDef *mfrc522_dma_hspi = NULL;
+static volatile uint8_t mfrc522_dma_busy = 0;
+static void (*mfrc522_idle_hook)(void) = NULL;
+
+/* Shadow copy of configuration registers that only change through our writes */
+#define MFRC522_REG_BIT(reg)  ((uint64_t)1 << (reg))
+#define MFRC522_CACHEABLE_REGS (MFRC522_REG_BIT(MFRC522_REG_COMM_IEN) | \
+                                MFRC522_REG_BIT(MFRC522_REG_DIV_IEN) | \
+                                MFRC522_REG_BIT(MFRC522_REG_WATER_LEVEL) | \
+                                MFRC522_REG_BIT(MFRC522_REG_BIT_FRAMING) | \
+                                MFRC522_REG_BIT(MFRC522_REG_MODE) | \
+                                MFRC522_REG_BIT(MFRC522_REG_TX_MODE) | \
+                                MFRC522_REG_BIT(MFRC522_REG_RX_MODE) | \
+                                MFRC522_REG_BIT(MFRC522_REG_TX_CONTROL) | \
+                                MFRC522_REG_BIT(MFRC522_REG_TX_ASK) | \
+                                MFRC522_REG_BIT(MFRC522_REG_MOD_WIDTH) | \
+                                MFRC522_REG_BIT(MFRC522_REG_T_MODE) | \
+                                MFRC522_REG_BIT(MFRC522_REG_T_PRESCALER) | \
+                                MFRC522_REG_BIT(MFRC522_REG_T_RELOAD_H) | \
+                                MFRC522_REG_BIT(MFRC522_REG_T_RELOAD_L))
+
+/* CRC_A lookup: x^16 + x^12 + x^5 + 1, reflected (0x8408) */
+static const uint16_t mfrc522_crc_a_table[256] = {
+    0x0000, 0x1189, 0x2312, 0x329B, 0x4624, 0x57AD, 0x6536, 0x74BF,
+    0x8C48, 0x9DC1, 0xAF5A, 0xBED3, 0xCA6C, 0xDBE5, 0xE97E, 0xF8F7,
+    0x1081, 0x0108, 0x3393, 0x221A, 0x56A5, 0x472C, 0x75B7, 0x643E,
+    0x9CC9, 0x8D40, 0xBFDB, 0xAE52, 0xDAED, 0xCB64, 0xF9FF, 0xE876,
+    0x2102, 0x308B, 0x0210, 0x1399, 0x6726, 0x76AF, 0x4434, 0x55BD,
+    0xAD4A, 0xBCC3, 0x8E58, 0x9FD1, 0xEB6E, 0xFAE7, 0xC87C, 0xD9F5,
+    0x3183, 0x200A, 0x1291, 0x0318, 0x77A7, 0x662E, 0x54B5, 0x453C,
+    0xBDCB, 0xAC42, 0x9ED9, 0x8F50, 0xFBEF, 0xEA66, 0xD8FD, 0xC974,
+    0x4204, 0x538D, 0x6116, 0x709F, 0x0420, 0x15A9, 0x2732, 0x36BB,
+    0xCE4C, 0xDFC5, 0xED5E, 0xFCD7, 0x8868, 0x99E1, 0xAB7A, 0xBAF3,
+    0x5285, 0x430C, 0x7197, 0x601E, 0x14A1, 0x0528, 0x37B3, 0x263A,
+    0xDECD, 0xCF44, 0xFDDF, 0xEC56, 0x98E9, 0x8960, 0xBBFB, 0xAA72,
+    0x6306, 0x728F, 0x4014, 0x519D, 0x2522, 0x34AB, 0x0630, 0x17B9,
+    0xEF4E, 0xFEC7, 0xCC5C, 0xDDD5, 0xA96A, 0xB8E3, 0x8A78, 0x9BF1,
+    0x7387, 0x620E, 0x5095, 0x411C, 0x35A3, 0x242A, 0x16B1, 0x0738,
+    0xFFCF, 0xEE46, 0xDCDD, 0xCD54, 0xB9EB, 0xA862, 0x9AF9, 0x8B70,
+    0x8408, 0x9581, 0xA71A, 0xB693, 0xC22C, 0xD3A5, 0xE13E, 0xF0B7,
+    0x0840, 0x19C9, 0x2B52, 0x3ADB, 0x4E64, 0x5FED, 0x6D76, 0x7CFF,
+    0x9489, 0x8500, 0xB79B, 0xA612, 0xD2AD, 0xC324, 0xF1BF, 0xE036,
+    0x18C1, 0x0948, 0x3BD3, 0x2A5A, 0x5EE5, 0x4F6C, 0x7DF7, 0x6C7E,
+    0xA50A, 0xB483, 0x8618, 0x9791, 0xE32E, 0xF2A7, 0xC03C, 0xD1B5,
+    0x2942, 0x38CB, 0x0A50, 0x1BD9, 0x6F66, 0x7EEF, 0x4C74, 0x5DFD,
+    0xB58B, 0xA402, 0x9699, 0x8710, 0xF3AF, 0xE226, 0xD0BD, 0xC134,
+    0x39C3, 0x284A, 0x1AD1, 0x0B58, 0x7FE7, 0x6E6E, 0x5CF5, 0x4D7C,
+    0xC60C, 0xD785, 0xE51E, 0xF497, 0x8028, 0x91A1, 0xA33A, 0xB2B3,
+    0x4A44, 0x5BCD, 0x6956, 0x78DF, 0x0C60, 0x1DE9, 0x2F72, 0x3EFB,
+    0xD68D, 0xC704, 0xF59F, 0xE416, 0x90A9, 0x8120, 0xB3BB, 0xA232,
+    0x5AC5, 0x4B4C, 0x79D7, 0x685E, 0x1CE1, 0x0D68, 0x3FF3, 0x2E7A,
+    0xE70E, 0xF687, 0xC41C, 0xD595, 0xA12A, 0xB0A3, 0x8238, 0x93B1,
+    0x6B46, 0x7ACF, 0x4854, 0x59DD, 0x2D62, 0x3CEB, 0x0E70, 0x1FF9,
+    0xF78F, 0xE606, 0xD49D, 0xC514, 0xB1AB, 0xA022, 0x92B9, 0x8330,
+    0x7BC7, 0x6A4E, 0x58D5, 0x495C, 0x3DE3, 0x2C6A, 0x1EF1, 0x0F78,
+};
+
+/* Safety net on top of the chip timer when waiting for the IRQ pin */
+#define MFRC522_IRQ_TIMEOUT_MS  50
+/* Blocking SPI timeout, also used as DMA completion timeout */
+#define MFRC522_SPI_TIMEOUT_MS  100
+/* Shorter transfers are cheaper blocking than setting up two DMA streams */
+#define MFRC522_DMA_MIN_LEN     8
+
+/* Timer ticks at 13.56MHz / (2*0xD3E + 1) ~ 2kHz, period = (reload + 1) * 0.5ms */
+#define MFRC522_T_RELOAD_GUARD   9  // 5ms, ISO 14443-3 allows a PICC that long to power up
+
+/* Timer reload per FWT profile, the timer starts at the end of transmission (TAuto) */
+static const uint16_t mfrc522_fwt_reload[] = {
+    [MFRC522_FWT_SHORT]  = 1,   // 1ms, ATQA arrives ~0.1ms after REQA
+    [MFRC522_FWT_MEDIUM] = 9,   // 5ms
+    [MFRC522_FWT_LONG]   = 29,  // 15ms, MIFARE Classic WRITE needs up to 10ms
+};
+/* ISO/IEC 14443-4 timing: 4096/fc per FWI step, the activation and
+ * deselect frame wait times, and the extra time the reader has to allow */
+#define MFRC522_ISODEP_FWT_UNIT_US        302
+#define MFRC522_ISODEP_FWT_ACTIVATION_US  5286
+#define MFRC522_ISODEP_FWT_DELTA_US       3625
+#define MFRC522_ISODEP_FWT_MAX_US         4949000
+
+/* ISO-DEP block PCBs, without CID and NAD */
+#define MFRC522_ISODEP_I_BLOCK     0x02
+#define MFRC522_ISODEP_CHAINING    0x10
+#define MFRC522_ISODEP_R_ACK       0xA2
+#define MFRC522_ISODEP_R_NAK       0xB2
+#define MFRC522_ISODEP_S_DESELECT  0xC2
+#define MFRC522_ISODEP_S_WTX       0xF2
+
+/* CommandReg PowerDown bit */
+#define MFRC522_COMMAND_POWER_DOWN 0x10
 
 /* Chip Select control */
-#define MFRC522_CS_LOW()   HAL_GPIO_WritePin(mfrc522_config.CS_GPIO_Port, mfrc522_config.CS_Pin, GPIO_PIN_RESET)
-#define MFRC522_CS_HIGH()  HAL_GPIO_WritePin(mfrc522_config.CS_GPIO_Port, mfrc522_config.CS_Pin, GPIO_PIN_SET)
-#define MFRC522_RST_LOW()  HAL_GPIO_WritePin(mfrc522_config.RST_GPIO_Port, mfrc522_config.RST_Pin, GPIO_PIN_RESET)
-#define MFRC522_RST_HIGH() HAL_GPIO_WritePin(mfrc522_config.RST_GPIO_Port, mfrc522_config.RST_Pin, GPIO_PIN_SET)
+#define MFRC522_CS_LOW(dev)   HAL_GPIO_WritePin(dev->config.CS_GPIO_Port, dev->config.CS_Pin, GPIO_PIN_RESET)
+#define MFRC522_CS_HIGH(dev)  HAL_GPIO_WritePin(dev->config.CS_GPIO_Port, dev->config.CS_Pin, GPIO_PIN_SET)
+#define MFRC522_RST_LOW(dev)  HAL_GPIO_WritePin(dev->config.RST_GPIO_Port, dev->config.RST_Pin, GPIO_PIN_RESET)
+#define MFRC522_RST_HIGH(dev) HAL_GPIO_WritePin(dev->config.RST_GPIO_Port, dev->config.RST_Pin, GPIO_PIN_SET)
+
+/* Initialize one MFRC522 reader and its handle */
+void MFRC522_Init(MFRC522_Handle_t *dev, const MFRC522_Config_t *config) {
+    memset(dev, 0, sizeof(MFRC522_Handle_t));
+    memcpy(&dev->config, config, sizeof(MFRC522_Config_t));
+    dev->crcMode = MFRC522_CRC_SOFTWARE;
+
+    MFRC522_CS_HIGH(dev);
+    MFRC522_RST_HIGH(dev);
+    HAL_Delay(10);
+
+    MFRC522_Reset(dev);
+
+    // Timer: TAuto, ~2kHz tick; the reload is set per command by MFRC522_SetFWT
+    MFRC522_WriteRegister(dev, MFRC522_REG_T_MODE, 0x8D);
+    MFRC522_WriteRegister(dev, MFRC522_REG_T_PRESCALER, 0x3E);
+    MFRC522_SetFWT(dev, MFRC522_FWT_LONG);
+
+    MFRC522_WriteRegister(dev, MFRC522_REG_TX_ASK, 0x40);
+    MFRC522_WriteRegister(dev, MFRC522_REG_MODE, 0x3D);
+    MFRC522_SetBitRate(dev, MFRC522_BITRATE_106, MFRC522_BITRATE_106);
+
+    if (dev->config.IRQ_GPIO_Port != NULL) {
+        // IRQ pin push-pull, so no external pull-up is needed
+        MFRC522_WriteRegister(dev, MFRC522_REG_DIV_IEN, 0x80);
+        dev->waitMode = MFRC522_WAIT_IRQ;
+    } else {
+        dev->waitMode = MFRC522_WAIT_POLL;
+    }
+
+    MFRC522_SetDMA(dev, true);
+
+    MFRC522_AntennaOn(dev);
+}
+
+/* Wait until the chip is back in Idle with its oscillator running, instead
+ * of a fixed delay. PowerDown reads back 1 until the oscillator is stable. */
+static void MFRC522_WaitReady(MFRC522_Handle_t *dev) {
+    uint32_t start = HAL_GetTick();
+
+    while ((MFRC522_ReadRegister(dev, MFRC522_REG_COMMAND) & (MFRC522_COMMAND_POWER_DOWN | 0x0F)) &&
+           ((HAL_GetTick() - start) <= MFRC522_IRQ_TIMEOUT_MS)) {
+    }
+}
+
+/* Reset the MFRC522 */
+void MFRC522_Reset(MFRC522_Handle_t *dev) {
+    MFRC522_WriteRegister(dev, MFRC522_REG_COMMAND, MFRC522_CMD_SOFT_RESET);
+    // Every register is back at its reset value, drop the shadow copy
+    dev->shadowValid = 0;
+    dev->poweredDown = false;
+    MFRC522_WaitReady(dev);
+}
+
+/* Check if MFRC522 is present */
+bool MFRC522_Check(MFRC522_Handle_t *dev, uint8_t *version) {
+    *version = MFRC522_ReadRegister(dev, MFRC522_REG_VERSION);
+    return (*version == 0x91 || *version == 0x92);
+}
+
+/* SPI link test for clock calibration: VERSION and a full FIFO written and
+ * read back, with a different pattern each iteration. Only for an idle
+ * chip, it flushes the FIFO. */
+bool MFRC522_SpiTest(MFRC522_Handle_t *dev, uint16_t iterations) {
+    uint8_t pattern[MFRC522_FIFO_SIZE];
+    uint8_t readBack[MFRC522_FIFO_SIZE];
+    bool ok = true;
+
+    for (uint16_t it = 0; ok && (it < iterations); it++) {
+        uint8_t version = MFRC522_ReadRegister(dev, MFRC522_REG_VERSION);
+
+        // Alternating bits, all ones/zeros and a walking one stress the edges
+        for (uint8_t i = 0; i < MFRC522_FIFO_SIZE; i++) {
+            switch (it % 4) {
+                case 0: pattern[i] = (i & 1) ? 0xAA : 0x55; break;
+                case 1: pattern[i] = (i & 1) ? 0x00 : 0xFF; break;
+                case 2: pattern[i] = 1 << ((i + it) % 8); break;
+                default: pattern[i] = (uint8_t)(i * 37 + it); break;
+            }
+        }
+
+        MFRC522_WriteRegister(dev, MFRC522_REG_FIFO_LEVEL, 0x80);
+        MFRC522_WriteFIFO(dev, pattern, MFRC522_FIFO_SIZE);
+        uint8_t level = MFRC522_ReadRegister(dev, MFRC522_REG_FIFO_LEVEL) & 0x7F;
+        MFRC522_ReadFIFO(dev, readBack, MFRC522_FIFO_SIZE);
+
+        ok = ((version == 0x91) || (version == 0x92)) && (level == MFRC522_FIFO_SIZE) &&
+             (memcmp(pattern, readBack, MFRC522_FIFO_SIZE) == 0);
+    }
+
+    MFRC522_WriteRegister(dev, MFRC522_REG_FIFO_LEVEL, 0x80);
+    return ok;
+}
+
+/* Turn on antenna */
+void MFRC522_AntennaOn(MFRC522_Handle_t *dev) {
+    uint8_t temp = MFRC522_ReadRegister(dev, MFRC522_REG_TX_CONTROL);
+    if (!(temp & 0x03)) {
+        MFRC522_SetBitMask(dev, MFRC522_REG_TX_CONTROL, 0x03);
+    }
+}
+
+/* Turn off antenna */
+void MFRC522_AntennaOff(MFRC522_Handle_t *dev) {
+    MFRC522_ClearBitMask(dev, MFRC522_REG_TX_CONTROL, 0x03);
+}
+
+/* Select how MFRC522_ToCard waits for completion */
+void MFRC522_SetWaitMode(MFRC522_Handle_t *dev, MFRC522_WaitMode_t mode) {
+    if ((mode == MFRC522_WAIT_IRQ) && (dev->config.IRQ_GPIO_Port == NULL)) {
+        mode = MFRC522_WAIT_POLL;
+    }
+    dev->waitMode = mode;
+}
+
+MFRC522_WaitMode_t MFRC522_GetWaitMode(MFRC522_Handle_t *dev) {
+    return dev->waitMode;
+}
+
+/* Called from the EXTI callback of the IRQ pin */
+void MFRC522_IRQHandler(MFRC522_Handle_t *dev) {
+    dev->irqFlag = 1;
+}
+
+/* Use DMA for long transfers, only if both SPI DMA streams are linked */
+void MFRC522_SetDMA(MFRC522_Handle_t *dev, bool enable) {
+    SPI_HandleTypeDef *hspi = dev->config.hspi;
+    dev->useDma = enable && (hspi->hdmatx != NULL) && (hspi->hdmarx != NULL);
+}
+
+bool MFRC522_GetDMA(MFRC522_Handle_t *dev) {
+    return dev->useDma;
+}
+
+/* Work run while a transfer or transceive is in flight; must not call the driver */
+void MFRC522_SetIdleHook(void (*hook)(void)) {
+    mfrc522_idle_hook = hook;
+}
+
+/* Called from HAL_SPI_TxCpltCallback / HAL_SPI_TxRxCpltCallback */
+void MFRC522_SPI_CpltHandler(SPI_HandleTypeDef *hspi) {
+    if (hspi == mfrc522_dma_hspi) {
+        mfrc522_dma_busy = 0;
+    }
+}
+
+/* Called from HAL_SPI_ErrorCallback */
+void MFRC522_SPI_ErrorHandler(SPI_HandleTypeDef *hspi) {
+    if (hspi == mfrc522_dma_hspi) {
+        mfrc522_dma_busy = 0;
+    }
+}
+
+static void MFRC522_RunIdleHook(MFRC522_Handle_t *dev) {
+    if (mfrc522_idle_hook != NULL) {
+        uint32_t start = DWT->CYCCNT;
+        mfrc522_idle_hook();
+        dev->stats.idleCycles += DWT->CYCCNT - start;
+    }
+}
+
+/* Wait for the DMA completion callback, running the idle hook meanwhile */
+static void MFRC522_WaitDMA(MFRC522_Handle_t *dev) {
+    uint32_t start = HAL_GetTick();
+
+    while (mfrc522_dma_busy) {
+        if ((HAL_GetTick() - start) > MFRC522_SPI_TIMEOUT_MS) {
+            HAL_SPI_Abort(dev->config.hspi);
+            mfrc522_dma_busy = 0;
+            break;
+        }
+        MFRC522_RunIdleHook(dev);
+    }
+}
+
+/* Sleep until the IRQ pin fires, false on timeout */
+static bool MFRC522_WaitForIrq(MFRC522_Handle_t *dev, uint32_t timeoutMs) {
+    uint32_t start = HAL_GetTick();
+
+    while (!dev->irqFlag) {
+        if ((HAL_GetTick() - start) > timeoutMs) {
+            return false;
+        }
+        MFRC522_RunIdleHook(dev);
+        // WFI still wakes on a pending interrupt while PRIMASK is set,
+        // so an IRQ arriving between the check and the sleep is not lost
+        __disable_irq();
+        if (!dev->irqFlag) {
+            __WFI();
+        }
+        __enable_irq();
+    }
+
+    return true;
+}
+
+/* SPI address bytes */
+#define MFRC522_ADDR_WRITE(reg)  (((reg) << 1) & 0x7E)
+#define MFRC522_ADDR_READ(reg)   ((((reg) << 1) & 0x7E) | 0x80)
+
+/* One CS-framed SPI transfer, rxData may be NULL for writes */
+static void MFRC522_Transfer(MFRC522_Handle_t *dev, const uint8_t *txData, uint8_t *rxData, uint16_t len) {
+    SPI_HandleTypeDef *hspi = dev->config.hspi;
+    uint32_t start = DWT->CYCCNT;
+    HAL_StatusTypeDef ret = HAL_ERROR;
+
+    MFRC522_CS_LOW(dev);
+    if (dev->useDma && (len >= MFRC522_DMA_MIN_LEN)) {
+        mfrc522_dma_hspi = hspi;
+        mfrc522_dma_busy = 1;
+        if (rxData != NULL) {
+            ret = HAL_SPI_TransmitReceive_DMA(hspi, txData, rxData, len);
+        } else {
+            ret = HAL_SPI_Transmit_DMA(hspi, txData, len);
+        }
+        if (ret == HAL_OK) {
+            MFRC522_WaitDMA(dev);
+        } else {
+            mfrc522_dma_busy = 0;
+        }
+    }
+    if (ret != HAL_OK) {
+        if (rxData != NULL) {
+            HAL_SPI_TransmitReceive(hspi, txData, rxData, len, MFRC522_SPI_TIMEOUT_MS);
+        } else {
+            HAL_SPI_Transmit(hspi, txData, len, MFRC522_SPI_TIMEOUT_MS);
+        }
+    }
+    MFRC522_CS_HIGH(dev);
+
+    dev->stats.spiTransactions++;
+    dev->stats.spiBytes += len;
+    dev->stats.spiCycles += DWT->CYCCNT - start;
+}
+
+/* Write to MFRC522 register, redundant writes to cached registers are skipped */
+void MFRC522_WriteRegister(MFRC522_Handle_t *dev, uint8_t reg, uint8_t value) {
+    uint8_t txData[2];
+    uint64_t bit = MFRC522_REG_BIT(reg & 0x3F);
+
+    if (MFRC522_CACHEABLE_REGS & bit) {
+        if ((dev->shadowValid & bit) && (dev->shadow[reg] == value)) {
+            dev->stats.cacheHits++;
+            return;
+        }
+        dev->shadow[reg] = value;
+        dev->shadowValid |= bit;
+    }
+
+    txData[0] = MFRC522_ADDR_WRITE(reg);
+    txData[1] = value;
+
+    MFRC522_Transfer(dev, txData, NULL, 2);
+}
+
+/* Read from MFRC522 register, cached registers are served from the shadow */
+uint8_t MFRC522_ReadRegister(MFRC522_Handle_t *dev, uint8_t reg) {
+    uint8_t txData[2] = {MFRC522_ADDR_READ(reg), 0x00};
+    uint8_t rxData[2] = {0};
+    uint64_t bit = MFRC522_REG_BIT(reg & 0x3F);
+
+    if (dev->shadowValid & bit) {
+        dev->stats.cacheHits++;
+        return dev->shadow[reg];
+    }
+
+    MFRC522_Transfer(dev, txData, rxData, 2);
+
+    if (MFRC522_CACHEABLE_REGS & bit) {
+        dev->shadow[reg] = rxData[1];
+        dev->shadowValid |= bit;
+    }
+
+    return rxData[1];
+}
+
+/* Burst write into the FIFO, the address byte is sent once */
+void MFRC522_WriteFIFO(MFRC522_Handle_t *dev, const uint8_t *data, uint8_t len) {
+    uint8_t txData[MFRC522_FIFO_SIZE + 1];
+
+    if (len == 0) {
+        return;
+    }
+    if (len > MFRC522_FIFO_SIZE) {
+        len = MFRC522_FIFO_SIZE;
+    }
+
+    txData[0] = MFRC522_ADDR_WRITE(MFRC522_REG_FIFO_DATA);
+    memcpy(&txData[1], data, len);
+
+    MFRC522_Transfer(dev, txData, NULL, len + 1);
+}
+
+/* Burst read from the FIFO, the address byte is repeated for every byte */
+void MFRC522_ReadFIFO(MFRC522_Handle_t *dev, uint8_t *data, uint8_t len) {
+    uint8_t regs[MFRC522_FIFO_SIZE];
+
+    if (len == 0) {
+        return;
+    }
+    if (len > MFRC522_FIFO_SIZE) {
+        len = MFRC522_FIFO_SIZE;
+    }
+
+    memset(regs, MFRC522_REG_FIFO_DATA, len);
+    MFRC522_ReadRegisters(dev, regs, data, len);
+}
+
+/* Read several (possibly different) registers in one CS frame */
+void MFRC522_ReadRegisters(MFRC522_Handle_t *dev, const uint8_t *regs, uint8_t *values, uint8_t count) {
+    uint8_t txData[MFRC522_FIFO_SIZE + 1];
+    uint8_t rxData[MFRC522_FIFO_SIZE + 1];
+    uint8_t i;
+
+    if (count == 0) {
+        return;
+    }
+    if (count > MFRC522_FIFO_SIZE) {
+        count = MFRC522_FIFO_SIZE;
+    }
+
+    // Each byte shifted out addresses the next read, the reply to
+    // byte i arrives while byte i+1 is sent; 0x00 ends the frame
+    for (i = 0; i < count; i++) {
+        txData[i] = MFRC522_ADDR_READ(regs[i]);
+    }
+    txData[count] = 0x00;
+
+    MFRC522_Transfer(dev, txData, rxData, count + 1);
+
+    memcpy(values, &rxData[1], count);
+}
+
+/* SPI traffic counters since the last reset */
+const MFRC522_Stats_t* MFRC522_GetStats(MFRC522_Handle_t *dev) {
+    return &dev->stats;
+}
+
+void MFRC522_ResetStats(MFRC522_Handle_t *dev) {
+    memset(&dev->stats, 0, sizeof(dev->stats));
+}
+
+/* Set bit mask in register (write-only for cached registers) */
+void MFRC522_SetBitMask(MFRC522_Handle_t *dev, uint8_t reg, uint8_t mask) {
+    uint8_t tmp = MFRC522_ReadRegister(dev, reg);
+    MFRC522_WriteRegister(dev, reg, tmp | mask);
+}
+
+/* Clear bit mask in register (write-only for cached registers) */
+void MFRC522_ClearBitMask(MFRC522_Handle_t *dev, uint8_t reg, uint8_t mask) {
+    uint8_t tmp = MFRC522_ReadRegister(dev, reg);
+    MFRC522_WriteRegister(dev, reg, tmp & (~mask));
+}
+
+/* Calculate CRC_A with the selected implementation, result is LSB first */
+void MFRC522_CalculateCRC(MFRC522_Handle_t *dev, uint8_t *data, uint8_t len, uint8_t *result) {
+    uint32_t start = DWT->CYCCNT;
+
+    if (dev->crcMode == MFRC522_CRC_CHIP) {
+        MFRC522_CalculateCRC_Chip(dev, data, len, result);
+    } else {
+        MFRC522_CalculateCRC_Software(data, len, result);
+    }
+
+    dev->stats.crcCycles += DWT->CYCCNT - start;
+}
+
+void MFRC522_SetCRCMode(MFRC522_Handle_t *dev, MFRC522_CrcMode_t mode) {
+    dev->crcMode = mode;
+}
+
+MFRC522_CrcMode_t MFRC522_GetCRCMode(MFRC522_Handle_t *dev) {
+    return dev->crcMode;
+}
+
+/* ISO/IEC 14443-3 CRC_A on the M4 (preset 0x6363, no final XOR) */
+void MFRC522_CalculateCRC_Software(const uint8_t *data, uint16_t len, uint8_t *result) {
+    uint16_t crc = 0x6363;
+
+    for (uint16_t i = 0; i < len; i++) {
+        crc = (crc >> 8) ^ mfrc522_crc_a_table[(crc ^ data[i]) & 0xFF];
+    }
+
+    result[0] = crc & 0xFF;
+    result[1] = crc >> 8;
+}
+
+/* CRC_A by the MFRC522 coprocessor, kept for cross-checking */
+void MFRC522_CalculateCRC_Chip(MFRC522_Handle_t *dev, const uint8_t *data, uint8_t len, uint8_t *result) {
+    // Set2 = 0: clear CRCIRq; FlushBuffer is the only writable FIFO_LEVEL bit
+    MFRC522_WriteRegister(dev, MFRC522_REG_DIV_IRQ, 0x04);
+    MFRC522_WriteRegister(dev, MFRC522_REG_FIFO_LEVEL, 0x80);
+
+    MFRC522_WriteFIFO(dev, data, len);
+
+    MFRC522_WriteRegister(dev, MFRC522_REG_COMMAND, MFRC522_CMD_CALC_CRC);
+
+    uint16_t timeout = 5000;
+    uint8_t n;
+    do {
+        n = MFRC522_ReadRegister(dev, MFRC522_REG_DIV_IRQ);
+        timeout--;
+    } while ((timeout != 0) && !(n & 0x04));
+
+    const uint8_t crcRegs[2] = {MFRC522_REG_CRC_RESULT_L, MFRC522_REG_CRC_RESULT_H};
+    MFRC522_ReadRegisters(dev, crcRegs, result, 2);
+}
+
+static void MFRC522_LoadTimer(MFRC522_Handle_t *dev, uint16_t reload) {
+    MFRC522_WriteRegister(dev, MFRC522_REG_T_RELOAD_H, reload >> 8);
+    MFRC522_WriteRegister(dev, MFRC522_REG_T_RELOAD_L, reload & 0xFF);
+}
+
+/* Time the loaded timer runs, rounded up to whole ms */
+static uint32_t MFRC522_TimerMs(MFRC522_Handle_t *dev) {
+    uint16_t reload = (MFRC522_ReadRegister(dev, MFRC522_REG_T_RELOAD_H) << 8) |
+                      MFRC522_ReadRegister(dev, MFRC522_REG_T_RELOAD_L);
+    return (reload + 2) / 2;
+}
+
+/* Load the frame wait time for the next command, the shadow cache makes
+ * repeating the same profile free */
+void MFRC522_SetFWT(MFRC522_Handle_t *dev, MFRC522_Fwt_t fwt) {
+    MFRC522_LoadTimer(dev, mfrc522_fwt_reload[fwt]);
+}
+
+/* Frame wait time in microseconds, for cards that announce their own (FWI).
+ * Rounded up to the 0.5ms tick, reload + 1 adds one more tick of margin. */
+void MFRC522_SetFWTUs(MFRC522_Handle_t *dev, uint32_t us) {
+    uint32_t reload = (us + 499) / 500;
+
+    MFRC522_LoadTimer(dev, (reload > 0xFFFF) ? 0xFFFF : reload);
+}
+
+/* TxSpeed/RxSpeed of the next frames, with the modulation width NXP gives
+ * for each rate. REQA, WUPA and RATS always go at 106 kbit/s. */
+void MFRC522_SetBitRate(MFRC522_Handle_t *dev, MFRC522_BitRate_t txRate, MFRC522_BitRate_t rxRate) {
+    static const uint8_t modWidth[4] = {0x26, 0x15, 0x0A, 0x05};
+
+    MFRC522_WriteRegister(dev, MFRC522_REG_TX_MODE, txRate << 4);
+    MFRC522_WriteRegister(dev, MFRC522_REG_RX_MODE, rxRate << 4);
+    MFRC522_WriteRegister(dev, MFRC522_REG_MOD_WIDTH, modWidth[txRate]);
+}
+
+#define MFRC522_STEP_BIT(step)  (1 << ((step) - 1))
+
+/* Count an RF error in the per-class statistics and pass it on */
+static MFRC522_Status_t MFRC522_RfError(MFRC522_Handle_t *dev, MFRC522_Status_t status) {
+    dev->stats.rfErrors[status]++;
+    return status;
+}
+
+/* Status for the ErrorReg bits of a finished command. BufferOvfl,
+ * ProtocolErr and ParityErr win over CollErr; CRCErr only shows up when
+ * the chip checks CRC_A itself, which the driver does not ask for. */
+static MFRC522_Status_t MFRC522_ErrorStatus(MFRC522_Handle_t *dev, uint8_t error) {
+    if (error & 0x10) {
+        return MFRC522_RfError(dev, MFRC522_OVERFLOW);
+    }
+    if (error & 0x01) {
+        return MFRC522_RfError(dev, MFRC522_PROTOCOL_ERR);
+    }
+    if (error & 0x02) {
+        return MFRC522_RfError(dev, MFRC522_PARITY_ERR);
+    }
+    if (error & 0x04) {
+        return MFRC522_RfError(dev, MFRC522_CRC_ERR);
+    }
+    if (error & 0x08) {
+        return MFRC522_RfError(dev, MFRC522_COLLISION);
+    }
+    return MFRC522_OK;
+}
+
+/* Check the CRC_A that follows len bytes of an answer */
+static bool MFRC522_CrcOk(MFRC522_Handle_t *dev, const uint8_t *data, uint8_t len) {
+    uint8_t crc[2];
+
+    MFRC522_CalculateCRC_Software(data, len, crc);
+    if ((crc[0] != data[len]) || (crc[1] != data[len + 1])) {
+        MFRC522_RfError(dev, MFRC522_CRC_ERR);
+        return false;
+    }
+    return true;
+}
+
+/* Load a command and its data and start it, without waiting */
+static void MFRC522_StartCommand(MFRC522_Handle_t *dev, uint8_t command, const uint8_t *sendData, uint8_t sendLen) {
+    uint8_t irqEn = 0x00;
+    uint8_t waitIRq = 0x00;
+
+    switch (command) {
+        case MFRC522_CMD_MF_AUTHENT:
+            irqEn = 0x12;
+            waitIRq = 0x10;
+            break;
+        case MFRC522_CMD_TRANSCEIVE:
+            irqEn = 0x77;
+            waitIRq = 0x30;
+            break;
+        default:
+            break;
+    }
+
+    if (dev->waitMode == MFRC522_WAIT_IRQ) {
+        // Only route completion and timer events to the pin, TxIRq and
+        // LoAlertIRq would otherwise wake us before the answer arrives
+        irqEn = waitIRq | 0x01;
+    }
+
+    dev->cmdCommand = command;
+    dev->cmdIrqEn = irqEn;
+    dev->cmdWaitIRq = waitIRq;
+    dev->cmdIrq = 0;
+
+    MFRC522_WriteRegister(dev, MFRC522_REG_COMM_IEN, irqEn | 0x80);
+    // Set1 = 0: clear every pending IRQ bit without reading them first
+    MFRC522_WriteRegister(dev, MFRC522_REG_COMM_IRQ, 0x7F);
+    dev->irqFlag = 0;
+    MFRC522_WriteRegister(dev, MFRC522_REG_FIFO_LEVEL, 0x80);
+    MFRC522_WriteRegister(dev, MFRC522_REG_COMMAND, MFRC522_CMD_IDLE);
+
+    MFRC522_WriteFIFO(dev, sendData, sendLen);
+
+    MFRC522_WriteRegister(dev, MFRC522_REG_COMMAND, command);
+
+    if (command == MFRC522_CMD_TRANSCEIVE) {
+        MFRC522_SetBitMask(dev, MFRC522_REG_BIT_FRAMING, 0x80);
+    }
+
+    dev->cmdStart = HAL_GetTick();
+}
+
+/* True while the command is still running. In IRQ mode this costs no SPI
+ * traffic until the pin has fired. The chip timer (SetFWT) ends the wait
+ * when no answer comes, the tick timeout only guards against a chip that
+ * stopped responding. */
+static bool MFRC522_CommandPending(MFRC522_Handle_t *dev) {
+    if (dev->waitMode == MFRC522_WAIT_IRQ) {
+        if (dev->irqFlag) {
+            return false;
+        }
+    } else {
+        dev->cmdIrq = MFRC522_ReadRegister(dev, MFRC522_REG_COMM_IRQ);
+        if (dev->cmdIrq & (dev->cmdWaitIRq | 0x01)) {
+            return false;
+        }
+    }
+
+    return (HAL_GetTick() - dev->cmdStart) <= MFRC522_IRQ_TIMEOUT_MS;
+}
+
+/* Collect the result of a finished command, at most maxLen bytes of the answer */
+static MFRC522_Status_t MFRC522_FinishCommand(MFRC522_Handle_t *dev, uint8_t *backData, uint16_t *backLen,
+                                              uint8_t maxLen) {
+    MFRC522_Status_t status = MFRC522_TIMEOUT;
+    uint8_t lastBits;
+    uint8_t n;
+
+    if (dev->waitMode == MFRC522_WAIT_IRQ) {
+        n = MFRC522_ReadRegister(dev, MFRC522_REG_COMM_IRQ);
+    } else {
+        n = dev->cmdIrq;
+    }
+
+    MFRC522_ClearBitMask(dev, MFRC522_REG_BIT_FRAMING, 0x80);
+
+    if (n & (dev->cmdWaitIRq | 0x01)) {
+        // ERROR, FIFO_LEVEL and CONTROL in a single frame
+        const uint8_t resultRegs[3] = {MFRC522_REG_ERROR, MFRC522_REG_FIFO_LEVEL, MFRC522_REG_CONTROL};
+        uint8_t result[3];
+        MFRC522_ReadRegisters(dev, resultRegs, result, 3);
+
+        // A collision still delivers the bits received before it
+        status = MFRC522_ErrorStatus(dev, result[0]);
+        if ((status == MFRC522_OK) || (status == MFRC522_COLLISION)) {
+            if (n & dev->cmdIrqEn & 0x01) {
+                status = MFRC522_NOTAGERR;
+            }
+
+            if (dev->cmdCommand == MFRC522_CMD_TRANSCEIVE) {
+                n = result[1];
+                lastBits = result[2] & 0x07;
+
+                if (lastBits) {
+                    *backLen = (n - 1) * 8 + lastBits;
+                } else {
+                    *backLen = n * 8;
+                }
+
+                if (n == 0) {
+                    n = 1;
+                }
+                if (n > maxLen) {
+                    // Longer than the caller's buffer: an error, not a shorter answer
+                    n = maxLen;
+                    status = MFRC522_RfError(dev, MFRC522_OVERFLOW);
+                }
+
+                MFRC522_ReadFIFO(dev, backData, n);
+            }
+        }
+    }
+
+    return status;
+}
+
+static MFRC522_Status_t MFRC522_Transceive(MFRC522_Handle_t *dev, uint8_t command, const uint8_t *sendData,
+                                           uint8_t sendLen, uint8_t *backData, uint16_t *backLen, uint8_t maxLen) {
+    MFRC522_StartCommand(dev, command, sendData, sendLen);
+
+    if (dev->waitMode == MFRC522_WAIT_IRQ) {
+        MFRC522_WaitForIrq(dev, MFRC522_IRQ_TIMEOUT_MS);
+    } else {
+        while (MFRC522_CommandPending(dev)) {
+        }
+    }
+
+    return MFRC522_FinishCommand(dev, backData, backLen, maxLen);
+}
+
+/* Communicate with PICC, blocking; backData must hold MFRC522_FIFO_SIZE bytes */
+MFRC522_Status_t MFRC522_ToCard(MFRC522_Handle_t *dev, uint8_t command, uint8_t *sendData, uint8_t sendLen,
+                                 uint8_t *backData, uint16_t *backLen) {
+    return MFRC522_Transceive(dev, command, sendData, sendLen, backData, backLen, MFRC522_FIFO_SIZE);
+}
+
+/* 424 and 848 kbit/s move a FIFO load in 1.2 or 0.6 ms, each service
+ * would cost a wake-up from WFI; TxMode/RxMode come from the shadow */
+static bool MFRC522_HighBitRate(MFRC522_Handle_t *dev) {
+    return (((MFRC522_ReadRegister(dev, MFRC522_REG_TX_MODE) >> 4) & 0x07) >= 2) ||
+           (((MFRC522_ReadRegister(dev, MFRC522_REG_RX_MODE) >> 4) & 0x07) >= 2);
+}
+
+/* ComIEnReg while TransceiveLong sleeps: LoAlertIRq while the frame is
+ * still being loaded, then HiAlertIRq and RxIRq for the answer. Each
+ * alert bit is cleared once the FIFO is serviced. */
+#define MFRC522_IEN_LONG_TX  (0x80 | 0x40 | 0x04 | 0x02 | 0x01)
+#define MFRC522_IEN_LONG_RX  (0x80 | 0x30 | 0x08 | 0x02 | 0x01)
+
+/* Transceive of byte-oriented frames of any length. The first 64 bytes go
+ * into the FIFO before StartSend and the rest is topped up each time the
+ * level falls to the water level; the answer is drained each time it rises
+ * to 64 minus the water level, and once more after RxIRq. Frames whose
+ * answer fits the FIFO take the plain transceive. In IRQ mode the MCU
+ * sleeps between FIFO services up to 212 kbit/s. At 424 and 848 kbit/s
+ * the FIFO needs service every 150-300us, so this polls, except while
+ * the card takes its frame waiting time to answer. backLen is in bytes. */
+MFRC522_Status_t MFRC522_TransceiveLong(MFRC522_Handle_t *dev, const uint8_t *sendData, uint16_t sendLen,
+                                        uint8_t *backData, uint16_t backMax, uint16_t *backLen) {
+    const uint8_t pollRegs[2] = {MFRC522_REG_COMM_IRQ, MFRC522_REG_FIFO_LEVEL};
+    const uint8_t resultRegs[3] = {MFRC522_REG_ERROR, MFRC522_REG_FIFO_LEVEL, MFRC522_REG_CONTROL};
+    uint32_t limitMs = MFRC522_TimerMs(dev) + MFRC522_IRQ_TIMEOUT_MS;
+    uint16_t sent = (sendLen > MFRC522_FIFO_SIZE) ? MFRC522_FIFO_SIZE : sendLen;
+    MFRC522_Status_t status = MFRC522_OK;
+    uint8_t poll[2];
+    uint8_t result[3];
+    bool sleep;
+    bool waitAnswer = false;
+
+    *backLen = 0;
+    MFRC522_WriteRegister(dev, MFRC522_REG_BIT_FRAMING, 0x00);
+
+    if ((sendLen <= MFRC522_FIFO_SIZE) && (backMax <= MFRC522_FIFO_SIZE)) {
+        uint16_t backBits = 0;
+        status = MFRC522_Transceive(dev, MFRC522_CMD_TRANSCEIVE, sendData, sendLen, backData, &backBits, backMax);
+        if (status != MFRC522_OK) {
+            return status;
+        }
+        if (backBits % 8) {
+            // Byte-oriented frames end on a byte boundary
+            return MFRC522_RfError(dev, MFRC522_PROTOCOL_ERR);
+        }
+        *backLen = backBits / 8;
+        return MFRC522_OK;
+    }
+
+    sleep = (dev->waitMode == MFRC522_WAIT_IRQ) && !MFRC522_HighBitRate(dev);
+    MFRC522_WriteRegister(dev, MFRC522_REG_WATER_LEVEL, MFRC522_WATER_LEVEL);
+    MFRC522_StartCommand(dev, MFRC522_CMD_TRANSCEIVE, sendData, sent);
+    if (sleep) {
+        // Loading the FIFO may have raised HiAlertIRq already
+        MFRC522_WriteRegister(dev, MFRC522_REG_COMM_IRQ, 0x0C);
+        MFRC522_WriteRegister(dev, MFRC522_REG_COMM_IEN, (sent < sendLen) ? MFRC522_IEN_LONG_TX : MFRC522_IEN_LONG_RX);
+    }
+
+    for (;;) {
+        if (sleep || waitAnswer) {
+            // The pin can still be low from an IRQ that came in while the
+            // last one was handled; its edge is gone, so look at the level
+            uint32_t elapsed = HAL_GetTick() - dev->cmdStart;
+            dev->irqFlag = 0;
+            if ((elapsed <= limitMs) &&
+                (HAL_GPIO_ReadPin(dev->config.IRQ_GPIO_Port, dev->config.IRQ_Pin) != GPIO_PIN_RESET)) {
+                MFRC522_WaitForIrq(dev, limitMs - elapsed);
+            }
+            waitAnswer = false;
+        }
+
+        MFRC522_ReadRegisters(dev, pollRegs, poll, 2);
+        uint8_t level = poll[1] & 0x7F;
+
+        if (sent < sendLen) {
+            // TxIRq with data still to come: the FIFO ran dry and cut the frame short
+            if (poll[0] & 0x42) {
+                status = MFRC522_ERR;
+                break;
+            }
+            if (level <= MFRC522_WATER_LEVEL) {
+                uint16_t chunk = MFRC522_FIFO_SIZE - level;
+                if (chunk > sendLen - sent) {
+                    chunk = sendLen - sent;
+                }
+                MFRC522_WriteFIFO(dev, &sendData[sent], chunk);
+                sent += chunk;
+                if (sleep) {
+                    MFRC522_WriteRegister(dev, MFRC522_REG_COMM_IRQ, 0x0C);
+                    if (sent == sendLen) {
+                        MFRC522_WriteRegister(dev, MFRC522_REG_COMM_IEN, MFRC522_IEN_LONG_RX);
+                    }
+                }
+            }
+        } else if (poll[0] & (dev->cmdWaitIRq | 0x03)) {
+            // RxIRq, ErrIRq or TimerIRq
+            break;
+        } else if ((poll[0] & 0x40) && (level >= MFRC522_FIFO_SIZE - MFRC522_WATER_LEVEL)) {
+            // Only after TxIRq: until then the level counts bytes still to send
+            if (*backLen + level > backMax) {
+                status = MFRC522_RfError(dev, MFRC522_OVERFLOW);
+                break;
+            }
+            MFRC522_ReadFIFO(dev, &backData[*backLen], level);
+            *backLen += level;
+            if (sleep) {
+                MFRC522_WriteRegister(dev, MFRC522_REG_COMM_IRQ, 0x08);
+            }
+        } else if ((dev->waitMode == MFRC522_WAIT_IRQ) && !sleep && (poll[0] & 0x40) && (level == 0) &&
+                   (*backLen == 0)) {
+            // Sent at 424/848 kbit/s and nothing back yet: sleep through the
+            // frame waiting time, S(WTX) included, until the answer fills
+            // the FIFO or ends, then poll again
+            MFRC522_WriteRegister(dev, MFRC522_REG_COMM_IRQ, 0x0C);
+            MFRC522_WriteRegister(dev, MFRC522_REG_COMM_IEN, MFRC522_IEN_LONG_RX);
+            waitAnswer = true;
+        }
+
+        if ((HAL_GetTick() - dev->cmdStart) > limitMs) {
+            status = MFRC522_TIMEOUT;
+            break;
+        }
+    }
+
+    if (status != MFRC522_OK) {
+        MFRC522_WriteRegister(dev, MFRC522_REG_COMMAND, MFRC522_CMD_IDLE);
+        MFRC522_ClearBitMask(dev, MFRC522_REG_BIT_FRAMING, 0x80);
+        return status;
+    }
+    MFRC522_ClearBitMask(dev, MFRC522_REG_BIT_FRAMING, 0x80);
+
+    // BufferOvfl, CollErr, ParityErr, ProtocolErr; or no answer at all
+    MFRC522_ReadRegisters(dev, resultRegs, result, 3);
+    status = MFRC522_ErrorStatus(dev, result[0]);
+    if (status != MFRC522_OK) {
+        return status;
+    }
+    if (!(poll[0] & dev->cmdWaitIRq) && (*backLen == 0) && ((result[1] & 0x7F) == 0)) {
+        return MFRC522_NOTAGERR;
+    }
+    if (result[2] & 0x07) {
+        // Byte-oriented frames end on a byte boundary
+        return MFRC522_RfError(dev, MFRC522_PROTOCOL_ERR);
+    }
+    if (*backLen + (result[1] & 0x7F) > backMax) {
+        return MFRC522_RfError(dev, MFRC522_OVERFLOW);
+    }
+
+    MFRC522_ReadFIFO(dev, &backData[*backLen], result[1] & 0x7F);
+    *backLen += result[1] & 0x7F;
+
+    return MFRC522_OK;
+}
+
+/* Empty dictionary, no sector has preferred keys */
+void MFRC522_KeyTableInit(MFRC522_KeyTable_t *table) {
+    memset(table, 0, sizeof(*table));
+    memset(table->slots, MFRC522_KEY_NONE, sizeof(table->slots));
+}
+
+/* Set dictionary key `index`, index == count appends. Returns the index, -1 if out of range */
+int8_t MFRC522_KeyTableSet(MFRC522_KeyTable_t *table, uint8_t index, uint8_t authMode, const uint8_t *key) {
+    if ((index > table->count) || (index >= MFRC522_KEYS_MAX)) {
+        return -1;
+    }
+
+    table->keys[index].authMode = authMode;
+    memcpy(table->keys[index].key, key, 6);
+    if (index == table->count) {
+        table->count++;
+    }
+    return index;
+}
+
+/* Keys a sector tries before the rest of the dictionary, count 0 clears them */
+bool MFRC522_KeyTableSetSlots(MFRC522_KeyTable_t *table, uint8_t sector, const uint8_t *indices, uint8_t count) {
+    if ((sector >= MFRC522_SECTORS_MAX) || (count > MFRC522_KEY_SLOTS)) {
+        return false;
+    }
+
+    memset(table->slots[sector], MFRC522_KEY_NONE, MFRC522_KEY_SLOTS);
+    memcpy(table->slots[sector], indices, count);
+    return true;
+}
+
+void MFRC522_KeyCacheInit(MFRC522_KeyCache_t *cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+static MFRC522_KeyCacheEntry_t* MFRC522_KeyCacheFind(MFRC522_KeyCache_t *cache, const Uid_t *uid) {
+    for (uint8_t i = 0; i < MFRC522_KEY_CACHE_SIZE; i++) {
+        MFRC522_KeyCacheEntry_t *entry = &cache->entries[i];
+        if ((entry->uidSize == uid->size) && (memcmp(entry->uidByte, uid->uidByte, uid->size) == 0)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Remember the key that opened a sector; a new card replaces the least
+ * recently used one (free entries have lastUse 0) */
+static void MFRC522_KeyCacheStore(MFRC522_KeyCache_t *cache, const Uid_t *uid, uint8_t sector, uint8_t keyIndex,
+                                  bool firstTry) {
+    MFRC522_KeyCacheEntry_t *entry = MFRC522_KeyCacheFind(cache, uid);
+
+    if (firstTry && (entry != NULL) && (entry->keyIndex[sector] == keyIndex)) {
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+
+    if (entry == NULL) {
+        entry = &cache->entries[0];
+        for (uint8_t i = 1; i < MFRC522_KEY_CACHE_SIZE; i++) {
+            if (cache->entries[i].lastUse < entry->lastUse) {
+                entry = &cache->entries[i];
+            }
+        }
+        entry->uidSize = uid->size;
+        memcpy(entry->uidByte, uid->uidByte, uid->size);
+        memset(entry->keyIndex, MFRC522_KEY_NONE, sizeof(entry->keyIndex));
+    }
+
+    entry->keyIndex[sector] = keyIndex;
+    entry->lastUse = ++cache->clock;
+}
+
+/* Dictionary indices in the order a sector tries them: the key remembered
+ * for this card, the sector's slots, then every other key */
+static uint8_t MFRC522_KeyCandidates(const MFRC522_KeyTable_t *keys, MFRC522_KeyCache_t *cache, const Uid_t *uid,
+                                     uint8_t sector, uint8_t *order) {
+    uint8_t preferred[1 + MFRC522_KEY_SLOTS];
+    uint32_t taken = 0;
+    uint8_t count = 0;
+
+    preferred[0] = MFRC522_KEY_NONE;
+    if (cache != NULL) {
+        MFRC522_KeyCacheEntry_t *entry = MFRC522_KeyCacheFind(cache, uid);
+        if (entry != NULL) {
+            preferred[0] = entry->keyIndex[sector];
+        }
+    }
+    memcpy(&preferred[1], keys->slots[sector], MFRC522_KEY_SLOTS);
+
+    for (uint8_t i = 0; i < sizeof(preferred) + keys->count; i++) {
+        uint8_t index = (i < sizeof(preferred)) ? preferred[i] : (i - sizeof(preferred));
+        if ((index < keys->count) && !(taken & (1UL << index))) {
+            taken |= 1UL << index;
+            order[count++] = index;
+        }
+    }
+
+    return count;
+}
+
+/* Prepare the anticollision frame of the current cascade level */
+static void MFRC522_SeqBeginLevel(MFRC522_Handle_t *dev, MFRC522_Seq_t *seq) {
+    static const uint8_t selCmds[3] = {PICC_CMD_SEL_CL1, PICC_CMD_SEL_CL2, PICC_CMD_SEL_CL3};
+
+    memset(seq->frame, 0, sizeof(seq->frame));
+    seq->frame[0] = selCmds[seq->level];
+    seq->knownBits = 0;
+
+    // ValuesAfterColl = 0: bits received after a collision read back as 0
+    MFRC522_WriteRegister(dev, MFRC522_REG_COLL, 0x00);
+}
+
+/* Move on to the next requested step after the current one */
+static void MFRC522_SeqNext(MFRC522_Handle_t *dev, MFRC522_Seq_t *seq) {
+    if (seq->step != MFRC522_STEP_IDLE) {
+        seq->completed |= MFRC522_STEP_BIT(seq->step);
+    }
+
+    do {
+        seq->step++;
+    } while ((seq->step < MFRC522_STEP_DONE) && !(seq->steps & MFRC522_STEP_BIT(seq->step)));
+
+    switch (seq->step) {
+        case MFRC522_STEP_ANTICOLL:
+            // The UID size stays 0 until the last cascade level is known
+            seq->uid.size = 0;
+            seq->level = 0;
+            MFRC522_SeqBeginLevel(dev, seq);
+            break;
+
+        case MFRC522_STEP_SELECT:
+            // SELECT the last cascade level of the UID
+            switch (seq->uid.size) {
+                case 4:
+                    seq->frame[0] = PICC_CMD_SEL_CL1;
+                    break;
+                case 7:
+                    seq->frame[0] = PICC_CMD_SEL_CL2;
+                    break;
+                case 10:
+                    seq->frame[0] = PICC_CMD_SEL_CL3;
+                    break;
+                default:
+                    seq->status = MFRC522_ERR;
+                    seq->step = MFRC522_STEP_DONE;
+                    return;
+            }
+            memcpy(&seq->frame[2], &seq->uid.uidByte[seq->uid.size - 4], 4);
+            break;
+
+        case MFRC522_STEP_AUTH:
+            if (seq->keys == NULL) {
+                break;
+            }
+            // The candidates depend on the UID, known from here on
+            if (seq->keyTry == 0) {
+                seq->keyCount = MFRC522_KeyCandidates(seq->keys, seq->cache, &seq->uid,
+                                                      MFRC522_SectorOfBlock(seq->blockAddr), seq->keyOrder);
+            }
+            if (seq->keyTry >= seq->keyCount) {
+                seq->status = MFRC522_ERR;
+                seq->step = MFRC522_STEP_DONE;
+                return;
+            }
+            seq->authMode = seq->keys->keys[seq->keyOrder[seq->keyTry]].authMode;
+            seq->key = seq->keys->keys[seq->keyOrder[seq->keyTry]].key;
+            break;
+
+        case MFRC522_STEP_DONE:
+            seq->status = MFRC522_OK;
+            if (seq->retries > 0) {
+                dev->stats.recovered++;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/* The last SELECT was answered with sak: drop the steps this card type
+ * cannot answer, e.g. AUTH on an Ultralight, and AUTH and READ of a card
+ * listed in skipUids */
+static void MFRC522_SeqSelected(MFRC522_Seq_t *seq, uint8_t sak) {
+    seq->uid.sak = sak;
+    seq->steps &= MFRC522_GetSupportedSteps(MFRC522_GetType(sak));
+
+    for (uint8_t i = 0; i < seq->skipCount; i++) {
+        if ((seq->skipUids[i].size == seq->uid.size) &&
+            (memcmp(seq->skipUids[i].uidByte, seq->uid.uidByte, seq->uid.size) == 0)) {
+            seq->steps &= MFRC522_SEQ_REQUEST | MFRC522_SEQ_ANTICOLL | MFRC522_SEQ_SELECT;
+            break;
+        }
+    }
+}
+
+/* Frames that select the card of a running sequence again after an error,
+ * sent by MFRC522_Poll like any other step */
+enum {
+    MFRC522_RESELECT_NONE = 0,
+    MFRC522_RESELECT_HALT,      // HLTA: IDLE or HALT from READY, ACTIVE or authenticated
+    MFRC522_RESELECT_WAKE,      // WUPA
+    MFRC522_RESELECT_SELECT     // SELECT of cascade level seq->level of the known UID
+};
+
+static void MFRC522_SeqFail(MFRC522_Seq_t *seq, MFRC522_Status_t status) {
+    seq->status = (status == MFRC522_OK) ? MFRC522_ERR : status;
+    seq->step = MFRC522_STEP_DONE;
+    seq->reselect = MFRC522_RESELECT_NONE;
+}
+
+/* Cascade levels of a UID, 0 for an invalid size */
+static uint8_t MFRC522_CascadeLevels(const Uid_t *uid) {
+    return (uid->size == 4) ? 1 : (uid->size == 7) ? 2 : (uid->size == 10) ? 3 : 0;
+}
+
+/* SELECT frame of one cascade level of a known UID, CRC_A included (9 bytes) */
+static void MFRC522_KnownSelectFrame(MFRC522_Handle_t *dev, const Uid_t *uid, uint8_t level, uint8_t *frame) {
+    static const uint8_t selCmds[3] = {PICC_CMD_SEL_CL1, PICC_CMD_SEL_CL2, PICC_CMD_SEL_CL3};
+
+    frame[0] = selCmds[level];
+    frame[1] = 0x70;
+    if (level < MFRC522_CascadeLevels(uid) - 1) {
+        // Incomplete UID: cascade tag and three UID bytes
+        frame[2] = PICC_CMD_CT;
+        memcpy(&frame[3], &uid->uidByte[level * 3], 3);
+    } else {
+        memcpy(&frame[2], &uid->uidByte[level * 3], 4);
+    }
+    frame[6] = frame[2] ^ frame[3] ^ frame[4] ^ frame[5];
+    MFRC522_CalculateCRC(dev, frame, 7, &frame[7]);
+}
+
+/* Check the SAK answering the SELECT of one cascade level of a known UID */
+static MFRC522_Status_t MFRC522_KnownSelectCheck(MFRC522_Handle_t *dev, const Uid_t *uid, uint8_t level,
+                                                 MFRC522_Status_t status, const uint8_t *resp, uint16_t backBits) {
+    if ((status == MFRC522_OK) && (backBits != 24)) {
+        status = MFRC522_RfError(dev, MFRC522_PROTOCOL_ERR);
+    }
+    if ((status == MFRC522_OK) && !MFRC522_CrcOk(dev, resp, 1)) {
+        status = MFRC522_CRC_ERR;
+    }
+    // The cascade bit must be set exactly on the incomplete levels
+    if ((status == MFRC522_OK) && (((resp[0] & 0x04) != 0) != (level < MFRC522_CascadeLevels(uid) - 1))) {
+        status = MFRC522_ERR;
+    }
+    return status;
+}
+
+/* REQA or WUPA, then SELECT of every cascade level straight from a known
+ * UID, no anticollision. Blocking, built on ToCard; a running sequence
+ * selects its card again with the MFRC522_RESELECT_* frames instead. The
+ * SAK of the last level goes to sak. */
+static MFRC522_Status_t MFRC522_SelectKnown(MFRC522_Handle_t *dev, const Uid_t *uid, uint8_t reqMode,
+                                            uint8_t *sak) {
+    uint8_t levels = MFRC522_CascadeLevels(uid);
+    uint8_t frame[MFRC522_FIFO_SIZE];
+    uint16_t backBits;
+    MFRC522_Status_t status;
+
+    if (levels == 0) {
+        return MFRC522_ERR;
+    }
+
+    MFRC522_SetBitRate(dev, MFRC522_BITRATE_106, MFRC522_BITRATE_106);
+    MFRC522_WriteRegister(dev, MFRC522_REG_BIT_FRAMING, 0x07);
+    MFRC522_SetFWT(dev, MFRC522_FWT_SHORT);
+    frame[0] = reqMode;
+    status = MFRC522_ToCard(dev, MFRC522_CMD_TRANSCEIVE, frame, 1, frame, &backBits);
+    // Other cards answer as well, their ATQAs may collide
+    if (status == MFRC522_COLLISION) {
+        status = MFRC522_OK;
+    }
+
+    for (uint8_t level = 0; (status == MFRC522_OK) && (level < levels); level++) {
+        MFRC522_KnownSelectFrame(dev, uid, level, frame);
+        MFRC522_WriteRegister(dev, MFRC522_REG_BIT_FRAMING, 0x00);
+        MFRC522_SetFWT(dev, MFRC522_FWT_MEDIUM);
+        status = MFRC522_ToCard(dev, MFRC522_CMD_TRANSCEIVE, frame, 9, frame, &backBits);
+        status = MFRC522_KnownSelectCheck(dev, uid, level, status, frame, backBits);
+    }
+
+    if (status == MFRC522_OK) {
+        *sak = frame[0];
+    }
+    return status;
+}
+
+/* A step failed with status. Silence, parity, CRC and framing errors are
+ * taken for RF trouble and the step is repeated in the same field, up to
+ * MFRC522_SEQ_RETRIES times per sequence; anything else ends it. */
+static void MFRC522_SeqError(MFRC522_Handle_t *dev, MFRC522_Seq_t *seq, MFRC522_Status_t status) {
+    bool transient = (status == MFRC522_NOTAGERR) || (status == MFRC522_PARITY_ERR) ||
+                     (status == MFRC522_CRC_ERR) || (status == MFRC522_PROTOCOL_ERR);
+
+    if (seq->step == MFRC522_STEP_REQUEST) {
+        // No ATQA is an empty field; a garbled one only helps when anticollision follows
+        transient = (status != MFRC522_NOTAGERR) && (seq->steps & MFRC522_SEQ_ANTICOLL);
+    } else {
+        if (status == MFRC522_NOTAGERR) {
+            MFRC522_RfError(dev, status);
+        }
+        if ((seq->step == MFRC522_STEP_READ) && (seq->uid.size == 0)) {
+            // A bare READ does not know its card, the caller selects it again
+            transient = false;
+        }
+    }
+
+    if (!transient || (seq->retries >= MFRC522_SEQ_RETRIES)) {
+        MFRC522_SeqFail(seq, status);
+        return;
+    }
+    seq->retries++;
+    dev->stats.retries++;
+
+    switch (seq->step) {
+        case MFRC522_STEP_REQUEST:
+            // Something answered; anticollision shows whether it is a card
+            MFRC522_SeqNext(dev, seq);
+            break;
+
+        case MFRC522_STEP_ANTICOLL:
+            // The card is still READY, the same frame goes out again
+            break;
+
+        default:
+            // SELECT, AUTH or READ: the card may be READY, ACTIVE or authenticated.
+            // HLTA first, then it is selected again frame by frame.
+            MFRC522_ClearBitMask(dev, MFRC522_REG_STATUS_2, 0x08);
+            seq->reselect = MFRC522_RESELECT_HALT;
+            break;
+    }
+}
+
+/* Send the next frame of the re-selection */
+static void MFRC522_ReselectSend(MFRC522_Handle_t *dev, MFRC522_Seq_t *seq) {
+    uint8_t buff[4];
+
+    switch (seq->reselect) {
+        case MFRC522_RESELECT_HALT:
+            buff[0] = PICC_CMD_HLTA;
+            buff[1] = 0;
+            MFRC522_CalculateCRC(dev, buff, 2, &buff[2]);
+
+            MFRC522_WriteRegister(dev, MFRC522_REG_BIT_FRAMING, 0x00);
+            // No answer is expected, the PICC just has to see the frame
+            MFRC522_SetFWT(dev, MFRC522_FWT_SHORT);
+            MFRC522_StartCommand(dev, MFRC522_CMD_TRANSCEIVE, buff, 4);
+            break;
+
+        case MFRC522_RESELECT_WAKE:
+            MFRC522_SetBitRate(dev, MFRC522_BITRATE_106, MFRC522_BITRATE_106);
+            MFRC522_WriteRegister(dev, MFRC522_REG_BIT_FRAMING, 0x07);
+            MFRC522_SetFWT(dev, MFRC522_FWT_SHORT);
+            buff[0] = PICC_CMD_WUPA;
+            MFRC522_StartCommand(dev, MFRC522_CMD_TRANSCEIVE, buff, 1);
+            break;
+
+        default:
+            MFRC522_KnownSelectFrame(dev, &seq->uid, seq->level, seq->frame);
+            MFRC522_WriteRegister(dev, MFRC522_REG_BIT_FRAMING, 0x00);
+            MFRC522_SetFWT(dev, MFRC522_FWT_MEDIUM);
+            MFRC522_StartCommand(dev, MFRC522_CMD_TRANSCEIVE, seq->frame, 9);
+            break;
+    }
+}
+
+/* Handle the answer to a re-selection frame. Once the card is ACTIVE again
+ * the sequence goes on after SELECT: AUTH (same key) or READ. Halted
+ * neighbours woken by the WUPA drop to IDLE on the SELECT, not back to
+ * HALT, so the next REQA of a scan finds them again. */
+static void MFRC522_ReselectReceive(MFRC522_Handle_t *dev, MFRC522_Seq_t *seq, MFRC522_Status_t status,
+                                    const uint8_t *resp, uint16_t backBits) {
+    switch (seq->reselect) {
+        case MFRC522_RESELECT_HALT:
+            if (seq->uid.size == 0) {
+                // SELECT of an intermediate cascade level: the card was READY and is IDLE now
+                seq->reselect = MFRC522_RESELECT_NONE;
+                seq->steps |= MFRC522_SEQ_REQUEST | MFRC522_SEQ_ANTICOLL | MFRC522_SEQ_SELECT;
+                seq->reqMode = PICC_CMD_REQA;
+                seq->step = MFRC522_STEP_IDLE;
+                MFRC522_SeqNext(dev, seq);
+                break;
+            }
+            // WUPA and SELECT of the known UID: no anticollision
+            seq->reselect = MFRC522_RESELECT_WAKE;
+            break;
+
+        case MFRC522_RESELECT_WAKE:
+            // Halted neighbours answer as well, their ATQAs may collide
+            if ((status != MFRC522_OK) && (status != MFRC522_COLLISION)) {
+                MFRC522_SeqFail(seq, status);
+                break;
+            }
+            seq->reselect = MFRC522_RESELECT_SELECT;
+            seq->level = 0;
+            break;
+
+        default:
+            status = MFRC522_KnownSelectCheck(dev, &seq->uid, seq->level, status, resp, backBits);
+            if (status != MFRC522_OK) {
+                MFRC522_SeqFail(seq, status);
+                break;
+            }
+            if (++seq->level < MFRC522_CascadeLevels(&seq->uid)) {
+                break;
+            }
+            seq->reselect = MFRC522_RESELECT_NONE;
+            MFRC522_SeqSelected(seq, resp[0]);
+            seq->step = MFRC522_STEP_SELECT;
+            MFRC522_SeqNext(dev, seq);
+            break;
+    }
+}
+
+/* Send the frame of the current step */
+static void MFRC522_SeqSend(MFRC522_Handle_t *dev, MFRC522_Seq_t *seq) {
+    uint8_t buff[12];
+    uint8_t i;
+
+    if (seq->reselect != MFRC522_RESELECT_NONE) {
+        MFRC522_ReselectSend(dev, seq);
+        seq->busy = true;
+        return;
+    }
+
+    switch (seq->step) {
+        case MFRC522_STEP_REQUEST:
+            // A card left at a higher bit rate (ISO-DEP) starts over at 106 kbit/s
+            MFRC522_SetBitRate(dev, MFRC522_BITRATE_106, MFRC522_BITRATE_106);
+            MFRC522_WriteRegister(dev, MFRC522_REG_BIT_FRAMING, 0x07);
+            MFRC522_SetFWT(dev, MFRC522_FWT_SHORT);
+            buff[0] = seq->reqMode;
+            MFRC522_StartCommand(dev, MFRC522_CMD_TRANSCEIVE, buff, 1);
+            break;
+
+        case MFRC522_STEP_ANTICOLL: {
+            uint8_t bytes = seq->knownBits / 8;
+            uint8_t bits = seq->knownBits % 8;
+            uint8_t index = 2 + bytes;
+
+            seq->frame[1] = (index << 4) | bits;  // NVB
+            // RxAlign and TxLastBits both split at the first unknown bit
+            MFRC522_WriteRegister(dev, MFRC522_REG_BIT_FRAMING, (bits << 4) | bits);
+            MFRC522_SetFWT(dev, MFRC522_FWT_MEDIUM);
+            MFRC522_StartCommand(dev, MFRC522_CMD_TRANSCEIVE, seq->frame, index + (bits ? 1 : 0));
+            break;
+        }
+
+        case MFRC522_STEP_SELECT:
+            seq->frame[1] = 0x70;
+            seq->frame[6] = seq->frame[2] ^ seq->frame[3] ^ seq->frame[4] ^ seq->frame[5];
+            MFRC522_CalculateCRC(dev, seq->frame, 7, &seq->frame[7]);
+
+            MFRC522_WriteRegister(dev, MFRC522_REG_BIT_FRAMING, 0x00);
+            MFRC522_SetFWT(dev, MFRC522_FWT_MEDIUM);
+            MFRC522_StartCommand(dev, MFRC522_CMD_TRANSCEIVE, seq->frame, 9);
+            break;
+
+        case MFRC522_STEP_AUTH:
+            buff[0] = seq->authMode;
+            buff[1] = seq->blockAddr;
+            for (i = 0; i < 6; i++) {
+                buff[i + 2] = seq->key[i];
+            }
+            // Crypto1 uses the last four UID bytes (CL1 for 4-byte, CL2/CL3 otherwise)
+            for (i = 0; i < 4; i++) {
+                buff[i + 8] = seq->uid.uidByte[i + seq->uid.size - 4];
+            }
+
+            MFRC522_WriteRegister(dev, MFRC522_REG_BIT_FRAMING, 0x00);
+            MFRC522_SetFWT(dev, MFRC522_FWT_MEDIUM);
+            MFRC522_StartCommand(dev, MFRC522_CMD_MF_AUTHENT, buff, 12);
+            break;
+
+        case MFRC522_STEP_READ:
+            buff[0] = PICC_CMD_MF_READ;
+            buff[1] = seq->blockAddr;
+            MFRC522_CalculateCRC(dev, buff, 2, &buff[2]);
+
+            MFRC522_WriteRegister(dev, MFRC522_REG_BIT_FRAMING, 0x00);
+            MFRC522_SetFWT(dev, MFRC522_FWT_MEDIUM);
+            MFRC522_StartCommand(dev, MFRC522_CMD_TRANSCEIVE, buff, 4);
+            break;
+
+        default:
+            return;
+    }
+
+    seq->busy = true;
+}
+
+/* Handle the answer to the current step and pick the next one */
+static void MFRC522_SeqReceive(MFRC522_Handle_t *dev, MFRC522_Seq_t *seq) {
+    MFRC522_Status_t status;
+    uint16_t backBits = 0;
+    uint8_t resp[18];
+
+    status = MFRC522_FinishCommand(dev, resp, &backBits, sizeof(resp));
+    seq->busy = false;
+
+    if (seq->reselect != MFRC522_RESELECT_NONE) {
+        MFRC522_ReselectReceive(dev, seq, status, resp, backBits);
+        return;
+    }
+
+    switch (seq->step) {
+        case MFRC522_STEP_REQUEST:
+            // Several cards answering with different ATQAs collide; anticollision sorts them out
+            if ((status == MFRC522_OK) && (backBits != 0x10)) {
+                status = MFRC522_RfError(dev, MFRC522_PROTOCOL_ERR);
+            }
+            if ((status != MFRC522_OK) && (status != MFRC522_COLLISION)) {
+                MFRC522_SeqError(dev, seq, status);
+                return;
+            }
+            seq->atqa[0] = resp[0];
+            seq->atqa[1] = resp[1];
+            MFRC522_SeqNext(dev, seq);
+            break;
+
+        case MFRC522_STEP_ANTICOLL: {
+            uint8_t bytes = seq->knownBits / 8;
+            uint8_t index = 2 + bytes;
+            uint8_t keepMask = (1 << (seq->knownBits % 8)) - 1;
+
+            if ((status != MFRC522_OK) && (status != MFRC522_COLLISION)) {
+                MFRC522_SeqError(dev, seq, status);
+                return;
+            }
+
+            // The first answer byte continues the partially known byte
+            seq->frame[index] = (seq->frame[index] & keepMask) | (resp[0] & ~keepMask);
+            memcpy(&seq->frame[index + 1], &resp[1], 4 - bytes);
+
+            if (status == MFRC522_COLLISION) {
+                uint8_t coll = MFRC522_ReadRegister(dev, MFRC522_REG_COLL);
+                if (coll & 0x20) {
+                    // CollPosNotValid: collision outside the UID bits
+                    MFRC522_SeqFail(seq, MFRC522_ERR);
+                    return;
+                }
+
+                // CollPos counts from the first FIFO byte, which holds
+                // UID byte `bytes`; 0 stands for 32
+                uint8_t collPos = coll & 0x1F;
+                if (collPos == 0) {
+                    collPos = 32;
+                }
+                collPos += bytes * 8;
+                if ((collPos <= seq->knownBits) || (collPos >= 40)) {
+                    MFRC522_SeqFail(seq, MFRC522_ERR);
+                    return;
+                }
+
+                // Follow the branch with a 1, as ISO 14443-3 allows, and resend
+                seq->knownBits = collPos;
+                seq->frame[2 + (collPos - 1) / 8] |= 1 << ((collPos - 1) % 8);
+                return;
+            }
+
+            if ((seq->frame[2] ^ seq->frame[3] ^ seq->frame[4] ^ seq->frame[5]) != seq->frame[6]) {
+                MFRC522_SeqError(dev, seq, MFRC522_RfError(dev, MFRC522_CRC_ERR));
+                return;
+            }
+
+            if ((seq->frame[2] == PICC_CMD_CT) && (seq->level < 2)) {
+                // Intermediate level: select it and continue one level down
+                memcpy(&seq->uid.uidByte[seq->level * 3], &seq->frame[3], 3);
+                seq->step = MFRC522_STEP_SELECT;
+            } else {
+                memcpy(&seq->uid.uidByte[seq->level * 3], &seq->frame[2], 4);
+                seq->uid.size = seq->level * 3 + 4;
+                MFRC522_SeqNext(dev, seq);
+            }
+            break;
+        }
+
+        case MFRC522_STEP_SELECT:
+            if ((status == MFRC522_OK) && (backBits != 0x18)) {
+                status = MFRC522_RfError(dev, MFRC522_PROTOCOL_ERR);
+            }
+            if ((status == MFRC522_OK) && !MFRC522_CrcOk(dev, resp, 1)) {
+                status = MFRC522_CRC_ERR;
+            }
+            if (status != MFRC522_OK) {
+                MFRC522_SeqError(dev, seq, status);
+                return;
+            }
+
+            if (seq->uid.size == 0) {
+                // Cascade tag without the "UID not complete" bit
+                if (!(resp[0] & 0x04)) {
+                    MFRC522_SeqFail(seq, MFRC522_ERR);
+                    return;
+                }
+                seq->level++;
+                MFRC522_SeqBeginLevel(dev, seq);
+                seq->step = MFRC522_STEP_ANTICOLL;
+            } else {
+                MFRC522_SeqSelected(seq, resp[0]);
+                MFRC522_SeqNext(dev, seq);
+            }
+            break;
+
+        case MFRC522_STEP_AUTH:
+            if ((status != MFRC522_OK) || (!(MFRC522_ReadRegister(dev, MFRC522_REG_STATUS_2) & 0x08))) {
+                if ((seq->keys != NULL) && (++seq->keyTry < seq->keyCount)) {
+                    // The PICC went back to IDLE: WUPA and SELECT of its UID for the next key,
+                    // anticollision could pick another card in the field
+                    MFRC522_ClearBitMask(dev, MFRC522_REG_STATUS_2, 0x08);
+                    seq->reselect = MFRC522_RESELECT_WAKE;
+                    return;
+                }
+                MFRC522_SeqFail(seq, status);
+                return;
+            }
+            if (seq->keys != NULL) {
+                seq->keyIndex = seq->keyOrder[seq->keyTry];
+                if (seq->cache != NULL) {
+                    MFRC522_KeyCacheStore(seq->cache, &seq->uid, MFRC522_SectorOfBlock(seq->blockAddr),
+                                          seq->keyIndex, seq->keyTry == 0);
+                }
+            }
+            MFRC522_SeqNext(dev, seq);
+            break;
+
+        case MFRC522_STEP_READ:
+            if ((status == MFRC522_OK) && (backBits == 4)) {
+                // 4-bit NAK: not authenticated or no such block, not an RF error
+                MFRC522_SeqFail(seq, MFRC522_ERR);
+                return;
+            }
+            if ((status == MFRC522_OK) && (backBits != 0x90)) {
+                status = MFRC522_RfError(dev, MFRC522_PROTOCOL_ERR);
+            }
+            if ((status == MFRC522_OK) && !MFRC522_CrcOk(dev, resp, 16)) {
+                status = MFRC522_CRC_ERR;
+            }
+            if (status != MFRC522_OK) {
+                MFRC522_SeqError(dev, seq, status);
+                return;
+            }
+            memcpy(seq->data, resp, 16);
+            MFRC522_SeqNext(dev, seq);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/* Start an asynchronous sequence, the first frame goes out right away.
+ * Only one sequence runs at a time, a running one is aborted. */
+void MFRC522_SeqStart(MFRC522_Handle_t *dev, MFRC522_Seq_t *seq) {
+    MFRC522_Abort(dev);
+
+    seq->step = MFRC522_STEP_IDLE;
+    seq->status = MFRC522_OK;
+    seq->completed = 0;
+    seq->busy = false;
+    seq->keyTry = 0;
+    seq->retries = 0;
+    seq->reselect = MFRC522_RESELECT_NONE;
+
+    MFRC522_SeqNext(dev, seq);
+    if (seq->step != MFRC522_STEP_DONE) {
+        dev->seq = seq;
+        MFRC522_SeqSend(dev, seq);
+    }
+}
+
+/* Advance the running sequence without blocking. Returns its current step,
+ * MFRC522_STEP_IDLE when no sequence is running. */
+MFRC522_Step_t MFRC522_Poll(MFRC522_Handle_t *dev) {
+    MFRC522_Seq_t *seq = dev->seq;
+
+    if (seq == NULL) {
+        return MFRC522_STEP_IDLE;
+    }
+
+    if (seq->busy) {
+        if (MFRC522_CommandPending(dev)) {
+            return seq->step;
+        }
+        MFRC522_SeqReceive(dev, seq);
+    }
+
+    if (seq->step == MFRC522_STEP_DONE) {
+        dev->seq = NULL;
+    } else if (!seq->busy) {
+        MFRC522_SeqSend(dev, seq);
+    }
+
+    return seq->step;
+}
+
+/* Stop the running sequence, it finishes with MFRC522_ERR */
+void MFRC522_Abort(MFRC522_Handle_t *dev) {
+    MFRC522_Seq_t *seq = dev->seq;
+
+    if (seq == NULL) {
+        return;
+    }
+
+    if (seq->busy) {
+        MFRC522_WriteRegister(dev, MFRC522_REG_COMMAND, MFRC522_CMD_IDLE);
+        MFRC522_ClearBitMask(dev, MFRC522_REG_BIT_FRAMING, 0x80);
+        seq->busy = false;
+    }
+    MFRC522_SeqFail(seq, MFRC522_ERR);
+    dev->seq = NULL;
+}
+
+/* Run a sequence to the end, sleeping on the IRQ pin where possible */
+MFRC522_Status_t MFRC522_RunSequence(MFRC522_Handle_t *dev, MFRC522_Seq_t *seq) {
+    MFRC522_SeqStart(dev, seq);
+
+    while (seq->step != MFRC522_STEP_DONE) {
+        if (seq->busy && (dev->waitMode == MFRC522_WAIT_IRQ)) {
+            MFRC522_WaitForIrq(dev, MFRC522_IRQ_TIMEOUT_MS);
+        }
+        MFRC522_Poll(dev);
+    }
+
+    return seq->status;
+}
+
+/* Request tag */
+MFRC522_Status_t MFRC522_Request(MFRC522_Handle_t *dev, uint8_t reqMode, uint8_t *tagType) {
+    MFRC522_Seq_t seq = {.steps = MFRC522_SEQ_REQUEST, .reqMode = reqMode};
+    MFRC522_Status_t status = MFRC522_RunSequence(dev, &seq);
+
+    tagType[0] = seq.atqa[0];
+    tagType[1] = seq.atqa[1];
+
+    return status;
+}
+
+/* Anti-collision detection over cascade levels 1 to 3.
+ * Intermediate levels (UID CLn starting with the cascade tag) are selected
+ * on the way; the last level is left for MFRC522_SelectTag. */
+MFRC522_Status_t MFRC522_Anticoll(MFRC522_Handle_t *dev, Uid_t *uid) {
+    MFRC522_Seq_t seq = {.steps = MFRC522_SEQ_ANTICOLL};
+    MFRC522_Status_t status = MFRC522_RunSequence(dev, &seq);
+
+    if (status == MFRC522_OK) {
+        uid->size = seq.uid.size;
+        memcpy(uid->uidByte, seq.uid.uidByte, seq.uid.size);
+    }
+
+    return status;
+}
+
+/* Select tag: SELECT the last cascade level of a UID found by MFRC522_Anticoll */
+MFRC522_Status_t MFRC522_SelectTag(MFRC522_Handle_t *dev, Uid_t *uid) {
+    MFRC522_Seq_t seq = {.steps = MFRC522_SEQ_SELECT, .uid = *uid};
+    MFRC522_Status_t status = MFRC522_RunSequence(dev, &seq);
+
+    if (status == MFRC522_OK) {
+        uid->sak = seq.uid.sak;
+    }
+
+    return status;
+}
+
+/* Authenticate */
+MFRC522_Status_t MFRC522_Auth(MFRC522_Handle_t *dev, uint8_t authMode, uint8_t blockAddr, uint8_t *key, Uid_t *uid) {
+    MFRC522_Seq_t seq = {.steps = MFRC522_SEQ_AUTH, .authMode = authMode,
+                         .blockAddr = blockAddr, .key = key, .uid = *uid};
+
+    return MFRC522_RunSequence(dev, &seq);
+}
+
+/* Read block */
+MFRC522_Status_t MFRC522_Read(MFRC522_Handle_t *dev, uint8_t blockAddr, uint8_t *recvData) {
+    MFRC522_Seq_t seq = {.steps = MFRC522_SEQ_READ, .blockAddr = blockAddr};
+    MFRC522_Status_t status = MFRC522_RunSequence(dev, &seq);
+
+    if (status == MFRC522_OK) {
+        memcpy(recvData, seq.data, 16);
+    }
+
+    return status;
+}
+
+/* Write block */
+MFRC522_Status_t MFRC522_Write(MFRC522_Handle_t *dev, uint8_t blockAddr, uint8_t *writeData) {
+    MFRC522_Status_t status;
+    uint16_t recvBits;
+    uint8_t i;
+    uint8_t buff[MFRC522_FIFO_SIZE];
 
-/* Initialize MFRC522 */
-void MFRC522_Init(MFRC522_Config_t *config) {
-    memcpy(&mfrc522_config, config, sizeof(MFRC522_Config_t));
+    buff[0] = PICC_CMD_MF_WRITE;
+    buff[1] = blockAddr;
+    MFRC522_CalculateCRC(dev, buff, 2, &buff[2]);
 
-    MFRC522_CS_HIGH();
-    MFRC522_RST_HIGH();
-    HAL_Delay(10);
+    MFRC522_SetFWT(dev, MFRC522_FWT_MEDIUM);
+    status = MFRC522_ToCard(dev, MFRC522_CMD_TRANSCEIVE, buff, 4, buff, &recvBits);
 
-    MFRC522_Reset();
+    if ((status != MFRC522_OK) || (recvBits != 4) || ((buff[0] & 0x0F) != 0x0A)) {
+        status = MFRC522_ERR;
+    }
 
-    // Timer: TPrescaler*TreloadVal/6.78MHz = 24ms
-    MFRC522_WriteRegister(MFRC522_REG_T_MODE, 0x8D);
-    MFRC522_WriteRegister(MFRC522_REG_T_PRESCALER, 0x3E);
-    MFRC522_WriteRegister(MFRC522_REG_T_RELOAD_L, 30);
-    MFRC522_WriteRegister(MFRC522_REG_T_RELOAD_H, 0);
+    if (status == MFRC522_OK) {
+        for (i = 0; i < 16; i++) {
+            buff[i] = writeData[i];
+        }
 
-    MFRC522_WriteRegister(MFRC522_REG_TX_ASK, 0x40);
-    MFRC522_WriteRegister(MFRC522_REG_MODE, 0x3D);
+        MFRC522_CalculateCRC(dev, buff, 16, &buff[16]);
+        MFRC522_SetFWT(dev, MFRC522_FWT_LONG);
+        status = MFRC522_ToCard(dev, MFRC522_CMD_TRANSCEIVE, buff, 18, buff, &recvBits);
 
-    MFRC522_AntennaOn();
-}
+        if ((status != MFRC522_OK) || (recvBits != 4) || ((buff[0] & 0x0F) != 0x0A)) {
+            status = MFRC522_ERR;
+        }
+    }
 
-/* Reset the MFRC522 */
-void MFRC522_Reset(void) {
-    MFRC522_WriteRegister(MFRC522_REG_COMMAND, MFRC522_CMD_SOFT_RESET);
-    HAL_Delay(50);
+    return status;
 }
 
-/* Check if MFRC522 is present */
-bool MFRC522_Check(uint8_t *version) {
-    *version = MFRC522_ReadRegister(MFRC522_REG_VERSION);
-    return (*version == 0x91 || *version == 0x92);
+/* GET_VERSION of an Ultralight EV1 / NTAG, 8 bytes. Older Type 2 tags
+ * do not know it and drop back to IDLE, they need a new REQA. */
+MFRC522_Status_t MFRC522_GetVersion(MFRC522_Handle_t *dev, uint8_t *version) {
+    MFRC522_Status_t status;
+    uint16_t recvBits;
+    uint8_t buff[10];
+
+    buff[0] = PICC_CMD_UL_GET_VERSION;
+    MFRC522_CalculateCRC(dev, buff, 1, &buff[1]);
+
+    MFRC522_WriteRegister(dev, MFRC522_REG_BIT_FRAMING, 0x00);
+    MFRC522_SetFWT(dev, MFRC522_FWT_MEDIUM);
+    status = MFRC522_Transceive(dev, MFRC522_CMD_TRANSCEIVE, buff, 3, buff, &recvBits, sizeof(buff));
+    if (status != MFRC522_OK) {
+        return status;
+    }
+    if (recvBits != 10 * 8) {
+        // Older tags NAK or stay silent, GET_VERSION is optional
+        return MFRC522_ERR;
+    }
+    if (!MFRC522_CrcOk(dev, buff, 8)) {
+        return MFRC522_CRC_ERR;
+    }
+
+    memcpy(version, buff, 8);
+    return MFRC522_OK;
 }
 
-/* Turn on antenna */
-void MFRC522_AntennaOn(void) {
-    uint8_t temp = MFRC522_ReadRegister(MFRC522_REG_TX_CONTROL);
-    if (!(temp & 0x03)) {
-        MFRC522_SetBitMask(MFRC522_REG_TX_CONTROL, 0x03);
+/* FAST_READ of pages startPage..endPage (NTAG, Ultralight EV1), up to
+ * MFRC522_FAST_READ_PAGES per frame. recvData holds (endPage - startPage + 1) * 4 bytes. */
+MFRC522_Status_t MFRC522_FastRead(MFRC522_Handle_t *dev, uint8_t startPage, uint8_t endPage, uint8_t *recvData) {
+    uint8_t buff[MFRC522_FAST_READ_PAGES * MFRC522_PAGE_SIZE + 2];
+
+    if (startPage > endPage) {
+        return MFRC522_ERR;
+    }
+
+    MFRC522_WriteRegister(dev, MFRC522_REG_BIT_FRAMING, 0x00);
+    MFRC522_SetFWT(dev, MFRC522_FWT_MEDIUM);
+
+    for (uint16_t page = startPage; page <= endPage; page += MFRC522_FAST_READ_PAGES) {
+        uint8_t last = (endPage - page >= MFRC522_FAST_READ_PAGES) ? page + MFRC522_FAST_READ_PAGES - 1 : endPage;
+        uint8_t len = (last - page + 1) * MFRC522_PAGE_SIZE;
+        uint16_t recvLen;
+
+        buff[0] = PICC_CMD_UL_FAST_READ;
+        buff[1] = page;
+        buff[2] = last;
+        MFRC522_CalculateCRC(dev, buff, 3, &buff[3]);
+
+        // Up to 15 pages the answer fits the FIFO and takes the plain transceive
+        MFRC522_Status_t status = MFRC522_TransceiveLong(dev, buff, 5, buff, len + 2, &recvLen);
+        if (status != MFRC522_OK) {
+            return status;
+        }
+        if (recvLen != len + 2) {
+            return MFRC522_RfError(dev, MFRC522_PROTOCOL_ERR);
+        }
+        if (!MFRC522_CrcOk(dev, buff, len)) {
+            return MFRC522_CRC_ERR;
+        }
+
+        memcpy(&recvData[(page - startPage) * MFRC522_PAGE_SIZE], buff, len);
     }
+
+    return MFRC522_OK;
 }
 
-/* Turn off antenna */
-void MFRC522_AntennaOff(void) {
-    MFRC522_ClearBitMask(MFRC522_REG_TX_CONTROL, 0x03);
+/* Halt tag */
+void MFRC522_Halt(MFRC522_Handle_t *dev) {
+    uint16_t unLen;
+    uint8_t buff[MFRC522_FIFO_SIZE];
+
+    buff[0] = PICC_CMD_HLTA;
+    buff[1] = 0;
+    MFRC522_CalculateCRC(dev, buff, 2, &buff[2]);
+
+    // No answer is expected, the PICC just has to see the frame
+    MFRC522_SetFWT(dev, MFRC522_FWT_SHORT);
+    MFRC522_ToCard(dev, MFRC522_CMD_TRANSCEIVE, buff, 4, buff, &unLen);
 }
 
-/* Write to MFRC522 register */
-void MFRC522_WriteRegister(uint8_t reg, uint8_t value) {
-    uint8_t txData[2];
-    txData[0] = (reg << 1) & 0x7E;
-    txData[1] = value;
+/* Enumerate every PICC in the field: anticoll, select and halt one card
+ * at a time until nothing answers REQA any more. Returns the UID count. */
+uint8_t MFRC522_Inventory(MFRC522_Handle_t *dev, Uid_t *uids, uint8_t maxCards) {
+    uint8_t tagType[2];
+    uint8_t count = 0;
+    uint8_t failures = 0;
+    // WUPA first so cards halted by an earlier scan are included
+    uint8_t reqMode = PICC_CMD_WUPA;
+
+    while ((count < maxCards) && (failures < 3)) {
+        if (MFRC522_Request(dev, reqMode, tagType) != MFRC522_OK) {
+            break;
+        }
+        reqMode = PICC_CMD_REQA;
+
+        Uid_t *uid = &uids[count];
+        if ((MFRC522_Anticoll(dev, uid) != MFRC522_OK) || (MFRC522_SelectTag(dev, uid) != MFRC522_OK)) {
+            failures++;
+            continue;
+        }
+        MFRC522_Halt(dev);
+
+        // A card that missed its HLTA answers again, do not list it twice
+        bool seen = false;
+        for (uint8_t i = 0; i < count; i++) {
+            if ((uids[i].size == uid->size) && (memcmp(uids[i].uidByte, uid->uidByte, uid->size) == 0)) {
+                seen = true;
+                break;
+            }
+        }
+        if (seen) {
+            failures++;
+        } else {
+            count++;
+        }
+    }
 
-    MFRC522_CS_LOW();
-    HAL_SPI_Transmit(mfrc522_config.hspi, txData, 2, 100);
-    MFRC522_CS_HIGH();
+    return count;
 }
 
-/* Read from MFRC522 register */
-uint8_t MFRC522_ReadRegister(uint8_t reg) {
-    uint8_t txData = ((reg << 1) & 0x7E) | 0x80;
-    uint8_t rxData = 0;
+/* Presence check of a card whose UID is known: WUPA, SELECT by UID and
+ * HLTA. Other halted cards woken by the WUPA drop to IDLE on the SELECT;
+ * MFRC522_HaltCard puts them back to HALT once every card is checked. */
+bool MFRC522_CheckCard(MFRC522_Handle_t *dev, const Uid_t *uid) {
+    uint8_t sak;
+    bool present = (MFRC522_SelectKnown(dev, uid, PICC_CMD_WUPA, &sak) == MFRC522_OK);
 
-    MFRC522_CS_LOW();
-    HAL_SPI_Transmit(mfrc522_config.hspi, &txData, 1, 100);
-    HAL_SPI_Receive(mfrc522_config.hspi, &rxData, 1, 100);
-    MFRC522_CS_HIGH();
+    MFRC522_Halt(dev);
 
-    return rxData;
+    return present;
 }
 
-/* Set bit mask in register */
-void MFRC522_SetBitMask(uint8_t reg, uint8_t mask) {
-    uint8_t tmp = MFRC522_ReadRegister(reg);
-    MFRC522_WriteRegister(reg, tmp | mask);
+/* REQA, SELECT by UID and HLTA: a known card left in IDLE goes back to
+ * HALT. A card that is halted already does not answer the REQA, so this
+ * costs one short frame then. */
+void MFRC522_HaltCard(MFRC522_Handle_t *dev, const Uid_t *uid) {
+    uint8_t sak;
+
+    if (MFRC522_SelectKnown(dev, uid, PICC_CMD_REQA, &sak) == MFRC522_OK) {
+        MFRC522_Halt(dev);
+    }
 }
 
-/* Clear bit mask in register */
-void MFRC522_ClearBitMask(uint8_t reg, uint8_t mask) {
-    uint8_t tmp = MFRC522_ReadRegister(reg);
-    MFRC522_WriteRegister(reg, tmp & (~mask));
+/* Start a card session: REQA/WUPA, anticollision and SELECT of one card.
+ * No sector is authenticated yet, that happens on the first read. */
+MFRC522_Status_t MFRC522_SessionBegin(MFRC522_Handle_t *dev, MFRC522_Session_t *sess, uint8_t reqMode,
+                                      uint8_t authMode, const uint8_t *key) {
+    MFRC522_Seq_t seq = {.steps = MFRC522_SEQ_REQUEST | MFRC522_SEQ_ANTICOLL | MFRC522_SEQ_SELECT,
+                         .reqMode = reqMode};
+    MFRC522_Status_t status = MFRC522_RunSequence(dev, &seq);
+
+    memset(sess, 0, sizeof(*sess));
+    sess->uid = seq.uid;
+    sess->atqa[0] = seq.atqa[0];
+    sess->atqa[1] = seq.atqa[1];
+    sess->authMode = authMode;
+    sess->key = key;
+    sess->authSector = -1;
+
+    return status;
 }
 
-/* Calculate CRC */
-void MFRC522_CalculateCRC(uint8_t *data, uint8_t len, uint8_t *result) {
-    MFRC522_ClearBitMask(MFRC522_REG_DIV_IRQ, 0x04);
-    MFRC522_SetBitMask(MFRC522_REG_FIFO_LEVEL, 0x80);
+/* Open the Crypto1 session of a sector, re-selecting the card first when
+ * an earlier AUTH failed */
+static MFRC522_Status_t MFRC522_SessionAuth(MFRC522_Handle_t *dev, MFRC522_Session_t *sess, uint8_t sector) {
+    MFRC522_Seq_t seq = {.steps = MFRC522_SEQ_AUTH, .authMode = sess->authMode,
+                         .blockAddr = MFRC522_SectorFirstBlock(sector), .key = sess->key, .uid = sess->uid,
+                         .keys = sess->keys, .cache = sess->cache};
+    MFRC522_Status_t status;
 
-    for (uint8_t i = 0; i < len; i++) {
-        MFRC522_WriteRegister(MFRC522_REG_FIFO_DATA, data[i]);
+    if (sess->needSelect) {
+        // The card fell back to IDLE, REQA keeps halted cards in the field quiet
+        seq.steps |= MFRC522_SEQ_REQUEST | MFRC522_SEQ_ANTICOLL | MFRC522_SEQ_SELECT;
+        seq.reqMode = PICC_CMD_REQA;
     }
 
-    MFRC522_WriteRegister(MFRC522_REG_COMMAND, MFRC522_CMD_CALC_CRC);
+    // The PICC ends the open session as soon as the next AUTH starts
+    sess->authSector = -1;
+    sess->auths++;
+    status = MFRC522_RunSequence(dev, &seq);
 
-    uint16_t timeout = 5000;
-    uint8_t n;
-    do {
-        n = MFRC522_ReadRegister(MFRC522_REG_DIV_IRQ);
-        timeout--;
-    } while ((timeout != 0) && !(n & 0x04));
+    if ((seq.completed & MFRC522_SEQ_ANTICOLL) &&
+        ((seq.uid.size != sess->uid.size) || (memcmp(seq.uid.uidByte, sess->uid.uidByte, seq.uid.size) != 0))) {
+        // Another card answered, the session's card has left the field
+        status = MFRC522_ERR;
+    }
+
+    if (status != MFRC522_OK) {
+        MFRC522_ClearBitMask(dev, MFRC522_REG_STATUS_2, 0x08);
+        sess->needSelect = true;
+        return status;
+    }
 
-    result[0] = MFRC522_ReadRegister(MFRC522_REG_CRC_RESULT_L);
-    result[1] = MFRC522_ReadRegister(MFRC522_REG_CRC_RESULT_H);
+    sess->needSelect = false;
+    sess->authSector = sector;
+    return MFRC522_OK;
 }
 
-/* Communicate with PICC */
-MFRC522_Status_t MFRC522_ToCard(uint8_t command, uint8_t *sendData, uint8_t sendLen,
-                                 uint8_t *backData, uint16_t *backLen) {
-    MFRC522_Status_t status = MFRC522_ERR;
-    uint8_t irqEn = 0x00;
-    uint8_t waitIRq = 0x00;
-    uint8_t lastBits;
-    uint8_t n;
-    uint16_t i;
+/* Authenticate with the key dictionary instead of the single session key */
+void MFRC522_SessionUseKeys(MFRC522_Session_t *sess, const MFRC522_KeyTable_t *keys, MFRC522_KeyCache_t *cache) {
+    sess->keys = keys;
+    sess->cache = cache;
+}
 
-    switch (command) {
-        case MFRC522_CMD_MF_AUTHENT:
-            irqEn = 0x12;
-            waitIRq = 0x10;
-            break;
-        case MFRC522_CMD_TRANSCEIVE:
-            irqEn = 0x77;
-            waitIRq = 0x30;
-            break;
-        default:
-            break;
+/* Make sure the sector of a block is open, authenticating only when the
+ * block lies outside the sector opened last */
+static MFRC522_Status_t MFRC522_SessionOpen(MFRC522_Handle_t *dev, MFRC522_Session_t *sess, uint8_t blockAddr) {
+    uint8_t sector = MFRC522_SectorOfBlock(blockAddr);
+
+    if ((sess->authSector == sector) && !sess->needSelect) {
+        return MFRC522_OK;
     }
+    return MFRC522_SessionAuth(dev, sess, sector);
+}
+
+/* A NAK or a lost frame leaves the card in IDLE (or HALT), the next access
+ * selects and authenticates again */
+static void MFRC522_SessionLost(MFRC522_Handle_t *dev, MFRC522_Session_t *sess) {
+    MFRC522_ClearBitMask(dev, MFRC522_REG_STATUS_2, 0x08);
+    sess->needSelect = true;
+}
 
-    MFRC522_WriteRegister(MFRC522_REG_COMM_IEN, irqEn | 0x80);
-    MFRC522_ClearBitMask(MFRC522_REG_COMM_IRQ, 0x80);
-    MFRC522_SetBitMask(MFRC522_REG_FIFO_LEVEL, 0x80);
-    MFRC522_WriteRegister(MFRC522_REG_COMMAND, MFRC522_CMD_IDLE);
+/* Read one block of the card */
+MFRC522_Status_t MFRC522_SessionReadBlock(MFRC522_Handle_t *dev, MFRC522_Session_t *sess, uint8_t blockAddr,
+                                          uint8_t *recvData) {
+    MFRC522_Status_t status = MFRC522_SessionOpen(dev, sess, blockAddr);
 
-    for (i = 0; i < sendLen; i++) {
-        MFRC522_WriteRegister(MFRC522_REG_FIFO_DATA, sendData[i]);
+    if (status != MFRC522_OK) {
+        return status;
     }
 
-    MFRC522_WriteRegister(MFRC522_REG_COMMAND, command);
+    status = MFRC522_Read(dev, blockAddr, recvData);
+    if (status != MFRC522_OK) {
+        MFRC522_SessionLost(dev, sess);
+        return status;
+    }
 
-    if (command == MFRC522_CMD_TRANSCEIVE) {
-        MFRC522_SetBitMask(MFRC522_REG_BIT_FRAMING, 0x80);
+    sess->blocksRead++;
+    return MFRC522_OK;
+}
+
+/* Write one block of the card */
+MFRC522_Status_t MFRC522_SessionWriteBlock(MFRC522_Handle_t *dev, MFRC522_Session_t *sess, uint8_t blockAddr,
+                                           uint8_t *writeData) {
+    MFRC522_Status_t status = MFRC522_SessionOpen(dev, sess, blockAddr);
+
+    if (status != MFRC522_OK) {
+        return status;
     }
 
-    i = 2000;
-    do {
-        n = MFRC522_ReadRegister(MFRC522_REG_COMM_IRQ);
-        i--;
-    } while ((i != 0) && !(n & 0x01) && !(n & waitIRq));
+    status = MFRC522_Write(dev, blockAddr, writeData);
+    if (status != MFRC522_OK) {
+        MFRC522_SessionLost(dev, sess);
+    }
+    return status;
+}
 
-    MFRC522_ClearBitMask(MFRC522_REG_BIT_FRAMING, 0x80);
+/* Read every block of a sector with one AUTH, recvData holds
+ * MFRC522_SectorBlockCount(sector) * 16 bytes */
+MFRC522_Status_t MFRC522_SessionReadSector(MFRC522_Handle_t *dev, MFRC522_Session_t *sess, uint8_t sector,
+                                           uint8_t *recvData) {
+    uint8_t first = MFRC522_SectorFirstBlock(sector);
+    uint8_t count = MFRC522_SectorBlockCount(sector);
+
+    for (uint8_t i = 0; i < count; i++) {
+        MFRC522_Status_t status = MFRC522_SessionReadBlock(dev, sess, first + i, &recvData[i * 16]);
+        if (status != MFRC522_OK) {
+            return status;
+        }
+    }
 
-    if (i != 0) {
-        if (!(MFRC522_ReadRegister(MFRC522_REG_ERROR) & 0x1B)) {
-            status = MFRC522_OK;
+    return MFRC522_OK;
+}
 
-            if (n & irqEn & 0x01) {
-                status = MFRC522_NOTAGERR;
-            }
+/* Halt the card and stop Crypto1 */
+void MFRC522_SessionEnd(MFRC522_Handle_t *dev, MFRC522_Session_t *sess) {
+    // HLTA goes out encrypted while a sector is open, as the PICC expects
+    MFRC522_Halt(dev);
+    MFRC522_ClearBitMask(dev, MFRC522_REG_STATUS_2, 0x08);
+    sess->authSector = -1;
+}
 
-            if (command == MFRC522_CMD_TRANSCEIVE) {
-                n = MFRC522_ReadRegister(MFRC522_REG_FIFO_LEVEL);
-                lastBits = MFRC522_ReadRegister(MFRC522_REG_CONTROL) & 0x07;
+/* Run the chip timer for reload+1 ticks and wait for it to expire */
+static void MFRC522_WaitTimer(MFRC522_Handle_t *dev, uint16_t reload) {
+    uint32_t timeoutMs = (reload + 2) / 2 + MFRC522_IRQ_TIMEOUT_MS;
 
-                if (lastBits) {
-                    *backLen = (n - 1) * 8 + lastBits;
-                } else {
-                    *backLen = n * 8;
-                }
+    MFRC522_LoadTimer(dev, reload);
 
-                if (n == 0) {
-                    n = 1;
-                }
-                if (n > 16) {
-                    n = 16;
-                }
+    MFRC522_WriteRegister(dev, MFRC522_REG_COMM_IEN, 0x81);
+    MFRC522_WriteRegister(dev, MFRC522_REG_COMM_IRQ, 0x7F);
+    dev->irqFlag = 0;
+    // TStartNow
+    MFRC522_WriteRegister(dev, MFRC522_REG_CONTROL, 0x40);
 
-                for (i = 0; i < n; i++) {
-                    backData[i] = MFRC522_ReadRegister(MFRC522_REG_FIFO_DATA);
-                }
-            }
-        } else {
-            status = MFRC522_ERR;
+    if (dev->waitMode == MFRC522_WAIT_IRQ) {
+        // The MCU sleeps in WFI until TimerIRq pulls the pin
+        MFRC522_WaitForIrq(dev, timeoutMs);
+    } else {
+        uint32_t start = HAL_GetTick();
+        while (!(MFRC522_ReadRegister(dev, MFRC522_REG_COMM_IRQ) & 0x01) &&
+               ((HAL_GetTick() - start) <= timeoutMs)) {
         }
     }
+}
 
-    return status;
+/* Field off and soft power-down, registers keep their values */
+void MFRC522_SoftPowerDown(MFRC522_Handle_t *dev) {
+    MFRC522_AntennaOff(dev);
+    MFRC522_WriteRegister(dev, MFRC522_REG_COMMAND, MFRC522_CMD_IDLE | MFRC522_COMMAND_POWER_DOWN);
+    dev->poweredDown = true;
 }
 
-/* Request tag */
-MFRC522_Status_t MFRC522_Request(uint8_t reqMode, uint8_t *tagType) {
-    MFRC522_Status_t status;
-    uint16_t backBits;
+/* Leave soft power-down, the field stays off until AntennaOn */
+void MFRC522_SoftWakeUp(MFRC522_Handle_t *dev) {
+    if (!dev->poweredDown) {
+        return;
+    }
 
-    MFRC522_WriteRegister(MFRC522_REG_BIT_FRAMING, 0x07);
+    MFRC522_WriteRegister(dev, MFRC522_REG_COMMAND, MFRC522_CMD_IDLE);
+    MFRC522_WaitReady(dev);
+    dev->poweredDown = false;
+}
+
+bool MFRC522_IsPoweredDown(MFRC522_Handle_t *dev) {
+    return dev->poweredDown;
+}
 
-    tagType[0] = reqMode;
-    status = MFRC522_ToCard(MFRC522_CMD_TRANSCEIVE, tagType, 1, tagType, &backBits);
+/* Duty-cycled presence probe: field on for the guard time and one short
+ * REQA. If a card answers the field is left on with the card in READY,
+ * so the caller continues with anticollision; otherwise the chip goes
+ * back to soft power-down. */
+bool MFRC522_ProbePresence(MFRC522_Handle_t *dev) {
+    uint8_t tagType[2];
 
-    if ((status != MFRC522_OK) || (backBits != 0x10)) {
-        status = MFRC522_ERR;
+    MFRC522_SoftWakeUp(dev);
+    MFRC522_AntennaOn(dev);
+    MFRC522_WaitTimer(dev, MFRC522_T_RELOAD_GUARD);
+
+    bool present = (MFRC522_Request(dev, PICC_CMD_REQA, tagType) == MFRC522_OK);
+
+    if (!present) {
+        MFRC522_SoftPowerDown(dev);
     }
 
-    return status;
+    return present;
 }
 
-/* Anti-collision detection */
-MFRC522_Status_t MFRC522_Anticoll(Uid_t *uid) {
-    MFRC522_Status_t status;
-    uint8_t i;
-    uint8_t serNumCheck = 0;
-    uint16_t unLen;
+/* Send iso->frame[0..len) with CRC_A and receive the answer into iso->frame,
+ * CRC checked and stripped. The frame is the send and the receive buffer:
+ * nothing is received before the last byte went out. */
+static MFRC522_Status_t MFRC522_IsoDepFrame(MFRC522_Handle_t *dev, MFRC522_IsoDep_t *iso, uint16_t len,
+                                            uint16_t *backLen) {
+    MFRC522_CalculateCRC_Software(iso->frame, len, &iso->frame[len]);
+
+    MFRC522_Status_t status = MFRC522_TransceiveLong(dev, iso->frame, len + 2, iso->frame, sizeof(iso->frame),
+                                                     backLen);
+    if (status != MFRC522_OK) {
+        return status;
+    }
+    if (*backLen < 3) {
+        return MFRC522_RfError(dev, MFRC522_PROTOCOL_ERR);
+    }
 
-    MFRC522_WriteRegister(MFRC522_REG_BIT_FRAMING, 0x00);
+    *backLen -= 2;
+    if (!MFRC522_CrcOk(dev, iso->frame, *backLen)) {
+        return MFRC522_CRC_ERR;
+    }
 
-    uint8_t serNum[2];
-    serNum[0] = PICC_CMD_SEL_CL1;
-    serNum[1] = 0x20;
+    return MFRC522_OK;
+}
 
-    status = MFRC522_ToCard(MFRC522_CMD_TRANSCEIVE, serNum, 2, serNum, &unLen);
+/* One block exchange. A card that needs more time answers S(WTX) instead;
+ * it gets the same S(WTX) back and WTXM times its FWT for the next answer. */
+static MFRC522_Status_t MFRC522_IsoDepExchange(MFRC522_Handle_t *dev, MFRC522_IsoDep_t *iso, uint16_t len,
+                                               uint16_t *backLen) {
+    MFRC522_Status_t status = MFRC522_IsoDepFrame(dev, iso, len, backLen);
 
-    if (status == MFRC522_OK) {
-        for (i = 0; i < 4; i++) {
-            uid->uidByte[i] = serNum[i];
-            serNumCheck ^= serNum[i];
-        }
+    while ((status == MFRC522_OK) && (*backLen == 2) && (iso->frame[0] == MFRC522_ISODEP_S_WTX)) {
+        uint8_t wtxm = iso->frame[1] & 0x3F;
 
-        if (serNumCheck != serNum[i]) {
-            status = MFRC522_ERR;
+        if ((wtxm == 0) || (wtxm > 59)) {
+            return MFRC522_ERR;
         }
 
-        uid->size = 4;
+        uint32_t fwt = iso->fwtUs * wtxm;
+        MFRC522_SetFWTUs(dev, ((fwt > MFRC522_ISODEP_FWT_MAX_US) ? MFRC522_ISODEP_FWT_MAX_US : fwt) +
+                                  MFRC522_ISODEP_FWT_DELTA_US);
+        iso->wtx++;
+        status = MFRC522_IsoDepFrame(dev, iso, 2, backLen);
+        MFRC522_SetFWTUs(dev, iso->fwtUs + MFRC522_ISODEP_FWT_DELTA_US);
     }
 
     return status;
 }
 
-/* Select tag */
-MFRC522_Status_t MFRC522_SelectTag(Uid_t *uid) {
-    MFRC522_Status_t status;
-    uint8_t i;
-    uint16_t recvBits;
-    uint8_t buffer[9];
-
-    buffer[0] = PICC_CMD_SEL_CL1;
-    buffer[1] = 0x70;
+/* RATS on a selected ISO/IEC 14443-4 card (SAK bit 5), then PPS to the
+ * highest bit rate both sides support up to maxRate. The card keeps its
+ * UID state; IsoDepDeselect ends the link. */
+MFRC522_Status_t MFRC522_IsoDepActivate(MFRC522_Handle_t *dev, MFRC522_IsoDep_t *iso, MFRC522_BitRate_t maxRate) {
+    static const uint16_t fscTable[9] = {16, 24, 32, 40, 48, 64, 96, 128, 256};
+    uint8_t fsci = 2;
+    uint8_t fwi = 4;
+    uint8_t sfgi = 0;
+    uint8_t ta = 0x00;
+    uint16_t len;
+
+    iso->active = false;
+    iso->blockNum = 0;
+    iso->wtx = 0;
+    iso->retries = 0;
+    iso->txRate = MFRC522_BITRATE_106;
+    iso->rxRate = MFRC522_BITRATE_106;
+
+    MFRC522_SetBitRate(dev, MFRC522_BITRATE_106, MFRC522_BITRATE_106);
+    MFRC522_SetFWTUs(dev, MFRC522_ISODEP_FWT_ACTIVATION_US);
+
+    iso->frame[0] = PICC_CMD_RATS;
+    iso->frame[1] = MFRC522_ISODEP_FSDI << 4;
+    MFRC522_Status_t status = MFRC522_IsoDepFrame(dev, iso, 2, &len);
+    if (status != MFRC522_OK) {
+        return status;
+    }
 
-    for (i = 0; i < 4; i++) {
-        buffer[i + 2] = uid->uidByte[i];
+    // TL counts itself
+    if (iso->frame[0] != len) {
+        return MFRC522_ERR;
     }
+    iso->atsLen = (len > MFRC522_ISODEP_ATS_MAX) ? MFRC522_ISODEP_ATS_MAX : len;
+    memcpy(iso->ats, iso->frame, iso->atsLen);
 
-    buffer[6] = buffer[2] ^ buffer[3] ^ buffer[4] ^ buffer[5];
+    // T0 announces which of TA(1), TB(1), TC(1) follow
+    if (len > 1) {
+        uint8_t t0 = iso->frame[1];
+        uint8_t pos = 2;
 
-    MFRC522_CalculateCRC(buffer, 7, &buffer[7]);
+        fsci = t0 & 0x0F;
+        if ((t0 & 0x10) && (pos < len)) {
+            ta = iso->frame[pos++];
+        }
+        if ((t0 & 0x20) && (pos < len)) {
+            fwi = iso->frame[pos] >> 4;
+            sfgi = iso->frame[pos] & 0x0F;
+            pos++;
+        }
+        // TC(1), NAD and CID support, not used
+    }
+    // Value 15 is reserved (RFU) for each of them
+    if (fwi == 15) {
+        fwi = 4;
+    }
+    if (sfgi == 15) {
+        sfgi = 0;
+    }
 
-    status = MFRC522_ToCard(MFRC522_CMD_TRANSCEIVE, buffer, 9, buffer, &recvBits);
+    iso->fsc = fscTable[(fsci > 8) ? 8 : fsci];
+    iso->fwtUs = (uint32_t)MFRC522_ISODEP_FWT_UNIT_US << fwi;
 
-    if ((status == MFRC522_OK) && (recvBits == 0x18)) {
-        uid->sak = buffer[0];
-        status = MFRC522_OK;
-    } else {
-        status = MFRC522_ERR;
+    // Start-up frame guard time before the next frame to the card
+    if (sfgi) {
+        MFRC522_WaitTimer(dev, (((uint32_t)MFRC522_ISODEP_FWT_UNIT_US << sfgi) + 499) / 500);
     }
 
-    return status;
-}
+    // DS bits: card to reader, DR bits: reader to card; b8 set means both directions must match
+    uint8_t ds = (ta >> 4) & 0x07;
+    uint8_t dr = ta & 0x07;
+    if (ta & 0x80) {
+        ds &= dr;
+        dr = ds;
+    }
 
-/* Authenticate */
-MFRC522_Status_t MFRC522_Auth(uint8_t authMode, uint8_t blockAddr, uint8_t *key, Uid_t *uid) {
-    MFRC522_Status_t status;
-    uint16_t recvBits;
-    uint8_t i;
-    uint8_t buff[12];
+    MFRC522_BitRate_t rx = MFRC522_BITRATE_106;
+    MFRC522_BitRate_t tx = MFRC522_BITRATE_106;
+    for (uint8_t rate = MFRC522_BITRATE_212; rate <= maxRate; rate++) {
+        if (ds & (1 << (rate - 1))) {
+            rx = rate;
+        }
+        if (dr & (1 << (rate - 1))) {
+            tx = rate;
+        }
+    }
 
-    buff[0] = authMode;
-    buff[1] = blockAddr;
+    if ((tx != MFRC522_BITRATE_106) || (rx != MFRC522_BITRATE_106)) {
+        MFRC522_SetFWTUs(dev, iso->fwtUs + MFRC522_ISODEP_FWT_DELTA_US);
+        iso->frame[0] = PICC_CMD_PPS;
+        iso->frame[1] = 0x11;  // PPS1 follows
+        iso->frame[2] = (rx << 2) | tx;
+        status = MFRC522_IsoDepFrame(dev, iso, 3, &len);
+        if ((status != MFRC522_OK) || (len != 1) || (iso->frame[0] != PICC_CMD_PPS)) {
+            return MFRC522_ERR;
+        }
 
-    for (i = 0; i < 6; i++) {
-        buff[i + 2] = key[i];
+        // The new rates apply from the next frame on
+        MFRC522_SetBitRate(dev, tx, rx);
+        iso->txRate = tx;
+        iso->rxRate = rx;
     }
 
-    for (i = 0; i < 4; i++) {
-        buff[i + 8] = uid->uidByte[i];
-    }
+    MFRC522_SetFWTUs(dev, iso->fwtUs + MFRC522_ISODEP_FWT_DELTA_US);
+    iso->active = true;
 
-    status = MFRC522_ToCard(MFRC522_CMD_MF_AUTHENT, buff, 12, buff, &recvBits);
+    return MFRC522_OK;
+}
 
-    if ((status != MFRC522_OK) || (!(MFRC522_ReadRegister(MFRC522_REG_STATUS_2) & 0x08))) {
-        status = MFRC522_ERR;
+/* Exchange one APDU. Commands longer than FSC go out as a chain of I-blocks,
+ * each confirmed by R(ACK); a chained answer is pulled in with R(ACK). A
+ * lost or damaged block is asked for again (R(NAK)) or sent again, up to
+ * MFRC522_ISODEP_RETRIES times in a row. */
+MFRC522_Status_t MFRC522_IsoDepTransceive(MFRC522_Handle_t *dev, MFRC522_IsoDep_t *iso, const uint8_t *apdu,
+                                          uint16_t apduLen, uint8_t *resp, uint16_t respMax, uint16_t *respLen) {
+    uint16_t maxInf = ((iso->fsc > MFRC522_ISODEP_FSD) ? MFRC522_ISODEP_FSD : iso->fsc) - 3;
+    uint16_t sent = 0;
+    uint16_t chunk = 0;
+    uint8_t next = MFRC522_ISODEP_I_BLOCK;
+    uint8_t errors = 0;
+    bool rxChain = false;
+
+    *respLen = 0;
+    if (!iso->active) {
+        return MFRC522_ERR;
     }
 
-    return status;
-}
+    for (;;) {
+        uint16_t len;
 
-/* Read block */
-MFRC522_Status_t MFRC522_Read(uint8_t blockAddr, uint8_t *recvData) {
-    MFRC522_Status_t status;
-    uint16_t unLen;
+        if (next == MFRC522_ISODEP_I_BLOCK) {
+            chunk = apduLen - sent;
+            if (chunk > maxInf) {
+                chunk = maxInf;
+            }
+            iso->frame[0] = MFRC522_ISODEP_I_BLOCK | iso->blockNum;
+            if (sent + chunk < apduLen) {
+                iso->frame[0] |= MFRC522_ISODEP_CHAINING;
+            }
+            memcpy(&iso->frame[1], &apdu[sent], chunk);
+            len = chunk + 1;
+        } else {
+            iso->frame[0] = next | iso->blockNum;
+            len = 1;
+        }
+
+        MFRC522_Status_t status = MFRC522_IsoDepExchange(dev, iso, len, &len);
+        uint8_t pcb = iso->frame[0];
 
-    recvData[0] = PICC_CMD_MF_READ;
-    recvData[1] = blockAddr;
+        if (status == MFRC522_OK) {
+            bool chaining = (sent + chunk < apduLen);
 
-    MFRC522_CalculateCRC(recvData, 2, &recvData[2]);
+            if ((pcb & 0xE2) == MFRC522_ISODEP_I_BLOCK) {
+                // An answer while our chain is incomplete, or a block we already have
+                if (chaining || ((pcb & 0x01) != iso->blockNum)) {
+                    return MFRC522_ERR;
+                }
+                iso->blockNum ^= 1;
+                errors = 0;
 
-    status = MFRC522_ToCard(MFRC522_CMD_TRANSCEIVE, recvData, 4, recvData, &unLen);
+                if (*respLen + len - 1 > respMax) {
+                    return MFRC522_ERR;
+                }
+                memcpy(&resp[*respLen], &iso->frame[1], len - 1);
+                *respLen += len - 1;
 
-    if ((status != MFRC522_OK) || (unLen != 0x90)) {
-        status = MFRC522_ERR;
-    }
+                if (!(pcb & MFRC522_ISODEP_CHAINING)) {
+                    return MFRC522_OK;
+                }
+                rxChain = true;
+                next = MFRC522_ISODEP_R_ACK;
+                continue;
+            }
 
-    return status;
+            if ((pcb & 0xE6) == MFRC522_ISODEP_R_ACK) {
+                if (pcb & 0x10) {
+                    // The card does not NAK
+                    return MFRC522_ERR;
+                }
+                if (((pcb & 0x01) == iso->blockNum) && chaining && !rxChain) {
+                    // Our block arrived, go on with the chain
+                    iso->blockNum ^= 1;
+                    sent += chunk;
+                    errors = 0;
+                    next = MFRC522_ISODEP_I_BLOCK;
+                    continue;
+                }
+                // The card missed our last block: send it again
+                if (++errors > MFRC522_ISODEP_RETRIES) {
+                    return MFRC522_ERR;
+                }
+                iso->retries++;
+                dev->stats.retries++;
+                next = rxChain ? MFRC522_ISODEP_R_ACK : MFRC522_ISODEP_I_BLOCK;
+                continue;
+            }
+
+            return MFRC522_ERR;
+        }
+
+        // Timeout or damaged frame: ask for the block again
+        if (status == MFRC522_NOTAGERR) {
+            MFRC522_RfError(dev, status);
+        }
+        if (++errors > MFRC522_ISODEP_RETRIES) {
+            return status;
+        }
+        iso->retries++;
+        dev->stats.retries++;
+        next = rxChain ? MFRC522_ISODEP_R_ACK : MFRC522_ISODEP_R_NAK;
+    }
 }
 
-/* Write block */
-MFRC522_Status_t MFRC522_Write(uint8_t blockAddr, uint8_t *writeData) {
-    MFRC522_Status_t status;
-    uint16_t recvBits;
-    uint8_t i;
-    uint8_t buff[18];
+/* S(DESELECT), the card goes to HALT; back to 106 kbit/s for the next card */
+void MFRC522_IsoDepDeselect(MFRC522_Handle_t *dev, MFRC522_IsoDep_t *iso) {
+    uint16_t len;
 
-    buff[0] = PICC_CMD_MF_WRITE;
-    buff[1] = blockAddr;
-    MFRC522_CalculateCRC(buff, 2, &buff[2]);
+    if (iso->active) {
+        MFRC522_SetFWTUs(dev, MFRC522_ISODEP_FWT_ACTIVATION_US);
+        iso->frame[0] = MFRC522_ISODEP_S_DESELECT;
+        MFRC522_IsoDepFrame(dev, iso, 1, &len);
+        iso->active = false;
+    }
 
-    status = MFRC522_ToCard(MFRC522_CMD_TRANSCEIVE, buff, 4, buff, &recvBits);
+    MFRC522_SetBitRate(dev, MFRC522_BITRATE_106, MFRC522_BITRATE_106);
+}
 
-    if ((status != MFRC522_OK) || (recvBits != 4) || ((buff[0] & 0x0F) != 0x0A)) {
-        status = MFRC522_ERR;
+/* Prepare an empty schedule, periodMs is the probe period of each reader */
+void MFRC522_SchedInit(MFRC522_Sched_t *sched, uint32_t periodMs) {
+    memset(sched, 0, sizeof(MFRC522_Sched_t));
+    sched->periodMs = periodMs;
+    sched->nextSlot = HAL_GetTick();
+}
+
+bool MFRC522_SchedAdd(MFRC522_Sched_t *sched, MFRC522_Handle_t *dev) {
+    if (sched->count >= MFRC522_SCHED_MAX_READERS) {
+        return false;
     }
+    sched->readers[sched->count++] = dev;
+    return true;
+}
 
-    if (status == MFRC522_OK) {
-        for (i = 0; i < 16; i++) {
-            buff[i] = writeData[i];
-        }
+/* Index of the reader whose probe slot has come, -1 if none is due yet */
+int8_t MFRC522_SchedNext(MFRC522_Sched_t *sched) {
+    uint32_t now = HAL_GetTick();
+    uint8_t idx = sched->next;
 
-        MFRC522_CalculateCRC(buff, 16, &buff[16]);
-        status = MFRC522_ToCard(MFRC522_CMD_TRANSCEIVE, buff, 18, buff, &recvBits);
+    if ((sched->count == 0) || ((int32_t)(now - sched->nextSlot) < 0)) {
+        return -1;
+    }
 
-        if ((status != MFRC522_OK) || (recvBits != 4) || ((buff[0] & 0x0F) != 0x0A)) {
-            status = MFRC522_ERR;
+    // Fixed slot pitch keeps one slot per reader and period; after falling
+    // a whole period behind, resynchronise instead of bursting slots
+    uint32_t pitch = sched->periodMs / sched->count;
+    sched->nextSlot += pitch;
+    if ((int32_t)(now - sched->nextSlot) > (int32_t)sched->periodMs) {
+        sched->nextSlot = now + pitch;
+    }
+
+    if (sched->lastSlot[idx] != 0) {
+        uint32_t gap = now - sched->lastSlot[idx];
+        if (gap > sched->maxGapMs[idx]) {
+            sched->maxGapMs[idx] = gap;
         }
     }
+    sched->lastSlot[idx] = now;
+    sched->next = (idx + 1) % sched->count;
 
-    return status;
+    return idx;
 }
 
-/* Halt tag */
-void MFRC522_Halt(void) {
-    uint16_t unLen;
-    uint8_t buff[4];
-
-    buff[0] = PICC_CMD_HLTA;
-    buff[1] = 0;
-    MFRC522_CalculateCRC(buff, 2, &buff[2]);
-
-    MFRC522_ToCard(MFRC522_CMD_TRANSCEIVE, buff, 4, buff, &unLen);
+void MFRC522_SchedResetStats(MFRC522_Sched_t *sched) {
+    memset(sched->lastSlot, 0, sizeof(sched->lastSlot));
+    memset(sched->maxGapMs, 0, sizeof(sched->maxGapMs));
 }
 
 /* Get card type */
@@ -382,6 +2390,7 @@ PICC_Type_t MFRC522_GetType(uint8_t sak) {
         case 0x10:
         case 0x11: return PICC_TYPE_MIFARE_PLUS;
         case 0x01: return PICC_TYPE_TNP3XXX;
+        case 0x20: return PICC_TYPE_ISO_14443_4;
         default: return PICC_TYPE_UNKNOWN;
     }
 }
@@ -395,7 +2404,95 @@ const char* MFRC522_GetTypeName(PICC_Type_t type) {
         case PICC_TYPE_MIFARE_UL: return "MIFARE Ultralight";
         case PICC_TYPE_MIFARE_PLUS: return "MIFARE Plus";
         case PICC_TYPE_TNP3XXX: return "MIFARE TNP3XXX";
+        case PICC_TYPE_ISO_14443_4: return "ISO/IEC 14443-4";
         case PICC_TYPE_NOT_COMPLETE: return "SAK incomplete";
         default: return "Unknown";
     }
 }
+
+/* Short description of a status code */
+const char* MFRC522_GetStatusName(MFRC522_Status_t status) {
+    switch (status) {
+        case MFRC522_OK: return "OK";
+        case MFRC522_NOTAGERR: return "no answer";
+        case MFRC522_ERR: return "error";
+        case MFRC522_TIMEOUT: return "chip timeout";
+        case MFRC522_COLLISION: return "collision";
+        case MFRC522_PARITY_ERR: return "parity error";
+        case MFRC522_CRC_ERR: return "CRC error";
+        case MFRC522_OVERFLOW: return "buffer overflow";
+        case MFRC522_PROTOCOL_ERR: return "protocol error";
+        default: return "unknown";
+    }
+}
+
+/* Number of 16-byte blocks of a MIFARE Classic card, 0 for other types */
+uint16_t MFRC522_GetBlockCount(PICC_Type_t type) {
+    switch (type) {
+        case PICC_TYPE_MIFARE_MINI: return 20;
+        case PICC_TYPE_MIFARE_1K: return 64;
+        case PICC_TYPE_MIFARE_4K: return 256;
+        default: return 0;
+    }
+}
+
+/* MFRC522_SEQ_* steps a card type answers once selected */
+uint8_t MFRC522_GetSupportedSteps(PICC_Type_t type) {
+    uint8_t steps = MFRC522_SEQ_REQUEST | MFRC522_SEQ_ANTICOLL | MFRC522_SEQ_SELECT;
+
+    switch (type) {
+        case PICC_TYPE_MIFARE_MINI:
+        case PICC_TYPE_MIFARE_1K:
+        case PICC_TYPE_MIFARE_4K:
+        case PICC_TYPE_MIFARE_PLUS:
+        case PICC_TYPE_TNP3XXX:
+            return steps | MFRC522_SEQ_AUTH | MFRC522_SEQ_READ;
+        case PICC_TYPE_MIFARE_UL:
+            // Type 2 tags READ 4 pages without authentication
+            return steps | MFRC522_SEQ_READ;
+        default:
+            return steps;
+    }
+}
+
+/* Type 2 tag pages from GET_VERSION (product type, storage size), 0 if unknown */
+uint16_t MFRC522_GetPageCount(const uint8_t *version) {
+    static const struct {
+        uint8_t productType;
+        uint8_t storageSize;
+        uint16_t pages;
+    } versions[] = {
+        {0x03, 0x0B, 20},   // Ultralight EV1 MF0UL11
+        {0x03, 0x0E, 41},   // Ultralight EV1 MF0UL21
+        {0x04, 0x0F, 45},   // NTAG213
+        {0x04, 0x11, 135},  // NTAG215
+        {0x04, 0x13, 231},  // NTAG216
+    };
+
+    for (uint8_t i = 0; i < sizeof(versions) / sizeof(versions[0]); i++) {
+        if ((version[2] == versions[i].productType) && (version[6] == versions[i].storageSize)) {
+            return versions[i].pages;
+        }
+    }
+    return 0;
+}
+
+/* MIFARE Classic sector layout: 32 sectors of 4 blocks, then (4K only)
+ * 8 sectors of 16 blocks from block 128 */
+uint8_t MFRC522_SectorOfBlock(uint8_t blockAddr) {
+    if (blockAddr < 128) {
+        return blockAddr / 4;
+    }
+    return 32 + (blockAddr - 128) / 16;
+}
+
+uint8_t MFRC522_SectorFirstBlock(uint8_t sector) {
+    if (sector < 32) {
+        return sector * 4;
+    }
+    return 128 + (sector - 32) * 16;
+}
+
+uint8_t MFRC522_SectorBlockCount(uint8_t sector) {
+    return (sector < 32) ? 4 : 16;
+}
@@ -57,6 +57,9 @@
 /* External variables --------------------------------------------------------*/
 extern IPCC_HandleTypeDef hipcc;
 /* USER CODE BEGIN EV */
+extern DMA_HandleTypeDef hdma_spi5_rx;
+extern DMA_HandleTypeDef hdma_spi5_tx;
+extern SPI_HandleTypeDef hspi5;
 
 /* USER CODE END EV */
 
@@ -241,5 +244,36 @@ void RCC_WAKEUP_IRQHandler(void)
 }
 
 /* USER CODE BEGIN 1 */
+/**
+  * @brief This function handles EXTI line 13 interrupt (MFRC522 IRQ pin).
+  */
+void EXTI13_IRQHandler(void)
+{
+  HAL_GPIO_EXTI_IRQHandler(RFID_IRQ_Pin);
+}
+
+/**
+  * @brief This function handles DMA2 stream0 global interrupt (SPI5 RX).
+  */
+void DMA2_Stream0_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_spi5_rx);
+}
+
+/**
+  * @brief This function handles DMA2 stream1 global interrupt (SPI5 TX).
+  */
+void DMA2_Stream1_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_spi5_tx);
+}
+
+/**
+  * @brief This function handles SPI5 global interrupt.
+  */
+void SPI5_IRQHandler(void)
+{
+  HAL_SPI_IRQHandler(&hspi5);
+}
 
 /* USER CODE END 1 */
@@ -0,0 +1,135 @@
+/* mfrc522_sim.h - MFRC522 register model and PICC emulator for host builds */
+
+#ifndef MFRC522_SIM_H
+#define MFRC522_SIM_H
+
+#include "stm32mp1xx_hal.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SIM_MAX_CHIPS   4
+#define SIM_MAX_CARDS   12
+
+/* Longest frame on air (FSD 256), longest APDU (Lc 255 + header) */
+#define SIM_RF_MAX_BYTES 260
+#define SIM_APDU_MAX     264
+
+/* Emulated PICCs */
+typedef enum {
+    SIM_CARD_CLASSIC_1K = 0,  // MIFARE Classic 1K, SAK 0x08
+    SIM_CARD_CLASSIC_4K,      // MIFARE Classic 4K, SAK 0x18
+    SIM_CARD_ULTRALIGHT,      // MIFARE Ultralight, SAK 0x00, 16 pages
+    SIM_CARD_ULTRALIGHT_EV1,  // Ultralight EV1: adds GET_VERSION and FAST_READ, 20 pages
+    SIM_CARD_DESFIRE          // ISO/IEC 14443-4, SAK 0x20: RATS, PPS up to 848 kbit/s, READ/UPDATE BINARY
+} SimCardType_t;
+
+/* RF errors injected into PICC answers */
+typedef enum {
+    SIM_FAULT_NONE = 0,
+    SIM_FAULT_DROP,     // Answer lost, the reader times out
+    SIM_FAULT_PARITY,   // Answer received with ParityErr
+    SIM_FAULT_CRC       // One bit flipped, the CRC_A no longer matches
+} SimFault_t;
+
+/* ISO/IEC 14443-3 PICC states */
+typedef enum {
+    SIM_PICC_OFF = 0,   // Outside every field
+    SIM_PICC_IDLE,
+    SIM_PICC_READY,
+    SIM_PICC_ACTIVE,
+    SIM_PICC_HALT,
+    SIM_PICC_PROTOCOL   // ISO/IEC 14443-4, after RATS
+} SimPiccState_t;
+
+typedef struct {
+    SimCardType_t type;
+    uint8_t uid[10];
+    uint8_t uidSize;           // 4, 7 or 10
+    uint8_t atqa[2];           // LSB first, as sent
+    uint8_t sak;
+    uint8_t mem[4096];         // Blocks or pages
+    uint16_t memSize;
+    int8_t chip;               // Reader whose field the card is in, -1 for none
+    // Protocol state
+    SimPiccState_t state;
+    bool wasHalted;            // Fall back to HALT instead of IDLE on errors
+    uint8_t level;             // Cascade level while READY
+    int16_t authSector;        // Sector opened by MFAuthent, -1 when none
+    int16_t writeAddr;         // Block waiting for the WRITE data phase, -1 when none
+    // ISO-DEP (SIM_CARD_DESFIRE)
+    uint8_t dr;                // Bit rate reader to card, 0 = 106 kbit/s ... 3 = 848 kbit/s
+    uint8_t ds;                // Bit rate card to reader
+    bool ppsAllowed;           // Only the first block after the ATS may be a PPS
+    uint8_t blockNum;
+    uint16_t fsd;              // Largest frame the reader accepts, from RATS
+    bool wtxPending;           // Response held back behind S(WTX)
+    uint8_t apdu[SIM_APDU_MAX];
+    uint16_t apduLen;
+    uint8_t resp[SIM_APDU_MAX];
+    uint16_t respLen;
+    uint16_t respPos;          // Response bytes sent so far
+    uint8_t last[SIM_RF_MAX_BYTES];  // Last block sent, without CRC, for retransmission
+    uint16_t lastLen;
+    // Fault injection
+    SimFault_t fault;
+    uint16_t faultCount;       // Answers still to corrupt with fault
+    uint16_t faultSkip;        // Answers to let through before that
+    uint32_t answers;          // Frames answered since placed in a field
+} SimCard_t;
+
+/* RF-side counters of one reader */
+typedef struct {
+    uint32_t frames;           // Frames sent by the reader
+    uint32_t answers;          // Frames received from PICCs
+    uint32_t collisions;       // Answers with CollErr
+    uint32_t timeouts;         // TimerIRq without an answer
+    uint32_t faults;           // Injected RF errors
+    uint32_t irqEdges;         // Falling edges on the IRQ pin
+} SimChipStats_t;
+
+/* Simulation setup */
+void Sim_Reset(void);
+void Sim_SetSpiClock(uint32_t hz);
+void Sim_SetSpiLimit(uint32_t hz);
+int Sim_AddChip(GPIO_TypeDef *csPort, uint16_t csPin, GPIO_TypeDef *rstPort, uint16_t rstPin,
+                GPIO_TypeDef *irqPort, uint16_t irqPin);
+SimCard_t* Sim_AddCard(SimCardType_t type, const uint8_t *uid, uint8_t uidSize);
+void Sim_PlaceCard(SimCard_t *card, int chip);
+void Sim_InjectFault(SimCard_t *card, SimFault_t fault, uint16_t count);
+void Sim_InjectFaultAt(SimCard_t *card, SimFault_t fault, uint16_t count, uint16_t skip);
+void Sim_SetErrorRate(uint16_t perMille, uint32_t seed);
+
+/* Virtual clock, nanoseconds since Sim_Reset */
+uint64_t Sim_Now(void);
+void Sim_Advance(uint64_t ns);
+bool Sim_NextEvent(uint64_t *at);
+
+const SimChipStats_t* Sim_GetChipStats(int chip);
+void Sim_ResetChipStats(int chip);
+
+/* Air interface between the chip model and the PICCs */
+typedef struct {
+    uint8_t data[SIM_RF_MAX_BYTES];
+    uint16_t bits;
+    uint8_t speed;             // Bit rate of the answer, as in RxModeReg RxSpeed
+    uint32_t delayNs;          // End of the reader frame to start of the answer
+    SimFault_t fault;
+} SimRfAnswer_t;
+
+void SimPicc_Clear(void);
+uint8_t SimPicc_Count(void);
+SimCard_t* SimPicc_Get(uint8_t index);
+void SimPicc_Field(SimCard_t *card, bool on);
+bool SimPicc_Receive(SimCard_t *card, const uint8_t *data, uint16_t bits, bool crypto, uint8_t speed,
+                     SimRfAnswer_t *answer);
+bool SimPicc_Authenticate(SimCard_t *card, uint8_t authCmd, uint8_t block, const uint8_t *key);
+uint16_t SimPicc_CrcA(const uint8_t *data, uint16_t len);
+bool SimChip_FieldOn(int chip);
+
+/* Hooks for the HAL stand-in */
+void SimChip_PinWrite(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state);
+uint8_t SimChip_Exchange(uint8_t mosi);
+void SimHal_IrqEdge(GPIO_TypeDef *port, uint16_t pin);
+void SimHal_Dispatch(void);
+
+#endif /* MFRC522_SIM_H */
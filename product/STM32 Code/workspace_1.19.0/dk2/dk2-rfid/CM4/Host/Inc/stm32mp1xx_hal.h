@@ -0,0 +1,110 @@
+/* stm32mp1xx_hal.h - Host stand-in for the STM32MP1 HAL
+ *
+ * Found before the real HAL through the include path, so Core/Inc/main.h
+ * and Core/Src/mfcr522.c build unmodified on Linux. Only what the RFID
+ * driver touches is provided; SPI, GPIO, the tick and the IRQ pin are
+ * routed to the simulated MFRC522 chips in mfrc522_sim.c. Time is virtual
+ * and only moves forward through these calls. */
+
+#ifndef STM32MP1XX_HAL_H
+#define STM32MP1XX_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+    HAL_OK = 0,
+    HAL_ERROR,
+    HAL_BUSY,
+    HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+typedef enum {
+    GPIO_PIN_RESET = 0,
+    GPIO_PIN_SET
+} GPIO_PinState;
+
+typedef struct {
+    uint32_t ODR;  // Output latch
+    uint32_t IDR;  // Input level, driven by the simulated chips
+} GPIO_TypeDef;
+
+#define GPIO_PIN_0   ((uint16_t)0x0001)
+#define GPIO_PIN_1   ((uint16_t)0x0002)
+#define GPIO_PIN_2   ((uint16_t)0x0004)
+#define GPIO_PIN_3   ((uint16_t)0x0008)
+#define GPIO_PIN_4   ((uint16_t)0x0010)
+#define GPIO_PIN_5   ((uint16_t)0x0020)
+#define GPIO_PIN_6   ((uint16_t)0x0040)
+#define GPIO_PIN_7   ((uint16_t)0x0080)
+#define GPIO_PIN_8   ((uint16_t)0x0100)
+#define GPIO_PIN_9   ((uint16_t)0x0200)
+#define GPIO_PIN_10  ((uint16_t)0x0400)
+#define GPIO_PIN_11  ((uint16_t)0x0800)
+#define GPIO_PIN_12  ((uint16_t)0x1000)
+#define GPIO_PIN_13  ((uint16_t)0x2000)
+#define GPIO_PIN_14  ((uint16_t)0x4000)
+#define GPIO_PIN_15  ((uint16_t)0x8000)
+
+extern GPIO_TypeDef sim_gpio[11];
+#define GPIOA (&sim_gpio[0])
+#define GPIOB (&sim_gpio[1])
+#define GPIOC (&sim_gpio[2])
+#define GPIOD (&sim_gpio[3])
+#define GPIOE (&sim_gpio[4])
+#define GPIOF (&sim_gpio[5])
+#define GPIOG (&sim_gpio[6])
+#define GPIOH (&sim_gpio[7])
+#define GPIOI (&sim_gpio[8])
+#define GPIOJ (&sim_gpio[9])
+#define GPIOK (&sim_gpio[10])
+
+typedef struct {
+    int unused;
+} DMA_HandleTypeDef;
+
+typedef struct __SPI_HandleTypeDef {
+    DMA_HandleTypeDef *hdmatx;
+    DMA_HandleTypeDef *hdmarx;
+    // Simulation only: DMA transfer in flight
+    uint64_t dmaDoneAt;
+    uint8_t dmaBusy;
+    uint8_t dmaRx;
+} SPI_HandleTypeDef;
+
+/* Cycle counter, follows the virtual clock */
+typedef struct {
+    volatile uint32_t CTRL;
+    volatile uint32_t CYCCNT;
+} DWT_Type;
+
+extern DWT_Type sim_dwt;
+#define DWT (&sim_dwt)
+
+/* Referenced by macros in main.h only */
+#define EXTI13_IRQn 13
+
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+void HAL_GPIO_EXTI_Falling_Callback(uint16_t GPIO_Pin);
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, const uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, const uint8_t *pTxData, uint8_t *pRxData,
+                                          uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, const uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi, const uint8_t *pTxData, uint8_t *pRxData,
+                                              uint16_t Size);
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *hspi);
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi);
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi);
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi);
+
+/* PRIMASK and WFI: interrupts are delivered between HAL calls unless masked */
+void __disable_irq(void);
+void __enable_irq(void);
+void __WFI(void);
+
+#endif /* STM32MP1XX_HAL_H */
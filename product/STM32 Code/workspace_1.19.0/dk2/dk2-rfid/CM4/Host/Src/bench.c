@@ -0,0 +1,864 @@
+/* bench.c - SPI cost of each MFRC522 driver operation on the emulated reader
+ *
+ * Runs the unmodified driver (Core/Src/mfcr522.c) against mfrc522_sim.c
+ * and prints, per operation, the SPI transactions and bytes it took, RF
+ * frames on air and the virtual time. Build and options: see Host/README. */
+
+#include "mfrc522.h"
+#include "mfrc522_sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_DEFAULT_ITERATIONS 100
+#define BENCH_BLOCK              4
+
+static SPI_HandleTypeDef hspi5;
+static DMA_HandleTypeDef hdma_spi5_tx;
+static DMA_HandleTypeDef hdma_spi5_rx;
+static MFRC522_Handle_t rfid;
+static int chip;
+
+static uint8_t keyA[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+static const uint8_t blockData[16] = "attendance-sim!";
+
+static MFRC522_KeyTable_t keyTable;  // Four keys, the bench card's sector 1 uses the last
+static MFRC522_KeyCache_t keyCache;
+static const uint8_t siteKey[6] = {0x5E, 0x17, 0xE0, 0x00, 0x42, 0x01};
+
+static SimCard_t *classic;       // MIFARE Classic 1K, 4-byte UID
+static SimCard_t *classic10;     // MIFARE Classic 4K, 10-byte UID
+static SimCard_t *ultralight;    // Ultralight, 7-byte UID
+static SimCard_t *ultralightEv1; // Ultralight EV1, 20 pages
+static SimCard_t *desfire;       // ISO/IEC 14443-4, up to 848 kbit/s
+static MFRC522_IsoDep_t iso;
+static SimCard_t *stackClassic[3];
+static SimCard_t *stackUltralight[3];
+
+typedef struct {
+    const char *name;
+    void (*setup)(void);         // Untimed: cards in the field, card states
+    bool (*run)(void);           // Timed: true if the operation did what it should
+    void (*teardown)(void);      // Untimed
+} BenchOp_t;
+
+/* IRQ pin and SPI DMA completion, wired as in main.c */
+void HAL_GPIO_EXTI_Falling_Callback(uint16_t GPIO_Pin) {
+    if ((rfid.config.IRQ_GPIO_Port != NULL) && (GPIO_Pin == rfid.config.IRQ_Pin)) {
+        MFRC522_IRQHandler(&rfid);
+    }
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi) {
+    MFRC522_SPI_CpltHandler(hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi) {
+    MFRC522_SPI_CpltHandler(hspi);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi) {
+    MFRC522_SPI_ErrorHandler(hspi);
+}
+
+void Error_Handler(void) {
+    abort();
+}
+
+/* Take every card out of the field, then put the given ones back in IDLE */
+static void Bench_Field(SimCard_t **cards, uint8_t count) {
+    for (uint8_t i = 0; i < SimPicc_Count(); i++) {
+        Sim_PlaceCard(SimPicc_Get(i), -1);
+    }
+    for (uint8_t i = 0; i < count; i++) {
+        Sim_PlaceCard(cards[i], chip);
+    }
+}
+
+static bool Bench_Select(Uid_t *uid) {
+    uint8_t atqa[2];
+
+    return (MFRC522_Request(&rfid, PICC_CMD_REQA, atqa) == MFRC522_OK) &&
+           (MFRC522_Anticoll(&rfid, uid) == MFRC522_OK) &&
+           (MFRC522_SelectTag(&rfid, uid) == MFRC522_OK);
+}
+
+static bool Bench_UidIs(const Uid_t *uid, const SimCard_t *card) {
+    return (uid->size == card->uidSize) && (memcmp(uid->uidByte, card->uid, card->uidSize) == 0);
+}
+
+static Uid_t benchUid;
+
+static void Setup_Empty(void) {
+    Bench_Field(NULL, 0);
+}
+
+static void Setup_Classic(void) {
+    Bench_Field(&classic, 1);
+}
+
+static void Setup_ClassicLocked(void) {
+    Setup_Classic();
+    memset(&classic->mem[11 * 16], 0xA5, 6);
+}
+
+static void Teardown_Unlock(void) {
+    memset(&classic->mem[11 * 16], 0xFF, 6);
+}
+
+static void Setup_ClassicSiteKey(void) {
+    Setup_Classic();
+    memcpy(&classic->mem[7 * 16], siteKey, 6);
+}
+
+static void Setup_SiteKeyCold(void) {
+    Setup_ClassicSiteKey();
+    MFRC522_KeyCacheInit(&keyCache);
+}
+
+/* Same card seen before: the cache already knows its sector 1 key */
+static void Setup_SiteKeyWarm(void) {
+    Setup_ClassicSiteKey();
+    MFRC522_KeyCacheInit(&keyCache);
+    MFRC522_Session_t session;
+    uint8_t data[16];
+    MFRC522_SessionBegin(&rfid, &session, PICC_CMD_REQA, PICC_CMD_MF_AUTH_KEY_A, NULL);
+    MFRC522_SessionUseKeys(&session, &keyTable, &keyCache);
+    MFRC522_SessionReadBlock(&rfid, &session, BENCH_BLOCK, data);
+    MFRC522_SessionEnd(&rfid, &session);
+    Setup_Classic();
+}
+
+static void Teardown_SiteKey(void) {
+    memset(&classic->mem[7 * 16], 0xFF, 6);
+}
+
+static void Setup_Classic10(void) {
+    Bench_Field(&classic10, 1);
+}
+
+static void Setup_ClassicReady(void) {
+    uint8_t atqa[2];
+    Setup_Classic();
+    MFRC522_Request(&rfid, PICC_CMD_REQA, atqa);
+}
+
+static void Setup_UltralightReady(void) {
+    uint8_t atqa[2];
+    Bench_Field(&ultralight, 1);
+    MFRC522_Request(&rfid, PICC_CMD_REQA, atqa);
+}
+
+static void Setup_Classic10Ready(void) {
+    uint8_t atqa[2];
+    Bench_Field(&classic10, 1);
+    MFRC522_Request(&rfid, PICC_CMD_REQA, atqa);
+}
+
+static void Setup_ClassicSelected(void) {
+    Setup_Classic();
+    Bench_Select(&benchUid);
+}
+
+static void Setup_ClassicAuthenticated(void) {
+    Setup_ClassicSelected();
+    MFRC522_Auth(&rfid, PICC_CMD_MF_AUTH_KEY_A, BENCH_BLOCK, keyA, &benchUid);
+}
+
+static void Setup_UltralightSelected(void) {
+    Bench_Field(&ultralight, 1);
+    Bench_Select(&benchUid);
+}
+
+static void Setup_UltralightEv1Selected(void) {
+    Bench_Field(&ultralightEv1, 1);
+    Bench_Select(&benchUid);
+}
+
+static void Setup_Ultralight(void) {
+    Bench_Field(&ultralight, 1);
+}
+
+static void Setup_StackClassic(void) {
+    Bench_Field(stackClassic, 3);
+}
+
+static void Setup_StackUltralight(void) {
+    Bench_Field(stackUltralight, 3);
+}
+
+static void Setup_NoisyClassic(void) {
+    static uint32_t seed = 0x5EED;
+
+    Setup_Classic();
+    Sim_SetErrorRate(100, seed++);
+}
+
+static void Setup_DesfireSelected(void) {
+    Bench_Field(&desfire, 1);
+    Bench_Select(&benchUid);
+}
+
+static void Setup_DesfireActive(void) {
+    Setup_DesfireSelected();
+    MFRC522_IsoDepActivate(&rfid, &iso, MFRC522_BITRATE_848);
+}
+
+static void Setup_DesfireActive106(void) {
+    Setup_DesfireSelected();
+    MFRC522_IsoDepActivate(&rfid, &iso, MFRC522_BITRATE_106);
+}
+
+static void Setup_DesfireUpdate(void) {
+    Setup_DesfireActive();
+    memset(desfire->mem, 0x00, 200);
+}
+
+static void Setup_DesfireCrcError(void) {
+    Setup_DesfireActive();
+    Sim_InjectFault(desfire, SIM_FAULT_CRC, 1);
+}
+
+/* One fault aimed at a step of the scan: ATQA, anticollision, SAK, READ */
+static void Setup_ClassicFault(SimFault_t fault, uint16_t skip) {
+    Setup_Classic();
+    Sim_InjectFaultAt(classic, fault, 1, skip);
+}
+
+static void Setup_AnticollParity(void) {
+    Setup_ClassicFault(SIM_FAULT_PARITY, 1);
+}
+
+static void Setup_SakLost(void) {
+    Setup_ClassicFault(SIM_FAULT_DROP, 2);
+}
+
+static void Setup_ReadCrcError(void) {
+    Setup_ClassicFault(SIM_FAULT_CRC, 3);
+}
+
+static void Teardown_Deselect(void) {
+    MFRC522_IsoDepDeselect(&rfid, &iso);
+}
+
+/* Crypto1 stays on in the reader after an authentication, as in main.c */
+static void Teardown_Crypto(void) {
+    MFRC522_ClearBitMask(&rfid, MFRC522_REG_STATUS_2, 0x08);
+}
+
+static void Teardown_Fault(void) {
+    Sim_InjectFault(classic, SIM_FAULT_NONE, 0);
+    Teardown_Crypto();
+}
+
+static void Teardown_Noise(void) {
+    Sim_SetErrorRate(0, 0);
+    Teardown_Crypto();
+}
+
+static void Teardown_WakeUp(void) {
+    MFRC522_SoftWakeUp(&rfid);
+    MFRC522_AntennaOn(&rfid);
+}
+
+static bool Run_RequestEmpty(void) {
+    uint8_t atqa[2];
+    return MFRC522_Request(&rfid, PICC_CMD_REQA, atqa) != MFRC522_OK;
+}
+
+static bool Run_Request(void) {
+    uint8_t atqa[2];
+    return (MFRC522_Request(&rfid, PICC_CMD_REQA, atqa) == MFRC522_OK) &&
+           (atqa[0] == classic->atqa[0]) && (atqa[1] == classic->atqa[1]);
+}
+
+static bool Run_SelectClassic(void) {
+    Uid_t uid;
+    return (MFRC522_Anticoll(&rfid, &uid) == MFRC522_OK) && (MFRC522_SelectTag(&rfid, &uid) == MFRC522_OK) &&
+           Bench_UidIs(&uid, classic) && (uid.sak == classic->sak);
+}
+
+static bool Run_SelectUltralight(void) {
+    Uid_t uid;
+    return (MFRC522_Anticoll(&rfid, &uid) == MFRC522_OK) && (MFRC522_SelectTag(&rfid, &uid) == MFRC522_OK) &&
+           Bench_UidIs(&uid, ultralight) && (uid.sak == ultralight->sak);
+}
+
+static bool Run_SelectClassic10(void) {
+    Uid_t uid;
+    return (MFRC522_Anticoll(&rfid, &uid) == MFRC522_OK) && (MFRC522_SelectTag(&rfid, &uid) == MFRC522_OK) &&
+           Bench_UidIs(&uid, classic10) && (uid.sak == classic10->sak);
+}
+
+static bool Run_AuthRead(void) {
+    uint8_t data[16];
+    return (MFRC522_Auth(&rfid, PICC_CMD_MF_AUTH_KEY_A, BENCH_BLOCK, keyA, &benchUid) == MFRC522_OK) &&
+           (MFRC522_Read(&rfid, BENCH_BLOCK, data) == MFRC522_OK) &&
+           (memcmp(data, &classic->mem[BENCH_BLOCK * 16], 16) == 0);
+}
+
+static bool Run_Scan(void) {
+    MFRC522_Seq_t seq = {
+        .steps = MFRC522_SEQ_REQUEST | MFRC522_SEQ_ANTICOLL | MFRC522_SEQ_SELECT |
+                 MFRC522_SEQ_AUTH | MFRC522_SEQ_READ,
+        .reqMode = PICC_CMD_REQA,
+        .authMode = PICC_CMD_MF_AUTH_KEY_A,
+        .blockAddr = BENCH_BLOCK,
+        .key = keyA,
+    };
+    return (MFRC522_RunSequence(&rfid, &seq) == MFRC522_OK) && Bench_UidIs(&seq.uid, classic) &&
+           (memcmp(seq.data, &classic->mem[BENCH_BLOCK * 16], 16) == 0);
+}
+
+/* UID-only scan profile: the card is halted right after SELECT */
+static bool Run_ScanUid(void) {
+    MFRC522_Seq_t seq = {
+        .steps = MFRC522_SEQ_REQUEST | MFRC522_SEQ_ANTICOLL | MFRC522_SEQ_SELECT,
+        .reqMode = PICC_CMD_REQA,
+    };
+    bool ok = (MFRC522_RunSequence(&rfid, &seq) == MFRC522_OK) && Bench_UidIs(&seq.uid, classic);
+    MFRC522_Halt(&rfid);
+    return ok && (classic->state == SIM_PICC_HALT);
+}
+
+/* Auto-scan of a card it reported before: the sequence ends after SELECT */
+static bool Run_ScanTracked(void) {
+    Uid_t tracked = {.size = classic->uidSize};
+    memcpy(tracked.uidByte, classic->uid, classic->uidSize);
+
+    MFRC522_Seq_t seq = {
+        .steps = MFRC522_SEQ_REQUEST | MFRC522_SEQ_ANTICOLL | MFRC522_SEQ_SELECT |
+                 MFRC522_SEQ_AUTH | MFRC522_SEQ_READ,
+        .reqMode = PICC_CMD_REQA,
+        .authMode = PICC_CMD_MF_AUTH_KEY_A,
+        .blockAddr = BENCH_BLOCK,
+        .key = keyA,
+        .skipUids = &tracked,
+        .skipCount = 1,
+    };
+    bool ok = (MFRC522_RunSequence(&rfid, &seq) == MFRC522_OK) && Bench_UidIs(&seq.uid, classic) &&
+              (seq.completed == (MFRC522_SEQ_REQUEST | MFRC522_SEQ_ANTICOLL | MFRC522_SEQ_SELECT));
+    MFRC522_Halt(&rfid);
+    return ok && (classic->state == SIM_PICC_HALT);
+}
+
+static bool Run_ReadUltralight(void) {
+    uint8_t data[16];
+    return (MFRC522_Read(&rfid, BENCH_BLOCK, data) == MFRC522_OK) &&
+           (memcmp(data, &ultralight->mem[BENCH_BLOCK * 4], 16) == 0);
+}
+
+/* Same sequence as the Classic scan: AUTH is dropped once the SAK is known */
+static bool Run_ScanUltralight(void) {
+    MFRC522_Seq_t seq = {
+        .steps = MFRC522_SEQ_REQUEST | MFRC522_SEQ_ANTICOLL | MFRC522_SEQ_SELECT |
+                 MFRC522_SEQ_AUTH | MFRC522_SEQ_READ,
+        .reqMode = PICC_CMD_REQA,
+        .authMode = PICC_CMD_MF_AUTH_KEY_A,
+        .blockAddr = BENCH_BLOCK,
+        .key = keyA,
+    };
+    return (MFRC522_RunSequence(&rfid, &seq) == MFRC522_OK) && !(seq.steps & MFRC522_SEQ_AUTH) &&
+           Bench_UidIs(&seq.uid, ultralight) && (memcmp(seq.data, &ultralight->mem[BENCH_BLOCK * 4], 16) == 0);
+}
+
+static bool Run_ReadAllUltralight(void) {
+    uint8_t data[MFRC522_UL_PAGES * 4];
+    for (uint8_t page = 0; page < MFRC522_UL_PAGES; page += 4) {
+        if (MFRC522_Read(&rfid, page, &data[page * 4]) != MFRC522_OK) {
+            return false;
+        }
+    }
+    return memcmp(data, ultralight->mem, sizeof(data)) == 0;
+}
+
+static bool Run_FastReadEv1(void) {
+    uint8_t version[8];
+    uint8_t data[64 * 4];
+    uint16_t pages;
+    return (MFRC522_GetVersion(&rfid, version) == MFRC522_OK) &&
+           ((pages = MFRC522_GetPageCount(version)) == ultralightEv1->memSize / 4) &&
+           (MFRC522_FastRead(&rfid, 0, pages - 1, data) == MFRC522_OK) &&
+           (memcmp(data, ultralightEv1->mem, pages * 4) == 0);
+}
+
+static bool Run_Write(void) {
+    uint8_t data[16];
+    memcpy(data, blockData, 16);
+    return (MFRC522_Write(&rfid, BENCH_BLOCK, data) == MFRC522_OK) &&
+           (memcmp(&classic->mem[BENCH_BLOCK * 16], blockData, 16) == 0);
+}
+
+static bool Run_Halt(void) {
+    MFRC522_Halt(&rfid);
+    return classic->state == SIM_PICC_HALT;
+}
+
+static bool Run_InventoryClassic(void) {
+    Uid_t uids[4];
+    return MFRC522_Inventory(&rfid, uids, 4) == 3;
+}
+
+static bool Run_InventoryUltralight(void) {
+    Uid_t uids[4];
+    return MFRC522_Inventory(&rfid, uids, 4) == 3;
+}
+
+/* Sector 1 the way ExecuteReadBlock used to do it: full scan per block.
+ * Data blocks are compared, the trailer reads back with key A zeroed. */
+static bool Run_SectorPerBlock(void) {
+    for (uint8_t b = 4; b < 8; b++) {
+        MFRC522_Seq_t seq = {
+            .steps = MFRC522_SEQ_REQUEST | MFRC522_SEQ_ANTICOLL | MFRC522_SEQ_SELECT |
+                     MFRC522_SEQ_AUTH | MFRC522_SEQ_READ,
+            .reqMode = PICC_CMD_WUPA,
+            .authMode = PICC_CMD_MF_AUTH_KEY_A,
+            .blockAddr = b,
+            .key = keyA,
+        };
+        bool ok = (MFRC522_RunSequence(&rfid, &seq) == MFRC522_OK) &&
+                  ((b == 7) || (memcmp(seq.data, &classic->mem[b * 16], 16) == 0));
+        MFRC522_Halt(&rfid);
+        MFRC522_ClearBitMask(&rfid, MFRC522_REG_STATUS_2, 0x08);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool Run_SectorSession(void) {
+    MFRC522_Session_t session;
+    uint8_t data[4 * 16];
+    bool ok = (MFRC522_SessionBegin(&rfid, &session, PICC_CMD_REQA, PICC_CMD_MF_AUTH_KEY_A, keyA) == MFRC522_OK) &&
+              (MFRC522_SessionReadSector(&rfid, &session, 1, data) == MFRC522_OK) &&
+              (session.auths == 1) && (memcmp(data, &classic->mem[4 * 16], 3 * 16) == 0);
+    MFRC522_SessionEnd(&rfid, &session);
+    return ok;
+}
+
+/* Whole card, one AUTH per sector; key A reads back as zeros in the trailers */
+static bool Bench_Dump(SimCard_t *card) {
+    static uint8_t data[4096];
+    MFRC522_Session_t session;
+    bool ok = MFRC522_SessionBegin(&rfid, &session, PICC_CMD_REQA, PICC_CMD_MF_AUTH_KEY_A, keyA) == MFRC522_OK;
+    uint16_t blocks = MFRC522_GetBlockCount(MFRC522_GetType(session.uid.sak));
+    uint8_t sectors = ok ? MFRC522_SectorOfBlock(blocks - 1) + 1 : 0;
+
+    for (uint8_t s = 0; ok && (s < sectors); s++) {
+        ok = MFRC522_SessionReadSector(&rfid, &session, s, &data[MFRC522_SectorFirstBlock(s) * 16]) == MFRC522_OK;
+    }
+    MFRC522_SessionEnd(&rfid, &session);
+
+    return ok && (blocks * 16 == card->memSize) && (session.auths == sectors) &&
+           Bench_UidIs(&session.uid, card) && (memcmp(&data[BENCH_BLOCK * 16], &card->mem[BENCH_BLOCK * 16], 16) == 0);
+}
+
+static bool Run_DumpClassic(void) {
+    return Bench_Dump(classic);
+}
+
+static bool Run_DumpClassic4K(void) {
+    return Bench_Dump(classic10);
+}
+
+/* Sector 2 has another key: its AUTH fails, the card is re-selected and
+ * the dump goes on with sector 3 */
+static bool Run_DumpLockedSector(void) {
+    uint8_t data[4 * 16];
+    MFRC522_Session_t session;
+    bool ok = MFRC522_SessionBegin(&rfid, &session, PICC_CMD_REQA, PICC_CMD_MF_AUTH_KEY_A, keyA) == MFRC522_OK;
+    uint8_t failed = 0;
+
+    for (uint8_t s = 0; ok && (s < 16); s++) {
+        if (MFRC522_SessionReadSector(&rfid, &session, s, data) != MFRC522_OK) {
+            failed++;
+        }
+    }
+    MFRC522_SessionEnd(&rfid, &session);
+
+    return ok && (failed == 1) && (session.blocksRead == 60) && (session.auths == 16);
+}
+
+static bool Run_DictionaryRead(void) {
+    MFRC522_Session_t session;
+    uint8_t data[16];
+    bool ok = (MFRC522_SessionBegin(&rfid, &session, PICC_CMD_REQA, PICC_CMD_MF_AUTH_KEY_A, NULL) == MFRC522_OK);
+
+    MFRC522_SessionUseKeys(&session, &keyTable, &keyCache);
+    ok = ok && (MFRC522_SessionReadBlock(&rfid, &session, BENCH_BLOCK, data) == MFRC522_OK) &&
+         (memcmp(data, &classic->mem[BENCH_BLOCK * 16], 16) == 0);
+    MFRC522_SessionEnd(&rfid, &session);
+    return ok;
+}
+
+static bool Run_Rats(void) {
+    bool ok = (MFRC522_IsoDepActivate(&rfid, &iso, MFRC522_BITRATE_848) == MFRC522_OK) &&
+              (iso.txRate == MFRC522_BITRATE_848) && (iso.rxRate == MFRC522_BITRATE_848) && (iso.fsc == 64);
+    return ok && (desfire->ds == 3) && (desfire->dr == 3);
+}
+
+/* 256 bytes from offset 0x100 and the status word: the answer does not fit
+ * FSD 256, the card chains two I-blocks */
+static bool Bench_ReadBinary(void) {
+    static const uint8_t apdu[5] = {0x00, 0xB0, 0x01, 0x00, 0x00};
+    uint8_t resp[258];
+    uint16_t len;
+
+    return (MFRC522_IsoDepTransceive(&rfid, &iso, apdu, sizeof(apdu), resp, sizeof(resp), &len) == MFRC522_OK) &&
+           (len == 258) && (resp[256] == 0x90) && (resp[257] == 0x00) &&
+           (memcmp(resp, &desfire->mem[0x100], 256) == 0);
+}
+
+static bool Run_ReadBinary(void) {
+    return Bench_ReadBinary();
+}
+
+static bool Run_ReadBinaryRetry(void) {
+    return Bench_ReadBinary() && (iso.retries == 1);
+}
+
+/* 205-byte command in four chained I-blocks, then S(WTX) while the card writes */
+static bool Run_UpdateBinary(void) {
+    uint8_t apdu[5 + 200];
+    uint8_t resp[2];
+    uint16_t len;
+
+    apdu[0] = 0x00;
+    apdu[1] = 0xD6;
+    apdu[2] = 0x00;
+    apdu[3] = 0x00;
+    apdu[4] = 200;
+    for (uint16_t i = 0; i < 200; i++) {
+        apdu[5 + i] = (uint8_t)(i * 7 + 1);
+    }
+
+    return (MFRC522_IsoDepTransceive(&rfid, &iso, apdu, sizeof(apdu), resp, sizeof(resp), &len) == MFRC522_OK) &&
+           (len == 2) && (resp[0] == 0x90) && (iso.wtx == 1) && (memcmp(desfire->mem, &apdu[5], 200) == 0);
+}
+
+static bool Run_SpiTest(void) {
+    return MFRC522_SpiTest(&rfid, 10);
+}
+
+static bool Run_SpiTestOverLimit(void) {
+    return !MFRC522_SpiTest(&rfid, 10);
+}
+
+static void Setup_SpiLimit(void) {
+    Setup_Empty();
+    Sim_SetSpiLimit(4000000);
+}
+
+static void Teardown_SpiLimit(void) {
+    Sim_SetSpiLimit(0);
+}
+
+/* Cards reported by the auto-scan are halted; their UIDs are known */
+static Uid_t trackedUids[4];
+
+static void Setup_ClassicHalted(void) {
+    Setup_ClassicSelected();
+    MFRC522_Halt(&rfid);
+}
+
+static void Setup_UltralightHalted(void) {
+    Setup_UltralightSelected();
+    MFRC522_Halt(&rfid);
+}
+
+static void Setup_ClassicRemoved(void) {
+    Setup_ClassicHalted();
+    Setup_Empty();
+}
+
+static void Setup_StackHalted(void) {
+    Setup_StackClassic();
+    MFRC522_Inventory(&rfid, trackedUids, 3);
+}
+
+static bool Run_CheckCard(void) {
+    SimCard_t *card = Bench_UidIs(&benchUid, classic) ? classic : ultralight;
+    return MFRC522_CheckCard(&rfid, &benchUid) && (card->state == SIM_PICC_HALT);
+}
+
+static bool Run_CheckCardRemoved(void) {
+    return !MFRC522_CheckCard(&rfid, &benchUid);
+}
+
+/* Every card checked on its own, then halted again as the auto-scan does */
+static bool Run_CheckStack(void) {
+    for (uint8_t i = 0; i < 3; i++) {
+        if (!MFRC522_CheckCard(&rfid, &trackedUids[i])) {
+            return false;
+        }
+    }
+    for (uint8_t i = 0; i < 3; i++) {
+        MFRC522_HaltCard(&rfid, &trackedUids[i]);
+    }
+    for (uint8_t i = 0; i < 3; i++) {
+        if (stackClassic[i]->state != SIM_PICC_HALT) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool Run_ProbeEmpty(void) {
+    return !MFRC522_ProbePresence(&rfid);
+}
+
+static bool Run_ProbeClassic(void) {
+    return MFRC522_ProbePresence(&rfid);
+}
+
+static const BenchOp_t benchOps[] = {
+    {"REQA, empty field",             Setup_Empty,               Run_RequestEmpty,        NULL},
+    {"REQA, Classic 1K",              Setup_Classic,             Run_Request,             NULL},
+    {"Anticoll+SELECT, 4-byte UID",   Setup_ClassicReady,        Run_SelectClassic,       NULL},
+    {"Anticoll+SELECT, 7-byte UID",   Setup_UltralightReady,     Run_SelectUltralight,    NULL},
+    {"Anticoll+SELECT, 10-byte UID",  Setup_Classic10Ready,      Run_SelectClassic10,     NULL},
+    {"AUTH+READ block (Classic)",     Setup_ClassicSelected,     Run_AuthRead,            Teardown_Crypto},
+    {"WRITE block (Classic)",         Setup_ClassicAuthenticated, Run_Write,              Teardown_Crypto},
+    {"READ 4 pages (Ultralight)",     Setup_UltralightSelected,  Run_ReadUltralight,      NULL},
+    {"READ 16 pages (Ultralight)",    Setup_UltralightSelected,  Run_ReadAllUltralight,   NULL},
+    {"VERSION+FAST_READ 20 pages",    Setup_UltralightEv1Selected, Run_FastReadEv1,       NULL},
+    {"HLTA",                          Setup_ClassicSelected,     Run_Halt,                NULL},
+    {"RATS+PPS, DESFire",             Setup_DesfireSelected,     Run_Rats,                Teardown_Deselect},
+    {"READ BINARY 256 B, 106 kbit/s", Setup_DesfireActive106,    Run_ReadBinary,          Teardown_Deselect},
+    {"READ BINARY 256 B, 848 kbit/s", Setup_DesfireActive,       Run_ReadBinary,          Teardown_Deselect},
+    {"UPDATE BINARY 200 B, WTX",      Setup_DesfireUpdate,       Run_UpdateBinary,        Teardown_Deselect},
+    {"READ BINARY, one CRC error",    Setup_DesfireCrcError,     Run_ReadBinaryRetry,     Teardown_Deselect},
+    {"Scan REQA..READ (Classic)",     Setup_Classic,             Run_Scan,                Teardown_Crypto},
+    {"Scan REQA..HLTA, UID only",     Setup_Classic,             Run_ScanUid,             NULL},
+    {"Scan REQA..READ (Ultralight)",  Setup_Ultralight,          Run_ScanUltralight,      NULL},
+    {"Scan, card tracked already",    Setup_Classic,             Run_ScanTracked,         NULL},
+    {"Scan, 10% RF errors",           Setup_NoisyClassic,        Run_Scan,                Teardown_Noise},
+    {"Scan, anticoll parity error",   Setup_AnticollParity,      Run_Scan,                Teardown_Fault},
+    {"Scan, SAK lost",                Setup_SakLost,             Run_Scan,                Teardown_Fault},
+    {"Scan, READ CRC error",          Setup_ReadCrcError,        Run_Scan,                Teardown_Fault},
+    {"Sector 1, scan per block",      Setup_Classic,             Run_SectorPerBlock,      NULL},
+    {"Sector 1, session",             Setup_Classic,             Run_SectorSession,       NULL},
+    {"Dump Classic 1K, session",      Setup_Classic,             Run_DumpClassic,         NULL},
+    {"Dump Classic 4K, session",      Setup_Classic10,           Run_DumpClassic4K,       NULL},
+    {"Dump 1K, sector 2 locked",      Setup_ClassicLocked,       Run_DumpLockedSector,    Teardown_Unlock},
+    {"Key 4 of 4, cold cache",        Setup_SiteKeyCold,         Run_DictionaryRead,      Teardown_SiteKey},
+    {"Key 4 of 4, warm cache",        Setup_SiteKeyWarm,         Run_DictionaryRead,      Teardown_SiteKey},
+    {"Inventory, 3x Classic 4-byte",  Setup_StackClassic,        Run_InventoryClassic,    NULL},
+    {"Inventory, 3x Ultralight",      Setup_StackUltralight,     Run_InventoryUltralight, NULL},
+    {"SPI link test x10",             Setup_Empty,               Run_SpiTest,             NULL},
+    {"SPI link test, over the limit", Setup_SpiLimit,            Run_SpiTestOverLimit,    Teardown_SpiLimit},
+    {"Presence probe, empty field",   Setup_Empty,               Run_ProbeEmpty,          Teardown_WakeUp},
+    {"Presence probe, card present",  Setup_Classic,             Run_ProbeClassic,        NULL},
+    {"Re-check halted, 4-byte UID",   Setup_ClassicHalted,       Run_CheckCard,           NULL},
+    {"Re-check halted, 7-byte UID",   Setup_UltralightHalted,    Run_CheckCard,           NULL},
+    {"Re-check 3 halted cards",       Setup_StackHalted,         Run_CheckStack,          NULL},
+    {"Re-check, card removed",        Setup_ClassicRemoved,      Run_CheckCardRemoved,    NULL},
+};
+
+static void Bench_Run(const BenchOp_t *op, uint32_t iterations) {
+    uint64_t transactions = 0;
+    uint64_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t frames = 0;
+    uint64_t ns = 0;
+    uint32_t ok = 0;
+
+    for (uint32_t i = 0; i < iterations; i++) {
+        op->setup();
+
+        MFRC522_ResetStats(&rfid);
+        Sim_ResetChipStats(chip);
+        uint64_t start = Sim_Now();
+
+        if (op->run()) {
+            ok++;
+        }
+
+        ns += Sim_Now() - start;
+        const MFRC522_Stats_t *stats = MFRC522_GetStats(&rfid);
+        transactions += stats->spiTransactions;
+        bytes += stats->spiBytes;
+        hits += stats->cacheHits;
+        frames += Sim_GetChipStats(chip)->frames;
+
+        if (op->teardown != NULL) {
+            op->teardown();
+        }
+    }
+
+    printf("%-30s %4u/%-4u %7.1f %7.1f %6.1f %6.1f %9.1f\n", op->name, (unsigned)ok, (unsigned)iterations,
+           (double)transactions / iterations, (double)bytes / iterations, (double)hits / iterations,
+           (double)frames / iterations, (double)ns / iterations / 1000.0);
+}
+
+static void Bench_AddCards(void) {
+    static const uint8_t uidClassic[4] = {0x5A, 0x3C, 0x91, 0x2E};
+    static const uint8_t uidClassic10[10] = {0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99};
+    static const uint8_t uidUltralight[7] = {0x04, 0x6F, 0x25, 0xA2, 0x3B, 0x51, 0x80};
+    static const uint8_t uidUltralightEv1[7] = {0x04, 0x2C, 0x7A, 0x91, 0x0E, 0x64, 0x81};
+    static const uint8_t uidDesfire[7] = {0x04, 0x3E, 0x51, 0x8A, 0xC2, 0x1D, 0x90};
+    // Shared first byte, so anticollision has to go past a whole UID byte
+    static const uint8_t uidStackClassic[3][4] = {
+        {0xB3, 0x10, 0x7E, 0x01}, {0xB3, 0x94, 0x02, 0x5C}, {0xB3, 0x95, 0x66, 0xC8},
+    };
+    // NXP UIDs all start with 04, and CL1 with the cascade tag: the first
+    // 16 bits of every cascade level 1 answer are identical. After the
+    // first collision two cards still collide further on.
+    static const uint8_t uidStackUltralight[3][7] = {
+        {0x04, 0x52, 0x19, 0x6A, 0x2C, 0x4D, 0x80},
+        {0x04, 0x53, 0x88, 0x02, 0x7E, 0x40, 0x81},
+        {0x04, 0x53, 0x89, 0x72, 0x1F, 0x4D, 0x80},
+    };
+
+    static const uint8_t otherKeys[3][6] = {
+        {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}, {0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5}, {0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+    };
+
+    MFRC522_KeyTableInit(&keyTable);
+    for (uint8_t k = 0; k < 3; k++) {
+        MFRC522_KeyTableSet(&keyTable, k, PICC_CMD_MF_AUTH_KEY_A, otherKeys[k]);
+    }
+    MFRC522_KeyTableSet(&keyTable, 3, PICC_CMD_MF_AUTH_KEY_A, siteKey);
+
+    classic = Sim_AddCard(SIM_CARD_CLASSIC_1K, uidClassic, 4);
+    memcpy(&classic->mem[BENCH_BLOCK * 16], "Student 00421337", 16);
+    classic10 = Sim_AddCard(SIM_CARD_CLASSIC_4K, uidClassic10, 10);
+    ultralight = Sim_AddCard(SIM_CARD_ULTRALIGHT, uidUltralight, 7);
+    memcpy(&ultralight->mem[BENCH_BLOCK * 4], "Ultralight pages", 16);
+    ultralightEv1 = Sim_AddCard(SIM_CARD_ULTRALIGHT_EV1, uidUltralightEv1, 7);
+    memcpy(&ultralightEv1->mem[BENCH_BLOCK * 4], "EV1 fast reading", 16);
+    desfire = Sim_AddCard(SIM_CARD_DESFIRE, uidDesfire, 7);
+    for (uint16_t i = 0; i < desfire->memSize; i++) {
+        desfire->mem[i] = (uint8_t)(i ^ (i >> 8));
+    }
+
+    for (uint8_t i = 0; i < 3; i++) {
+        stackClassic[i] = Sim_AddCard(SIM_CARD_CLASSIC_1K, uidStackClassic[i], 4);
+        stackUltralight[i] = Sim_AddCard(SIM_CARD_ULTRALIGHT, uidStackUltralight[i], 7);
+    }
+}
+
+/* The CRC_A vectors of the crctest console command, against both
+ * implementations; returns the number of mismatches */
+static uint8_t Bench_CrcVectors(void) {
+    static const struct {
+        uint8_t data[16];
+        uint8_t len;
+        uint8_t crc[2];
+    } vectors[] = {
+        {{0x00, 0x00}, 2, {0xA0, 0x1E}},
+        {{0x12, 0x34}, 2, {0x26, 0xCF}},
+        {{PICC_CMD_HLTA, 0x00}, 2, {0x57, 0xCD}},
+        {{PICC_CMD_MF_READ, 0x04}, 2, {0x26, 0xEE}},
+        {{PICC_CMD_SEL_CL1, 0x70, 0x11, 0x22, 0x33, 0x44, 0x44}, 7, {0x51, 0x9C}},
+        {{0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+          0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F}, 16, {0x77, 0xF5}},
+    };
+    uint8_t count = sizeof(vectors) / sizeof(vectors[0]);
+    uint8_t failures = 0;
+
+    for (uint8_t v = 0; v < count; v++) {
+        uint8_t soft[2];
+        uint8_t chipCrc[2];
+        MFRC522_CalculateCRC_Software(vectors[v].data, vectors[v].len, soft);
+        MFRC522_CalculateCRC_Chip(&rfid, vectors[v].data, vectors[v].len, chipCrc);
+        if ((memcmp(soft, vectors[v].crc, 2) != 0) || (memcmp(chipCrc, vectors[v].crc, 2) != 0)) {
+            printf("CRC_A vector %u: expected %02X %02X, soft %02X %02X, chip %02X %02X\n", (unsigned)v,
+                   vectors[v].crc[0], vectors[v].crc[1], soft[0], soft[1], chipCrc[0], chipCrc[1]);
+            failures++;
+        }
+    }
+
+    printf("CRC_A vectors: %u/%u passed\n", (unsigned)(count - failures), (unsigned)count);
+    return failures;
+}
+
+static void Bench_Usage(const char *prog) {
+    printf("usage: %s [poll|irq] [dma|nodma] [soft|chip] [n=ITERATIONS] [spi=HZ]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    MFRC522_WaitMode_t modes[2] = {MFRC522_WAIT_POLL, MFRC522_WAIT_IRQ};
+    uint8_t modeCount = 2;
+    bool dma = true;
+    MFRC522_CrcMode_t crc = MFRC522_CRC_SOFTWARE;
+    uint32_t iterations = BENCH_DEFAULT_ITERATIONS;
+    uint32_t spiHz = 10000000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "poll") == 0) {
+            modes[0] = MFRC522_WAIT_POLL;
+            modeCount = 1;
+        } else if (strcmp(argv[i], "irq") == 0) {
+            modes[0] = MFRC522_WAIT_IRQ;
+            modeCount = 1;
+        } else if (strcmp(argv[i], "dma") == 0) {
+            dma = true;
+        } else if (strcmp(argv[i], "nodma") == 0) {
+            dma = false;
+        } else if (strcmp(argv[i], "soft") == 0) {
+            crc = MFRC522_CRC_SOFTWARE;
+        } else if (strcmp(argv[i], "chip") == 0) {
+            crc = MFRC522_CRC_CHIP;
+        } else if (strncmp(argv[i], "n=", 2) == 0) {
+            iterations = strtoul(argv[i] + 2, NULL, 10);
+        } else if (strncmp(argv[i], "spi=", 4) == 0) {
+            spiHz = strtoul(argv[i] + 4, NULL, 10);
+        } else {
+            Bench_Usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((iterations == 0) || (spiHz == 0)) {
+        Bench_Usage(argv[0]);
+        return 1;
+    }
+
+    Sim_Reset();
+    Sim_SetSpiClock(spiHz);
+    chip = Sim_AddChip(GPIOD, GPIO_PIN_14, GPIOD, GPIO_PIN_15, GPIOD, GPIO_PIN_13);
+    Bench_AddCards();
+
+    hspi5.hdmatx = &hdma_spi5_tx;
+    hspi5.hdmarx = &hdma_spi5_rx;
+
+    MFRC522_Config_t config = {
+        .hspi = &hspi5,
+        .CS_GPIO_Port = GPIOD,
+        .CS_Pin = GPIO_PIN_14,
+        .RST_GPIO_Port = GPIOD,
+        .RST_Pin = GPIO_PIN_15,
+        .IRQ_GPIO_Port = GPIOD,
+        .IRQ_Pin = GPIO_PIN_13,
+    };
+    MFRC522_Init(&rfid, &config);
+
+    uint8_t version;
+    if (!MFRC522_Check(&rfid, &version)) {
+        printf("MFRC522 model not answering (version 0x%02X)\n", version);
+        return 1;
+    }
+
+    MFRC522_SetDMA(&rfid, dma);
+    MFRC522_SetCRCMode(&rfid, crc);
+
+    if (Bench_CrcVectors() != 0) {
+        return 1;
+    }
+
+    for (uint8_t m = 0; m < modeCount; m++) {
+        MFRC522_SetWaitMode(&rfid, modes[m]);
+
+        printf("\nWait: %s, DMA: %s, CRC: %s, SPI: %.2f MHz, %u iterations\n",
+               (modes[m] == MFRC522_WAIT_IRQ) ? "IRQ" : "poll", dma ? "on" : "off",
+               (crc == MFRC522_CRC_CHIP) ? "chip" : "software", spiHz / 1e6, (unsigned)iterations);
+        printf("%-30s %9s %7s %7s %6s %6s %9s\n", "Operation", "OK", "SPI tx", "Bytes", "Cache", "RF", "us");
+
+        for (size_t i = 0; i < sizeof(benchOps) / sizeof(benchOps[0]); i++) {
+            Bench_Run(&benchOps[i], iterations);
+        }
+    }
+
+    return 0;
+}
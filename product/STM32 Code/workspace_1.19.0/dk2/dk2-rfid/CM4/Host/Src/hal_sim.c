@@ -0,0 +1,225 @@
+/* hal_sim.c - HAL stand-in on the virtual clock of mfrc522_sim.c
+ *
+ * Every HAL call costs a little virtual time; SPI bytes cost their bus
+ * time. Interrupts (IRQ pin falling edge, SPI DMA completion) are taken
+ * at the end of HAL calls and on __enable_irq, as long as PRIMASK allows,
+ * and __WFI sleeps until the next chip event, DMA completion or SysTick. */
+
+#include "mfrc522_sim.h"
+
+GPIO_TypeDef sim_gpio[11];
+DWT_Type sim_dwt;
+
+/* HAL_GetTick, GPIO writes */
+#define SIM_CALL_NS       50
+/* Blocking transfer: HAL entry, flag polling, exit */
+#define SIM_SPI_SETUP_NS  400
+/* Two DMA streams configured and started */
+#define SIM_DMA_SETUP_NS  1500
+#define SIM_SYSTICK_NS    1000000ULL
+
+static uint32_t sim_spi_hz = 10000000;
+static uint32_t sim_spi_limit = 0;
+static uint32_t sim_spi_bytes = 0;
+static bool sim_primask = false;
+static uint16_t sim_exti_pending = 0;
+static SPI_HandleTypeDef *sim_dma_hspi = NULL;
+static SPI_HandleTypeDef *sim_dma_done = NULL;
+
+/* SPI5 runs from its kernel clock /8; the MFRC522 accepts up to 10 Mbit/s */
+void Sim_SetSpiClock(uint32_t hz) {
+    sim_spi_hz = hz;
+}
+
+/* Fastest clock the wiring carries, 0 for no limit. Above it one MISO
+ * byte in 97 comes back with a flipped bit. */
+void Sim_SetSpiLimit(uint32_t hz) {
+    sim_spi_limit = hz;
+}
+
+static uint64_t SimHal_ByteNs(void) {
+    return 8000000000ULL / sim_spi_hz;
+}
+
+static void SimHal_CheckDma(void) {
+    if ((sim_dma_hspi != NULL) && (Sim_Now() >= sim_dma_hspi->dmaDoneAt)) {
+        sim_dma_hspi->dmaBusy = 0;
+        sim_dma_done = sim_dma_hspi;
+        sim_dma_hspi = NULL;
+    }
+}
+
+static void SimHal_Elapse(uint64_t ns) {
+    Sim_Advance(ns);
+    SimHal_CheckDma();
+}
+
+void SimHal_IrqEdge(GPIO_TypeDef *port, uint16_t pin) {
+    (void)port;
+    sim_exti_pending |= pin;
+}
+
+/* Run the handlers of pending interrupts unless PRIMASK is set */
+void SimHal_Dispatch(void) {
+    if (sim_primask) {
+        return;
+    }
+
+    while (sim_exti_pending) {
+        uint16_t pin = sim_exti_pending & (uint16_t)-sim_exti_pending;
+        sim_exti_pending &= ~pin;
+        HAL_GPIO_EXTI_Falling_Callback(pin);
+    }
+
+    if (sim_dma_done != NULL) {
+        SPI_HandleTypeDef *hspi = sim_dma_done;
+        sim_dma_done = NULL;
+        if (hspi->dmaRx) {
+            HAL_SPI_TxRxCpltCallback(hspi);
+        } else {
+            HAL_SPI_TxCpltCallback(hspi);
+        }
+    }
+}
+
+uint32_t HAL_GetTick(void) {
+    SimHal_Elapse(SIM_CALL_NS);
+    SimHal_Dispatch();
+    return (uint32_t)(Sim_Now() / 1000000ULL);
+}
+
+void HAL_Delay(uint32_t Delay) {
+    SimHal_Elapse((uint64_t)Delay * 1000000ULL);
+    SimHal_Dispatch();
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState) {
+    SimHal_Elapse(SIM_CALL_NS);
+    if (PinState == GPIO_PIN_SET) {
+        GPIOx->ODR |= GPIO_Pin;
+    } else {
+        GPIOx->ODR &= ~GPIO_Pin;
+    }
+    SimChip_PinWrite(GPIOx, GPIO_Pin, PinState);
+    SimHal_Dispatch();
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+    return (GPIOx->IDR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+/* Clock bytes through the selected chip, one bus time per byte */
+static void SimHal_Shift(const uint8_t *tx, uint8_t *rx, uint16_t size, bool timed) {
+    for (uint16_t i = 0; i < size; i++) {
+        if (timed) {
+            SimHal_Elapse(SimHal_ByteNs());
+        }
+        uint8_t miso = SimChip_Exchange(tx[i]);
+        if ((sim_spi_limit != 0) && (sim_spi_hz > sim_spi_limit) && ((++sim_spi_bytes % 97) == 0)) {
+            miso ^= 0x10;
+        }
+        if (rx != NULL) {
+            rx[i] = miso;
+        }
+    }
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, const uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+    (void)hspi;
+    (void)Timeout;
+    SimHal_Elapse(SIM_SPI_SETUP_NS);
+    SimHal_Shift(pData, NULL, Size, true);
+    SimHal_Dispatch();
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, const uint8_t *pTxData, uint8_t *pRxData,
+                                          uint16_t Size, uint32_t Timeout) {
+    (void)hspi;
+    (void)Timeout;
+    SimHal_Elapse(SIM_SPI_SETUP_NS);
+    SimHal_Shift(pTxData, pRxData, Size, true);
+    SimHal_Dispatch();
+    return HAL_OK;
+}
+
+/* The bytes are exchanged up front; completion is signalled once their
+ * bus time has passed, so the CPU is free in between */
+static HAL_StatusTypeDef SimHal_StartDma(SPI_HandleTypeDef *hspi, const uint8_t *pTxData, uint8_t *pRxData,
+                                         uint16_t Size) {
+    if ((sim_dma_hspi != NULL) || (hspi->hdmatx == NULL) || (hspi->hdmarx == NULL)) {
+        return HAL_BUSY;
+    }
+
+    SimHal_Elapse(SIM_DMA_SETUP_NS);
+    SimHal_Shift(pTxData, pRxData, Size, false);
+    hspi->dmaBusy = 1;
+    hspi->dmaRx = (pRxData != NULL);
+    hspi->dmaDoneAt = Sim_Now() + Size * SimHal_ByteNs();
+    sim_dma_hspi = hspi;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, const uint8_t *pData, uint16_t Size) {
+    return SimHal_StartDma(hspi, pData, NULL, Size);
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi, const uint8_t *pTxData, uint8_t *pRxData,
+                                              uint16_t Size) {
+    return SimHal_StartDma(hspi, pTxData, pRxData, Size);
+}
+
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *hspi) {
+    hspi->dmaBusy = 0;
+    if (sim_dma_hspi == hspi) {
+        sim_dma_hspi = NULL;
+    }
+    return HAL_OK;
+}
+
+void __disable_irq(void) {
+    sim_primask = true;
+}
+
+void __enable_irq(void) {
+    sim_primask = false;
+    SimHal_Dispatch();
+}
+
+/* Sleep until something could raise an interrupt; a pending one wakes
+ * immediately, even with PRIMASK set */
+void __WFI(void) {
+    uint64_t now = Sim_Now();
+    uint64_t wake = (now / SIM_SYSTICK_NS + 1) * SIM_SYSTICK_NS;
+    uint64_t at;
+
+    if (sim_exti_pending || (sim_dma_done != NULL)) {
+        return;
+    }
+    if (Sim_NextEvent(&at) && (at < wake)) {
+        wake = at;
+    }
+    if ((sim_dma_hspi != NULL) && (sim_dma_hspi->dmaDoneAt < wake)) {
+        wake = sim_dma_hspi->dmaDoneAt;
+    }
+
+    SimHal_Elapse((wake > now) ? (wake - now) : 0);
+    SimHal_Dispatch();
+}
+
+/* Weak defaults, as in the HAL; the program overrides what it uses */
+__attribute__((weak)) void HAL_GPIO_EXTI_Falling_Callback(uint16_t GPIO_Pin) {
+    (void)GPIO_Pin;
+}
+
+__attribute__((weak)) void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi) {
+    (void)hspi;
+}
+
+__attribute__((weak)) void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi) {
+    (void)hspi;
+}
+
+__attribute__((weak)) void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi) {
+    (void)hspi;
+}
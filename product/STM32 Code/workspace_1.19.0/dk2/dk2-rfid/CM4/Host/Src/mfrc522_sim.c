@@ -0,0 +1,965 @@
+/* mfrc522_sim.c - MFRC522 register model on a virtual clock
+ *
+ * Emulates what the driver relies on: SPI address framing, the register
+ * file with its read/write side effects, the 64-byte FIFO, the Transceive,
+ * MFAuthent, CalcCRC and SoftReset commands, bit-oriented framing
+ * (TxLastBits, RxAlign, RxLastBits), collision detection, the timer with
+ * TAuto and TStartNow, the IRQ bits and the IRQ pin, soft power-down and
+ * the NRSTPD pin. Frames go to the cards in picc_sim.c; their timing
+ * follows ISO/IEC 14443-3 at the TxSpeed/RxSpeed set in TxModeReg and
+ * RxModeReg. The FIFO empties while a frame is sent and fills while the
+ * answer comes in, byte by byte, so frames longer than 64 bytes work only
+ * if the driver keeps up. */
+
+#include "mfrc522_sim.h"
+#include "mfrc522.h"
+#include <string.h>
+
+#define SIM_FC_HZ          13560000.0
+/* One elementary time unit at 106 kbit/s, 128/fc */
+#define SIM_ETU_NS         9440
+/* SoftReset, and oscillator start after power-down or NRSTPD */
+#define SIM_RESET_NS       40000
+#define SIM_OSC_START_NS   500000
+/* CRC coprocessor, per FIFO byte */
+#define SIM_CRC_BYTE_NS    600
+
+/* ComIrqReg bits */
+#define SIM_IRQ_TX         0x40
+#define SIM_IRQ_RX         0x20
+#define SIM_IRQ_IDLE       0x10
+#define SIM_IRQ_HI_ALERT   0x08
+#define SIM_IRQ_LO_ALERT   0x04
+#define SIM_IRQ_ERR        0x02
+#define SIM_IRQ_TIMER      0x01
+/* DivIrqReg CRCIRq */
+#define SIM_DIV_IRQ_CRC    0x04
+/* ErrorReg bits */
+#define SIM_ERR_BUFFER_OVFL 0x10
+#define SIM_ERR_COLL       0x08
+#define SIM_ERR_PARITY     0x02
+#define SIM_ERR_PROTOCOL   0x01
+
+#define SIM_MAX_EVENTS     8
+
+typedef enum {
+    SIM_EV_NONE = 0,
+    SIM_EV_TX_DONE,      // End of the reader frame
+    SIM_EV_RX,           // End of the PICC answer
+    SIM_EV_TIMER,        // Timer underflow
+    SIM_EV_AUTH,         // MFAuthent succeeded
+    SIM_EV_CRC,          // CalcCRC result ready
+    SIM_EV_READY,        // Reset or oscillator start finished
+    SIM_EV_ALERT         // FIFO level reaches the water level
+} SimEventKind_t;
+
+typedef struct {
+    uint64_t at;
+    SimEventKind_t kind;
+} SimEvent_t;
+
+typedef struct {
+    bool used;
+    GPIO_TypeDef *csPort;
+    uint16_t csPin;
+    GPIO_TypeDef *rstPort;
+    uint16_t rstPin;
+    GPIO_TypeDef *irqPort;
+    uint16_t irqPin;
+
+    uint8_t reg[0x40];
+    uint8_t fifo[MFRC522_FIFO_SIZE];
+    uint8_t fifoLen;
+    bool loAlert;             // Status1Reg LoAlert/HiAlert as last seen, their rise sets the IRQ bits
+    bool hiAlert;
+    bool crypto;              // Status2Reg MFCrypto1On
+    bool inReset;             // NRSTPD held low
+    bool fieldOn;
+    bool irqActive;
+
+    // SPI frame in progress
+    bool selected;
+    uint8_t spiCount;
+    bool spiRead;
+    uint8_t spiAddr;
+
+    SimEvent_t events[SIM_MAX_EVENTS];
+    bool timerFromTx;         // Underflow means the PICC did not answer
+
+    // Frame on air: bytes leave the FIFO one by one from txStart on
+    bool txActive;
+    uint64_t txStart;
+    uint8_t tx[SIM_RF_MAX_BYTES];
+    uint16_t txLen;
+
+    // Answer on its way to the FIFO
+    uint8_t rx[SIM_RF_MAX_BYTES];
+    uint16_t rxBits;
+    uint8_t rxAlign;
+    bool rxColl;
+    uint16_t rxCollBit;
+    SimFault_t rxFault;
+    bool rxActive;
+    uint64_t rxStart;
+    uint64_t rxByteNs;
+    uint8_t rxShifted[SIM_RF_MAX_BYTES + 1];  // As it lands in the FIFO, RxAlign applied
+    uint16_t rxBytes;
+    uint16_t rxPushed;
+    bool rxOvfl;
+
+    SimChipStats_t stats;
+} SimChip_t;
+
+static SimChip_t sim_chips[SIM_MAX_CHIPS];
+static uint64_t sim_now = 0;
+
+/* Reset values from the MFRC522 datasheet */
+static void SimChip_ResetRegisters(SimChip_t *chip) {
+    memset(chip->reg, 0, sizeof(chip->reg));
+    chip->reg[MFRC522_REG_COMMAND] = 0x20;
+    chip->reg[MFRC522_REG_COMM_IEN] = 0x80;
+    chip->reg[MFRC522_REG_COMM_IRQ] = 0x14;
+    chip->reg[MFRC522_REG_STATUS_1] = 0x21;
+    chip->reg[MFRC522_REG_WATER_LEVEL] = 0x08;
+    chip->reg[MFRC522_REG_CONTROL] = 0x10;
+    chip->reg[MFRC522_REG_COLL] = 0x80;
+    chip->reg[MFRC522_REG_MODE] = 0x3F;
+    chip->reg[MFRC522_REG_TX_CONTROL] = 0x80;
+    chip->reg[MFRC522_REG_TX_SEL] = 0x10;
+    chip->reg[MFRC522_REG_RX_SEL] = 0x84;
+    chip->reg[MFRC522_REG_RX_THRESHOLD] = 0x84;
+    chip->reg[MFRC522_REG_DEMOD] = 0x4D;
+    chip->reg[MFRC522_REG_MF_TX] = 0x62;
+    chip->reg[MFRC522_REG_SERIAL_SPEED] = 0xEB;
+    chip->reg[MFRC522_REG_CRC_RESULT_H] = 0xFF;
+    chip->reg[MFRC522_REG_CRC_RESULT_L] = 0xFF;
+    chip->reg[MFRC522_REG_MOD_WIDTH] = 0x26;
+    chip->reg[MFRC522_REG_RF_CFG] = 0x48;
+    chip->reg[MFRC522_REG_GS_N] = 0x88;
+    chip->reg[MFRC522_REG_CW_GS_P] = 0x20;
+    chip->reg[MFRC522_REG_MOD_GS_P] = 0x20;
+    chip->reg[MFRC522_REG_VERSION] = 0x92;
+
+    chip->fifoLen = 0;
+    chip->loAlert = true;
+    chip->hiAlert = false;
+    chip->crypto = false;
+    memset(chip->events, 0, sizeof(chip->events));
+}
+
+static int SimChip_Index(const SimChip_t *chip) {
+    return (int)(chip - sim_chips);
+}
+
+/* Field on/off, the cards in it power up in IDLE or lose their state */
+static void SimChip_UpdateField(SimChip_t *chip) {
+    bool on = !chip->inReset && !(chip->reg[MFRC522_REG_COMMAND] & 0x10) &&
+              (chip->reg[MFRC522_REG_TX_CONTROL] & 0x03);
+
+    if (on == chip->fieldOn) {
+        return;
+    }
+    chip->fieldOn = on;
+
+    for (uint8_t i = 0; i < SimPicc_Count(); i++) {
+        SimCard_t *card = SimPicc_Get(i);
+        if (card->chip == SimChip_Index(chip)) {
+            SimPicc_Field(card, on);
+        }
+    }
+}
+
+/* Drive the IRQ pin; IRqInv selects active low, the board uses the falling edge */
+static void SimChip_UpdateIrq(SimChip_t *chip) {
+    bool active = ((chip->reg[MFRC522_REG_COMM_IRQ] & chip->reg[MFRC522_REG_COMM_IEN] & 0x7F) != 0) ||
+                  ((chip->reg[MFRC522_REG_DIV_IRQ] & chip->reg[MFRC522_REG_DIV_IEN] & 0x14) != 0);
+    bool inverted = (chip->reg[MFRC522_REG_COMM_IEN] & 0x80) != 0;
+
+    if (chip->irqPort == NULL) {
+        return;
+    }
+
+    bool wasLow = chip->irqActive == inverted;
+    bool low = active == inverted;
+    chip->irqActive = active;
+
+    if (low) {
+        chip->irqPort->IDR &= ~chip->irqPin;
+    } else {
+        chip->irqPort->IDR |= chip->irqPin;
+    }
+    if (low && !wasLow) {
+        chip->stats.irqEdges++;
+        SimHal_IrqEdge(chip->irqPort, chip->irqPin);
+    }
+}
+
+static void SimChip_Schedule(SimChip_t *chip, SimEventKind_t kind, uint64_t at) {
+    for (uint8_t i = 0; i < SIM_MAX_EVENTS; i++) {
+        if (chip->events[i].kind == SIM_EV_NONE) {
+            chip->events[i].kind = kind;
+            chip->events[i].at = at;
+            return;
+        }
+    }
+}
+
+static void SimChip_Cancel(SimChip_t *chip, SimEventKind_t kind) {
+    for (uint8_t i = 0; i < SIM_MAX_EVENTS; i++) {
+        if (chip->events[i].kind == kind) {
+            chip->events[i].kind = SIM_EV_NONE;
+        }
+    }
+}
+
+/* TxSpeed and RxSpeed: 0 = 106, 1 = 212, 2 = 424, 3 = 848 kbit/s */
+static uint8_t SimChip_TxSpeed(const SimChip_t *chip) {
+    return (chip->reg[MFRC522_REG_TX_MODE] >> 4) & 0x03;
+}
+
+static uint8_t SimChip_RxSpeed(const SimChip_t *chip) {
+    return (chip->reg[MFRC522_REG_RX_MODE] >> 4) & 0x03;
+}
+
+/* Air time of a frame: start bit, data bits with one parity bit per byte, end */
+static uint64_t SimChip_FrameNs(uint16_t bits, uint8_t speed) {
+    return (uint64_t)(bits + bits / 8 + 2) * (SIM_ETU_NS >> speed);
+}
+
+/* One timer period: TPrescaler from TModeReg and TPrescalerReg */
+static uint64_t SimChip_TimerNs(const SimChip_t *chip) {
+    uint16_t prescaler = ((chip->reg[MFRC522_REG_T_MODE] & 0x0F) << 8) | chip->reg[MFRC522_REG_T_PRESCALER];
+    uint16_t reload = (chip->reg[MFRC522_REG_T_RELOAD_H] << 8) | chip->reg[MFRC522_REG_T_RELOAD_L];
+
+    return (uint64_t)((2.0 * prescaler + 1.0) * 1e9 / SIM_FC_HZ) * (reload + 1);
+}
+
+static void SimChip_StartTimer(SimChip_t *chip, uint64_t at, bool fromTx) {
+    SimChip_Cancel(chip, SIM_EV_TIMER);
+    SimChip_Schedule(chip, SIM_EV_TIMER, at + SimChip_TimerNs(chip));
+    chip->timerFromTx = fromTx;
+}
+
+/* Bits of a frame of len bytes, TxLastBits applies to the last one */
+static uint16_t SimChip_TxBits(const SimChip_t *chip, uint16_t len) {
+    uint8_t txLastBits = chip->reg[MFRC522_REG_BIT_FRAMING] & 0x07;
+
+    return txLastBits ? (len - 1) * 8 + txLastBits : len * 8;
+}
+
+/* Move the bytes that went on air since the last call out of the FIFO; a
+ * byte leaves the FIFO when its transmission starts */
+static void SimChip_TxDrain(SimChip_t *chip) {
+    if (!chip->txActive) {
+        return;
+    }
+
+    uint64_t due = (sim_now - chip->txStart) / (9 * (SIM_ETU_NS >> SimChip_TxSpeed(chip))) + 1;
+    while ((chip->txLen < due) && (chip->fifoLen > 0)) {
+        if (chip->txLen < SIM_RF_MAX_BYTES) {
+            chip->tx[chip->txLen] = chip->fifo[0];
+        }
+        chip->txLen++;
+        memmove(chip->fifo, &chip->fifo[1], --chip->fifoLen);
+    }
+}
+
+/* The frame ends when the FIFO runs empty: after the bytes already sent
+ * and the ones still waiting in it */
+static void SimChip_TxSchedule(SimChip_t *chip) {
+    uint16_t len = chip->txLen + chip->fifoLen;
+
+    SimChip_Cancel(chip, SIM_EV_TX_DONE);
+    SimChip_Schedule(chip, SIM_EV_TX_DONE,
+                     chip->txStart + SimChip_FrameNs(SimChip_TxBits(chip, len), SimChip_TxSpeed(chip)));
+}
+
+/* Push the answer bytes received by now into the FIFO, or all of them at
+ * the end of the frame. The last byte waits for the end, RxLastBits
+ * belongs to it. A full FIFO loses bytes and sets BufferOvfl. */
+static void SimChip_RxFill(SimChip_t *chip, bool all) {
+    uint64_t due;
+
+    if (!chip->rxActive) {
+        return;
+    }
+
+    if (all) {
+        due = chip->rxBytes;
+    } else {
+        due = (sim_now > chip->rxStart) ? (sim_now - chip->rxStart) / chip->rxByteNs : 0;
+        if (due + 1 > chip->rxBytes) {
+            due = (chip->rxBytes > 0) ? chip->rxBytes - 1 : 0;
+        }
+    }
+
+    while (chip->rxPushed < due) {
+        if (chip->fifoLen < MFRC522_FIFO_SIZE) {
+            chip->fifo[chip->fifoLen++] = chip->rxShifted[chip->rxPushed];
+        } else {
+            chip->rxOvfl = true;
+        }
+        chip->rxPushed++;
+    }
+}
+
+/* LoAlertIRq and HiAlertIRq store the rise of the Status1Reg bits */
+static void SimChip_FifoAlerts(SimChip_t *chip) {
+    uint8_t water = chip->reg[MFRC522_REG_WATER_LEVEL];
+    bool lo = chip->fifoLen <= water;
+    bool hi = MFRC522_FIFO_SIZE - chip->fifoLen <= water;
+
+    if (lo && !chip->loAlert) {
+        chip->reg[MFRC522_REG_COMM_IRQ] |= SIM_IRQ_LO_ALERT;
+    }
+    if (hi && !chip->hiAlert) {
+        chip->reg[MFRC522_REG_COMM_IRQ] |= SIM_IRQ_HI_ALERT;
+    }
+    chip->loAlert = lo;
+    chip->hiAlert = hi;
+}
+
+/* Wake the chip when the frame on air drains the FIFO to the water level,
+ * or the answer fills it to 64 minus the water level. Without this the
+ * level only moves when the driver looks. */
+static void SimChip_ScheduleAlert(SimChip_t *chip) {
+    uint8_t water = chip->reg[MFRC522_REG_WATER_LEVEL];
+
+    SimChip_Cancel(chip, SIM_EV_ALERT);
+
+    if (chip->txActive && (chip->fifoLen > water)) {
+        // Byte i leaves the FIFO at txStart + i byte times
+        uint64_t byteNs = 9 * (SIM_ETU_NS >> SimChip_TxSpeed(chip));
+        SimChip_Schedule(chip, SIM_EV_ALERT, chip->txStart + (chip->txLen + chip->fifoLen - water - 1) * byteNs);
+    } else if (chip->rxActive && (MFRC522_FIFO_SIZE - chip->fifoLen > water)) {
+        // Byte i lands at rxStart + (i + 1) byte times, the last one at the end of the frame
+        uint16_t last = chip->rxPushed + (MFRC522_FIFO_SIZE - water - chip->fifoLen) - 1;
+        if (last + 1 < chip->rxBytes) {
+            SimChip_Schedule(chip, SIM_EV_ALERT, chip->rxStart + (uint64_t)(last + 1) * chip->rxByteNs);
+        }
+    }
+}
+
+/* Abort the frame on air and the answer on its way */
+static void SimChip_StopRf(SimChip_t *chip) {
+    SimChip_Cancel(chip, SIM_EV_TX_DONE);
+    SimChip_Cancel(chip, SIM_EV_RX);
+    chip->txActive = false;
+    chip->rxActive = false;
+}
+
+/* Transceive with StartSend: the FIFO goes on air from now on */
+static void SimChip_Transmit(SimChip_t *chip) {
+    if (chip->fifoLen == 0) {
+        return;
+    }
+
+    chip->reg[MFRC522_REG_ERROR] = 0;
+    chip->stats.frames++;
+
+    SimChip_StopRf(chip);
+    SimChip_Cancel(chip, SIM_EV_TIMER);
+
+    chip->txActive = true;
+    chip->txStart = sim_now;
+    chip->txLen = 0;
+    SimChip_TxDrain(chip);
+    SimChip_TxSchedule(chip);
+}
+
+/* End of the reader frame: hand it to every card in the field and work
+ * out what comes back and when */
+static void SimChip_Deliver(SimChip_t *chip) {
+    uint8_t framing = chip->reg[MFRC522_REG_BIT_FRAMING];
+    uint16_t txLen = (chip->txLen > SIM_RF_MAX_BYTES) ? SIM_RF_MAX_BYTES : chip->txLen;
+    uint16_t txBits = SimChip_TxBits(chip, txLen);
+    uint8_t rxSpeed = SimChip_RxSpeed(chip);
+    SimRfAnswer_t answers[SIM_MAX_CARDS];
+    uint8_t count = 0;
+    uint32_t delayNs = 0;
+    uint64_t txEnd = sim_now;
+
+    if (chip->fieldOn) {
+        for (uint8_t i = 0; i < SimPicc_Count(); i++) {
+            SimCard_t *card = SimPicc_Get(i);
+            if ((card->chip == SimChip_Index(chip)) &&
+                SimPicc_Receive(card, chip->tx, txBits, chip->crypto, SimChip_TxSpeed(chip), &answers[count])) {
+                if (answers[count].fault == SIM_FAULT_DROP) {
+                    chip->stats.faults++;
+                    continue;
+                }
+                // The demodulator only hears the bit rate it is set to
+                if (answers[count].speed != rxSpeed) {
+                    continue;
+                }
+                if (answers[count].delayNs > delayNs) {
+                    delayNs = answers[count].delayNs;
+                }
+                count++;
+            }
+        }
+    }
+
+    // Overlay the answers; the first bit where they disagree is a collision
+    memset(chip->rx, 0, sizeof(chip->rx));
+    chip->rxBits = 0;
+    chip->rxColl = false;
+    chip->rxFault = SIM_FAULT_NONE;
+    chip->rxAlign = (framing >> 4) & 0x07;
+
+    for (uint8_t a = 0; a < count; a++) {
+        if (answers[a].fault != SIM_FAULT_NONE) {
+            chip->rxFault = answers[a].fault;
+            chip->stats.faults++;
+        }
+        if (answers[a].bits > chip->rxBits) {
+            chip->rxBits = answers[a].bits;
+        }
+    }
+    for (uint16_t b = 0; b < chip->rxBits; b++) {
+        int8_t value = -1;
+        for (uint8_t a = 0; a < count; a++) {
+            if (b >= answers[a].bits) {
+                continue;
+            }
+            int8_t bit = (answers[a].data[b / 8] >> (b % 8)) & 1;
+            if (value < 0) {
+                value = bit;
+            } else if (bit != value) {
+                if (!chip->rxColl) {
+                    chip->rxColl = true;
+                    chip->rxCollBit = b;
+                }
+                value = 1;
+            }
+        }
+        // ValuesAfterColl = 0 clears everything from the collision on
+        bool keep = !chip->rxColl || (chip->reg[MFRC522_REG_COLL] & 0x80);
+        if (keep && (value > 0)) {
+            chip->rx[b / 8] |= 1 << (b % 8);
+        }
+    }
+    if ((chip->rxFault == SIM_FAULT_CRC) && (chip->rxBits >= 8)) {
+        chip->rx[(chip->rxBits / 8) - 1] ^= 0x01;
+    }
+
+    // Received bits continue at bit RxAlign of the first FIFO byte
+    memset(chip->rxShifted, 0, sizeof(chip->rxShifted));
+    for (uint16_t b = 0; b < chip->rxBits; b++) {
+        uint16_t p = chip->rxAlign + b;
+        chip->rxShifted[p / 8] |= ((chip->rx[b / 8] >> (b % 8)) & 1) << (p % 8);
+    }
+    chip->rxBytes = (chip->rxAlign + chip->rxBits + 7) / 8;
+    chip->rxPushed = 0;
+    chip->rxOvfl = false;
+    chip->rxByteNs = 9 * (SIM_ETU_NS >> rxSpeed);
+
+    uint64_t timerEnd = txEnd + SimChip_TimerNs(chip);
+    bool timerRuns = (chip->reg[MFRC522_REG_T_MODE] & 0x80) != 0;
+
+    if (count > 0) {
+        uint64_t rxStart = txEnd + delayNs;
+        chip->rxActive = true;
+        // The first byte is complete after the start bit and 9 bits
+        chip->rxStart = rxStart + (SIM_ETU_NS >> rxSpeed);
+        SimChip_Schedule(chip, SIM_EV_RX, rxStart + SimChip_FrameNs(chip->rxBits, rxSpeed));
+        // TAuto: the first received bit stops the timer
+        if (timerRuns && (timerEnd < rxStart)) {
+            SimChip_StartTimer(chip, txEnd, true);
+        }
+    } else if (timerRuns) {
+        SimChip_StartTimer(chip, txEnd, true);
+    }
+}
+
+/* MFAuthent: command, block, key, 4 UID bytes from the FIFO */
+static void SimChip_Authenticate(SimChip_t *chip) {
+    uint8_t data[12];
+    SimCard_t *target = NULL;
+    bool ok = false;
+
+    chip->reg[MFRC522_REG_ERROR] = 0;
+    if (chip->fifoLen < 12) {
+        chip->reg[MFRC522_REG_ERROR] = SIM_ERR_PROTOCOL;
+        chip->reg[MFRC522_REG_COMM_IRQ] |= SIM_IRQ_ERR | SIM_IRQ_IDLE;
+        chip->reg[MFRC522_REG_COMMAND] &= 0xF0;
+        return;
+    }
+    memcpy(data, chip->fifo, 12);
+    chip->fifoLen = 0;
+
+    for (uint8_t i = 0; (i < SimPicc_Count()) && chip->fieldOn; i++) {
+        SimCard_t *card = SimPicc_Get(i);
+        if ((card->chip == SimChip_Index(chip)) && (card->state == SIM_PICC_ACTIVE) &&
+            (memcmp(&card->uid[card->uidSize - 4], &data[8], 4) == 0)) {
+            target = card;
+            break;
+        }
+    }
+    if (target != NULL) {
+        ok = SimPicc_Authenticate(target, data[0], data[1], &data[2]);
+    }
+
+    // Auth request + CRC, nonce, reader token, card token
+    uint64_t fdt = 86430;
+    uint64_t toNonce = SimChip_FrameNs(32, 0);
+    uint64_t toToken = toNonce + fdt + SimChip_FrameNs(32, 0) + fdt + SimChip_FrameNs(64, 0);
+    chip->stats.frames += 2;
+
+    if (ok) {
+        chip->stats.answers += 2;
+        SimChip_Schedule(chip, SIM_EV_AUTH, sim_now + toToken + fdt + SimChip_FrameNs(32, 0));
+    } else if (chip->reg[MFRC522_REG_T_MODE] & 0x80) {
+        // No nonce without a card, no card token after a wrong key
+        SimChip_StartTimer(chip, sim_now + ((target != NULL) ? toToken : toNonce), true);
+    }
+}
+
+static void SimChip_Command(SimChip_t *chip, uint8_t value) {
+    uint8_t old = chip->reg[MFRC522_REG_COMMAND];
+    uint8_t cmd = value & 0x0F;
+
+    if (cmd == MFRC522_CMD_NO_CMD_CHANGE) {
+        cmd = old & 0x0F;
+    }
+
+    if ((old & 0x10) && !(value & 0x10)) {
+        // Leaving soft power-down: PowerDown reads 1 until the oscillator runs
+        chip->reg[MFRC522_REG_COMMAND] = (value & 0x20) | 0x10 | cmd;
+        SimChip_Schedule(chip, SIM_EV_READY, sim_now + SIM_OSC_START_NS);
+        return;
+    }
+
+    chip->reg[MFRC522_REG_COMMAND] = (value & 0x30) | cmd;
+    if (value & 0x10) {
+        SimChip_StopRf(chip);
+        SimChip_Cancel(chip, SIM_EV_AUTH);
+        SimChip_UpdateField(chip);
+        return;
+    }
+    if ((value & 0x0F) == MFRC522_CMD_NO_CMD_CHANGE) {
+        return;
+    }
+
+    // A new command cancels the running one
+    SimChip_StopRf(chip);
+    SimChip_Cancel(chip, SIM_EV_AUTH);
+    SimChip_Cancel(chip, SIM_EV_CRC);
+
+    switch (cmd) {
+        case MFRC522_CMD_SOFT_RESET:
+            SimChip_ResetRegisters(chip);
+            chip->reg[MFRC522_REG_COMMAND] = 0x20 | MFRC522_CMD_SOFT_RESET;
+            SimChip_Schedule(chip, SIM_EV_READY, sim_now + SIM_RESET_NS);
+            SimChip_UpdateField(chip);
+            break;
+
+        case MFRC522_CMD_CALC_CRC:
+            SimChip_Schedule(chip, SIM_EV_CRC, sim_now + 1000 + chip->fifoLen * SIM_CRC_BYTE_NS);
+            break;
+
+        case MFRC522_CMD_TRANSCEIVE:
+            if (chip->reg[MFRC522_REG_BIT_FRAMING] & 0x80) {
+                SimChip_Transmit(chip);
+            }
+            break;
+
+        case MFRC522_CMD_MF_AUTHENT:
+            SimChip_Authenticate(chip);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void SimChip_Event(SimChip_t *chip, SimEventKind_t kind) {
+    switch (kind) {
+        case SIM_EV_TX_DONE:
+            SimChip_TxDrain(chip);
+            chip->txActive = false;
+            chip->reg[MFRC522_REG_COMM_IRQ] |= SIM_IRQ_TX;
+            if (chip->fifoLen <= chip->reg[MFRC522_REG_WATER_LEVEL]) {
+                chip->reg[MFRC522_REG_COMM_IRQ] |= SIM_IRQ_LO_ALERT;
+            }
+            SimChip_Deliver(chip);
+            break;
+
+        case SIM_EV_RX: {
+            uint16_t total = chip->rxAlign + chip->rxBits;
+            uint8_t error = 0;
+
+            SimChip_RxFill(chip, true);
+            chip->rxActive = false;
+            if (chip->rxOvfl) {
+                error |= SIM_ERR_BUFFER_OVFL;
+            }
+
+            chip->reg[MFRC522_REG_CONTROL] = (chip->reg[MFRC522_REG_CONTROL] & 0xF8) | (total % 8);
+
+            // CollPos counts FIFO bit positions from 1, RxAlign included;
+            // 0 stands for 32, anything further is CollPosNotValid
+            uint8_t coll = (chip->reg[MFRC522_REG_COLL] & 0x80) | 0x20;
+            if (chip->rxColl) {
+                uint16_t pos = chip->rxAlign + chip->rxCollBit + 1;
+                error |= SIM_ERR_COLL;
+                if (pos <= 32) {
+                    coll = (chip->reg[MFRC522_REG_COLL] & 0x80) | (pos & 0x1F);
+                }
+                chip->stats.collisions++;
+            }
+            chip->reg[MFRC522_REG_COLL] = coll;
+
+            if (chip->rxFault == SIM_FAULT_PARITY) {
+                error |= SIM_ERR_PARITY;
+            }
+            chip->reg[MFRC522_REG_ERROR] |= error;
+
+            chip->reg[MFRC522_REG_COMM_IRQ] |= SIM_IRQ_RX;
+            if (error) {
+                chip->reg[MFRC522_REG_COMM_IRQ] |= SIM_IRQ_ERR;
+            }
+            chip->stats.answers++;
+            break;
+        }
+
+        case SIM_EV_TIMER:
+            chip->reg[MFRC522_REG_COMM_IRQ] |= SIM_IRQ_TIMER;
+            if (chip->timerFromTx) {
+                chip->stats.timeouts++;
+            }
+            break;
+
+        case SIM_EV_AUTH:
+            chip->crypto = true;
+            chip->reg[MFRC522_REG_COMMAND] &= 0xF0;
+            chip->reg[MFRC522_REG_COMM_IRQ] |= SIM_IRQ_IDLE;
+            break;
+
+        case SIM_EV_CRC: {
+            static const uint16_t presets[4] = {0x0000, 0x6363, 0xA671, 0xFFFF};
+            uint16_t crc = presets[chip->reg[MFRC522_REG_MODE] & 0x03];
+
+            for (uint8_t i = 0; i < chip->fifoLen; i++) {
+                crc ^= chip->fifo[i];
+                for (uint8_t b = 0; b < 8; b++) {
+                    crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : (crc >> 1);
+                }
+            }
+            chip->fifoLen = 0;
+            chip->reg[MFRC522_REG_CRC_RESULT_H] = crc >> 8;
+            chip->reg[MFRC522_REG_CRC_RESULT_L] = crc & 0xFF;
+            chip->reg[MFRC522_REG_DIV_IRQ] |= SIM_DIV_IRQ_CRC;
+            break;
+        }
+
+        case SIM_EV_READY:
+            chip->reg[MFRC522_REG_COMMAND] &= 0x20;
+            SimChip_UpdateField(chip);
+            break;
+
+        case SIM_EV_ALERT:
+            SimChip_TxDrain(chip);
+            SimChip_RxFill(chip, false);
+            break;
+
+        default:
+            break;
+    }
+
+    SimChip_FifoAlerts(chip);
+    SimChip_ScheduleAlert(chip);
+    SimChip_UpdateIrq(chip);
+}
+
+static uint8_t SimChip_ReadValue(SimChip_t *chip, uint8_t addr) {
+    SimChip_TxDrain(chip);
+    SimChip_RxFill(chip, false);
+
+    switch (addr) {
+        case MFRC522_REG_FIFO_DATA: {
+            uint8_t value = 0;
+            if (chip->fifoLen > 0) {
+                value = chip->fifo[0];
+                memmove(chip->fifo, &chip->fifo[1], --chip->fifoLen);
+            }
+            return value;
+        }
+
+        case MFRC522_REG_FIFO_LEVEL:
+            return chip->fifoLen;
+
+        case MFRC522_REG_STATUS_1: {
+            uint8_t value = chip->reg[MFRC522_REG_STATUS_1] & 0x60;
+            bool running = false;
+            for (uint8_t i = 0; i < SIM_MAX_EVENTS; i++) {
+                running |= (chip->events[i].kind == SIM_EV_TIMER);
+            }
+            if (chip->irqActive) {
+                value |= 0x10;
+            }
+            if (running) {
+                value |= 0x08;
+            }
+            if (chip->fifoLen <= chip->reg[MFRC522_REG_WATER_LEVEL]) {
+                value |= 0x01;
+            }
+            if (MFRC522_FIFO_SIZE - chip->fifoLen <= chip->reg[MFRC522_REG_WATER_LEVEL]) {
+                value |= 0x02;
+            }
+            return value;
+        }
+
+        case MFRC522_REG_STATUS_2:
+            return (chip->reg[MFRC522_REG_STATUS_2] & 0xC0) | (chip->crypto ? 0x08 : 0x00) | 0x01;
+
+        case MFRC522_REG_CONTROL:
+            return 0x10 | (chip->reg[MFRC522_REG_CONTROL] & 0x07);
+
+        default:
+            return chip->reg[addr];
+    }
+}
+
+static uint8_t SimChip_Read(SimChip_t *chip, uint8_t addr) {
+    uint8_t value = SimChip_ReadValue(chip, addr);
+
+    SimChip_FifoAlerts(chip);
+    SimChip_ScheduleAlert(chip);
+    SimChip_UpdateIrq(chip);
+    return value;
+}
+
+static void SimChip_Write(SimChip_t *chip, uint8_t addr, uint8_t value) {
+    SimChip_TxDrain(chip);
+    SimChip_RxFill(chip, false);
+
+    switch (addr) {
+        case MFRC522_REG_COMMAND:
+            SimChip_Command(chip, value);
+            break;
+
+        case MFRC522_REG_COMM_IRQ:
+        case MFRC522_REG_DIV_IRQ:
+            // Set1/Set2: marked bits are set when 1, cleared when 0
+            if (value & 0x80) {
+                chip->reg[addr] |= value & 0x7F;
+            } else {
+                chip->reg[addr] &= ~value;
+            }
+            break;
+
+        case MFRC522_REG_FIFO_DATA:
+            if (chip->fifoLen < MFRC522_FIFO_SIZE) {
+                chip->fifo[chip->fifoLen++] = value;
+            } else {
+                chip->reg[MFRC522_REG_ERROR] |= SIM_ERR_BUFFER_OVFL;
+            }
+            // Topped up in time, the frame goes on
+            if (chip->txActive) {
+                SimChip_TxSchedule(chip);
+            }
+            break;
+
+        case MFRC522_REG_FIFO_LEVEL:
+            if (value & 0x80) {
+                chip->fifoLen = 0;
+                chip->reg[MFRC522_REG_ERROR] &= ~SIM_ERR_BUFFER_OVFL;
+            }
+            break;
+
+        case MFRC522_REG_CONTROL:
+            if (value & 0x80) {
+                SimChip_Cancel(chip, SIM_EV_TIMER);
+            } else if (value & 0x40) {
+                SimChip_StartTimer(chip, sim_now, false);
+            }
+            break;
+
+        case MFRC522_REG_BIT_FRAMING:
+            chip->reg[addr] = value;
+            if ((value & 0x80) && ((chip->reg[MFRC522_REG_COMMAND] & 0x0F) == MFRC522_CMD_TRANSCEIVE)) {
+                SimChip_Transmit(chip);
+            }
+            break;
+
+        case MFRC522_REG_COLL:
+            chip->reg[addr] = (chip->reg[addr] & 0x7F) | (value & 0x80);
+            break;
+
+        case MFRC522_REG_STATUS_2:
+            // MFCrypto1On can only be cleared by software
+            chip->reg[addr] = value & 0xC0;
+            if (!(value & 0x08)) {
+                chip->crypto = false;
+            }
+            break;
+
+        case MFRC522_REG_TX_CONTROL:
+            chip->reg[addr] = value;
+            SimChip_UpdateField(chip);
+            break;
+
+        case MFRC522_REG_ERROR:
+        case MFRC522_REG_STATUS_1:
+        case MFRC522_REG_VERSION:
+            break;
+
+        default:
+            chip->reg[addr] = value;
+            break;
+    }
+
+    SimChip_FifoAlerts(chip);
+    SimChip_ScheduleAlert(chip);
+    SimChip_UpdateIrq(chip);
+}
+
+void Sim_Reset(void) {
+    memset(sim_chips, 0, sizeof(sim_chips));
+    SimPicc_Clear();
+    sim_now = 0;
+    sim_dwt.CYCCNT = 0;
+    memset(sim_gpio, 0, sizeof(sim_gpio));
+}
+
+/* Register a reader and its pins; NRSTPD starts low, so the chip is held
+ * in hard power-down until the driver releases it */
+int Sim_AddChip(GPIO_TypeDef *csPort, uint16_t csPin, GPIO_TypeDef *rstPort, uint16_t rstPin,
+                GPIO_TypeDef *irqPort, uint16_t irqPin) {
+    for (int i = 0; i < SIM_MAX_CHIPS; i++) {
+        SimChip_t *chip = &sim_chips[i];
+        if (chip->used) {
+            continue;
+        }
+        chip->used = true;
+        chip->csPort = csPort;
+        chip->csPin = csPin;
+        chip->rstPort = rstPort;
+        chip->rstPin = rstPin;
+        chip->irqPort = irqPort;
+        chip->irqPin = irqPin;
+        chip->inReset = true;
+        SimChip_ResetRegisters(chip);
+        SimChip_UpdateIrq(chip);
+        return i;
+    }
+    return -1;
+}
+
+bool SimChip_FieldOn(int chip) {
+    return (chip >= 0) && (chip < SIM_MAX_CHIPS) && sim_chips[chip].fieldOn;
+}
+
+const SimChipStats_t* Sim_GetChipStats(int chip) {
+    return &sim_chips[chip].stats;
+}
+
+void Sim_ResetChipStats(int chip) {
+    memset(&sim_chips[chip].stats, 0, sizeof(SimChipStats_t));
+}
+
+uint64_t Sim_Now(void) {
+    return sim_now;
+}
+
+/* Earliest pending chip event */
+bool Sim_NextEvent(uint64_t *at) {
+    bool found = false;
+
+    for (int c = 0; c < SIM_MAX_CHIPS; c++) {
+        for (uint8_t i = 0; i < SIM_MAX_EVENTS; i++) {
+            const SimEvent_t *ev = &sim_chips[c].events[i];
+            if ((ev->kind != SIM_EV_NONE) && (!found || (ev->at < *at))) {
+                *at = ev->at;
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+/* Move the clock forward, running chip events in time order */
+void Sim_Advance(uint64_t ns) {
+    uint64_t target = sim_now + ns;
+    uint64_t at;
+
+    while (Sim_NextEvent(&at) && (at <= target)) {
+        for (int c = 0; c < SIM_MAX_CHIPS; c++) {
+            for (uint8_t i = 0; i < SIM_MAX_EVENTS; i++) {
+                SimEvent_t *ev = &sim_chips[c].events[i];
+                if ((ev->kind != SIM_EV_NONE) && (ev->at == at)) {
+                    SimEventKind_t kind = ev->kind;
+                    ev->kind = SIM_EV_NONE;
+                    sim_now = at;
+                    SimChip_Event(&sim_chips[c], kind);
+                }
+            }
+        }
+    }
+
+    sim_now = target;
+    // 209 MHz Cortex-M4
+    sim_dwt.CYCCNT = (uint32_t)(sim_now * 209 / 1000);
+}
+
+/* CS starts and ends an SPI frame, NRSTPD low holds the chip in hard power-down */
+void SimChip_PinWrite(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state) {
+    for (int i = 0; i < SIM_MAX_CHIPS; i++) {
+        SimChip_t *chip = &sim_chips[i];
+        if (!chip->used) {
+            continue;
+        }
+        if ((port == chip->csPort) && (pin == chip->csPin)) {
+            chip->selected = (state == GPIO_PIN_RESET);
+            chip->spiCount = 0;
+        }
+        if ((port == chip->rstPort) && (pin == chip->rstPin)) {
+            bool reset = (state == GPIO_PIN_RESET);
+            if (reset && !chip->inReset) {
+                chip->inReset = true;
+                SimChip_ResetRegisters(chip);
+            } else if (!reset && chip->inReset) {
+                chip->inReset = false;
+                chip->reg[MFRC522_REG_COMMAND] = 0x20 | 0x10;
+                SimChip_Schedule(chip, SIM_EV_READY, sim_now + SIM_OSC_START_NS);
+            }
+            SimChip_UpdateField(chip);
+            SimChip_UpdateIrq(chip);
+        }
+    }
+}
+
+/* One SPI byte. The first byte of a frame is the address (bit 7 = read);
+ * a read returns the register addressed by the previous byte, a write
+ * frame keeps writing the same register (FIFO bursts). */
+uint8_t SimChip_Exchange(uint8_t mosi) {
+    for (int i = 0; i < SIM_MAX_CHIPS; i++) {
+        SimChip_t *chip = &sim_chips[i];
+        if (!chip->used || !chip->selected) {
+            continue;
+        }
+        if (chip->inReset) {
+            return 0xFF;
+        }
+
+        uint8_t miso = 0x00;
+        if (chip->spiCount == 0) {
+            chip->spiRead = (mosi & 0x80) != 0;
+        } else if (chip->spiRead) {
+            miso = SimChip_Read(chip, chip->spiAddr);
+        } else {
+            SimChip_Write(chip, chip->spiAddr, mosi);
+        }
+        if ((chip->spiCount == 0) || chip->spiRead) {
+            chip->spiAddr = (mosi >> 1) & 0x3F;
+        }
+        if (chip->spiCount < 0xFF) {
+            chip->spiCount++;
+        }
+        return miso;
+    }
+
+    return 0xFF;
+}
@@ -0,0 +1,743 @@
+/* picc_sim.c - Emulated ISO/IEC 14443-3 type A cards for the MFRC522 model,
+ * and one ISO/IEC 14443-4 card speaking ISO-DEP on top */
+
+#include "mfrc522_sim.h"
+#include "mfrc522.h"
+#include <string.h>
+
+static SimCard_t sim_cards[SIM_MAX_CARDS];
+static uint8_t sim_card_count = 0;
+
+/* Random RF errors on top of the programmed ones */
+static uint16_t sim_error_rate = 0;  // Per mille of all answers
+static uint32_t sim_error_seed = 1;
+
+/* Frame delay time PCD -> PICC, 1172/fc */
+#define SIM_FDT_NS        86430
+/* EEPROM programming before the ACK of a WRITE data phase */
+#define SIM_EEPROM_NS     4000000
+
+#define SIM_ACK           0x0A
+#define SIM_NAK_CLASSIC   0x04  // Invalid operation or not authenticated
+#define SIM_NAK_UL        0x00  // Invalid argument
+
+#define SIM_CMD_UL_WRITE       0xA2
+#define SIM_CMD_UL_GET_VERSION 0x60
+#define SIM_CMD_UL_FAST_READ   0x3A
+
+/* Answer to S(WTX): past the card's FWT, within twice of it */
+#define SIM_WTX_NS        95000000
+/* ISO-DEP blocks, without CID and NAD */
+#define SIM_ISO_I_BLOCK   0x02
+#define SIM_ISO_CHAINING  0x10
+#define SIM_ISO_R_ACK     0xA2
+#define SIM_ISO_S_DESELECT 0xC2
+#define SIM_ISO_S_WTX     0xF2
+
+/* ISO/IEC 14443-3 CRC_A, bitwise so it does not share code with the driver */
+uint16_t SimPicc_CrcA(const uint8_t *data, uint16_t len) {
+    uint16_t crc = 0x6363;
+
+    for (uint16_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (uint8_t b = 0; b < 8; b++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : (crc >> 1);
+        }
+    }
+
+    return crc;
+}
+
+static bool SimPicc_CrcOk(const uint8_t *data, uint16_t len) {
+    if (len < 3) {
+        return false;
+    }
+    uint16_t crc = SimPicc_CrcA(data, len - 2);
+    return (data[len - 2] == (crc & 0xFF)) && (data[len - 1] == (crc >> 8));
+}
+
+static bool SimPicc_IsClassic(const SimCard_t *card) {
+    return (card->type == SIM_CARD_CLASSIC_1K) || (card->type == SIM_CARD_CLASSIC_4K);
+}
+
+/* Sector of a MIFARE Classic block; 4K has 16-block sectors from block 128 */
+static int16_t SimPicc_Sector(uint16_t block) {
+    return (block < 128) ? (block / 4) : (32 + (block - 128) / 16);
+}
+
+static uint16_t SimPicc_Trailer(int16_t sector) {
+    return (sector < 32) ? (sector * 4 + 3) : (128 + (sector - 32) * 16 + 15);
+}
+
+static uint8_t SimPicc_Levels(const SimCard_t *card) {
+    return (card->uidSize == 4) ? 1 : ((card->uidSize == 7) ? 2 : 3);
+}
+
+/* UID CLn and BCC of a cascade level, the cascade tag leads all but the last */
+static void SimPicc_Cln(const SimCard_t *card, uint8_t level, uint8_t *cln) {
+    if (level < SimPicc_Levels(card) - 1) {
+        cln[0] = PICC_CMD_CT;
+        memcpy(&cln[1], &card->uid[level * 3], 3);
+    } else {
+        memcpy(cln, &card->uid[level * 3], 4);
+    }
+    cln[4] = cln[0] ^ cln[1] ^ cln[2] ^ cln[3];
+}
+
+static void SimPicc_Format(SimCard_t *card) {
+    memset(card->mem, 0, sizeof(card->mem));
+
+    if (card->type == SIM_CARD_DESFIRE) {
+        // A plain 4 KB binary file, nothing at fixed places
+        return;
+    }
+    if (SimPicc_IsClassic(card)) {
+        // Manufacturer block: UID (and BCC for 4-byte UIDs), SAK, ATQA
+        uint8_t *b0 = card->mem;
+        memcpy(b0, card->uid, card->uidSize);
+        if (card->uidSize == 4) {
+            b0[4] = b0[0] ^ b0[1] ^ b0[2] ^ b0[3];
+            b0[5] = card->sak;
+            b0[6] = card->atqa[0];
+            b0[7] = card->atqa[1];
+        } else {
+            b0[7] = card->sak;
+            b0[8] = card->atqa[0];
+            b0[9] = card->atqa[1];
+        }
+
+        // Transport configuration: both keys FFFFFFFFFFFF
+        static const uint8_t trailer[16] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x07,
+                                            0x80, 0x69, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+        uint16_t blocks = card->memSize / 16;
+        for (int16_t s = 0; s <= SimPicc_Sector(blocks - 1); s++) {
+            memcpy(&card->mem[SimPicc_Trailer(s) * 16], trailer, 16);
+        }
+    } else {
+        // Pages 0-2: UID with BCC0/BCC1, internal byte, lock bytes
+        uint8_t *p = card->mem;
+        p[0] = card->uid[0];
+        p[1] = card->uid[1];
+        p[2] = card->uid[2];
+        p[3] = PICC_CMD_CT ^ p[0] ^ p[1] ^ p[2];
+        memcpy(&p[4], &card->uid[3], 4);
+        p[8] = p[4] ^ p[5] ^ p[6] ^ p[7];
+        p[9] = 0x48;
+    }
+}
+
+void SimPicc_Clear(void) {
+    memset(sim_cards, 0, sizeof(sim_cards));
+    sim_card_count = 0;
+    sim_error_rate = 0;
+    sim_error_seed = 1;
+}
+
+uint8_t SimPicc_Count(void) {
+    return sim_card_count;
+}
+
+SimCard_t* SimPicc_Get(uint8_t index) {
+    return (index < sim_card_count) ? &sim_cards[index] : NULL;
+}
+
+/* Create a card outside every field. Ultralights and DESFire always have
+ * 7-byte UIDs. */
+SimCard_t* Sim_AddCard(SimCardType_t type, const uint8_t *uid, uint8_t uidSize) {
+    SimCard_t *card;
+
+    if ((sim_card_count >= SIM_MAX_CARDS) || ((uidSize != 4) && (uidSize != 7) && (uidSize != 10))) {
+        return NULL;
+    }
+    if (((type == SIM_CARD_ULTRALIGHT) || (type == SIM_CARD_ULTRALIGHT_EV1) || (type == SIM_CARD_DESFIRE)) &&
+        (uidSize != 7)) {
+        return NULL;
+    }
+
+    card = &sim_cards[sim_card_count++];
+    memset(card, 0, sizeof(SimCard_t));
+    card->type = type;
+    memcpy(card->uid, uid, uidSize);
+    card->uidSize = uidSize;
+
+    // ATQA bits 7:6 carry the UID size
+    uint8_t sizeBits = (uidSize == 4) ? 0x00 : ((uidSize == 7) ? 0x40 : 0x80);
+    switch (type) {
+        case SIM_CARD_CLASSIC_1K:
+            card->atqa[0] = 0x04 | sizeBits;
+            card->sak = 0x08;
+            card->memSize = 1024;
+            break;
+        case SIM_CARD_CLASSIC_4K:
+            card->atqa[0] = 0x02 | sizeBits;
+            card->sak = 0x18;
+            card->memSize = 4096;
+            break;
+        case SIM_CARD_ULTRALIGHT:
+            card->atqa[0] = 0x44;
+            card->sak = 0x00;
+            card->memSize = 64;
+            break;
+        case SIM_CARD_ULTRALIGHT_EV1:
+            card->atqa[0] = 0x44;
+            card->sak = 0x00;
+            card->memSize = 80;
+            break;
+        case SIM_CARD_DESFIRE:
+            card->atqa[0] = 0x44;
+            card->atqa[1] = 0x03;
+            card->sak = 0x20;
+            card->memSize = 4096;
+            break;
+    }
+
+    card->chip = -1;
+    card->state = SIM_PICC_OFF;
+    card->authSector = -1;
+    card->writeAddr = -1;
+    SimPicc_Format(card);
+
+    return card;
+}
+
+/* Move a card into the field of a reader, -1 takes it out */
+void Sim_PlaceCard(SimCard_t *card, int chip) {
+    card->chip = chip;
+    card->answers = 0;
+    SimPicc_Field(card, (chip >= 0) && SimChip_FieldOn(chip));
+}
+
+/* Corrupt the next count answers of this card */
+void Sim_InjectFault(SimCard_t *card, SimFault_t fault, uint16_t count) {
+    Sim_InjectFaultAt(card, fault, count, 0);
+}
+
+/* Same, after skip good answers: aims the fault at one step of a sequence */
+void Sim_InjectFaultAt(SimCard_t *card, SimFault_t fault, uint16_t count, uint16_t skip) {
+    card->fault = fault;
+    card->faultCount = count;
+    card->faultSkip = skip;
+}
+
+/* Corrupt a random share of all answers, reproducible through the seed */
+void Sim_SetErrorRate(uint16_t perMille, uint32_t seed) {
+    sim_error_rate = perMille;
+    sim_error_seed = seed ? seed : 1;
+}
+
+/* Power up in IDLE when the field comes on, lose all state when it goes */
+void SimPicc_Field(SimCard_t *card, bool on) {
+    if (on && (card->state != SIM_PICC_OFF)) {
+        return;
+    }
+    card->state = on ? SIM_PICC_IDLE : SIM_PICC_OFF;
+    card->wasHalted = false;
+    card->level = 0;
+    card->authSector = -1;
+    card->writeAddr = -1;
+    card->dr = 0;
+    card->ds = 0;
+}
+
+/* Unexpected frame: back to IDLE, or HALT when woken from there */
+static void SimPicc_Fallback(SimCard_t *card) {
+    card->state = card->wasHalted ? SIM_PICC_HALT : SIM_PICC_IDLE;
+    card->level = 0;
+    card->authSector = -1;
+    card->writeAddr = -1;
+    card->dr = 0;
+    card->ds = 0;
+}
+
+static void SimPicc_Answer(SimRfAnswer_t *answer, const uint8_t *data, uint16_t len, bool crc) {
+    memcpy(answer->data, data, len);
+    if (crc) {
+        uint16_t c = SimPicc_CrcA(data, len);
+        answer->data[len] = c & 0xFF;
+        answer->data[len + 1] = c >> 8;
+        len += 2;
+    }
+    answer->bits = len * 8;
+}
+
+static void SimPicc_Nibble(SimRfAnswer_t *answer, uint8_t value) {
+    answer->data[0] = value & 0x0F;
+    answer->bits = 4;
+}
+
+static SimFault_t SimPicc_NextFault(SimCard_t *card) {
+    if (card->faultSkip > 0) {
+        card->faultSkip--;
+    } else if (card->faultCount > 0) {
+        card->faultCount--;
+        return card->fault;
+    }
+    if (sim_error_rate > 0) {
+        // xorshift32
+        sim_error_seed ^= sim_error_seed << 13;
+        sim_error_seed ^= sim_error_seed >> 17;
+        sim_error_seed ^= sim_error_seed << 5;
+        if ((sim_error_seed % 1000) < sim_error_rate) {
+            return (SimFault_t)(SIM_FAULT_DROP + (sim_error_seed >> 16) % 3);
+        }
+    }
+    return SIM_FAULT_NONE;
+}
+
+/* READY: anticollision and SELECT of the current cascade level */
+static bool SimPicc_ReceiveReady(SimCard_t *card, const uint8_t *data, uint16_t bits, SimRfAnswer_t *answer) {
+    uint8_t cln[5];
+    uint8_t nvb;
+
+    if ((bits < 16) || (data[0] != (PICC_CMD_SEL_CL1 + 2 * card->level))) {
+        SimPicc_Fallback(card);
+        return false;
+    }
+    SimPicc_Cln(card, card->level, cln);
+    nvb = data[1];
+
+    if ((nvb == 0x70) && (bits == 72)) {
+        // SELECT; a PICC whose UID does not match stays READY
+        if (!SimPicc_CrcOk(data, 9) || (memcmp(&data[2], cln, 5) != 0)) {
+            return false;
+        }
+        uint8_t sak;
+        if (card->level < SimPicc_Levels(card) - 1) {
+            sak = 0x04;  // Cascade bit: UID not complete
+            card->level++;
+        } else {
+            sak = card->sak;
+            card->state = SIM_PICC_ACTIVE;
+        }
+        SimPicc_Answer(answer, &sak, 1, true);
+        return true;
+    }
+
+    // ANTICOLLISION: NVB holds the byte count (SEL and NVB included) and the extra bits
+    uint16_t knownBits = ((nvb >> 4) - 2) * 8 + (nvb & 0x07);
+    if (((nvb >> 4) < 2) || (knownBits >= 40) || (bits != 16 + knownBits)) {
+        SimPicc_Fallback(card);
+        return false;
+    }
+    for (uint16_t i = 0; i < knownBits; i++) {
+        if (((data[2 + i / 8] ^ cln[i / 8]) >> (i % 8)) & 1) {
+            return false;
+        }
+    }
+
+    // Send the rest of UID CLn and BCC, bit by bit from the first unknown one
+    memset(answer->data, 0, 5);
+    for (uint16_t i = knownBits; i < 40; i++) {
+        uint16_t o = i - knownBits;
+        answer->data[o / 8] |= ((cln[i / 8] >> (i % 8)) & 1) << (o % 8);
+    }
+    answer->bits = 40 - knownBits;
+    return true;
+}
+
+/* ACTIVE, ISO/IEC 14443-4 card: RATS opens the protocol, HLTA is the only
+ * other command; anything else silences it */
+static bool SimPicc_ReceiveRats(SimCard_t *card, const uint8_t *data, uint16_t len, SimRfAnswer_t *answer) {
+    static const uint16_t fsdTable[9] = {16, 24, 32, 40, 48, 64, 96, 128, 256};
+    // TL, T0 (TA TB TC, FSCI 5 = 64 bytes), TA 212/424/848 both ways,
+    // TB FWI 8 (77ms) SFGI 1, TC CID supported, one historical byte
+    static const uint8_t ats[6] = {0x06, 0x75, 0x77, 0x81, 0x02, 0x80};
+
+    if ((data[0] == PICC_CMD_RATS) && (len == 4)) {
+        uint8_t fsdi = data[1] >> 4;
+        card->fsd = fsdTable[(fsdi > 8) ? 8 : fsdi];
+        card->state = SIM_PICC_PROTOCOL;
+        card->blockNum = 1;
+        card->ppsAllowed = true;
+        card->wtxPending = false;
+        card->apduLen = 0;
+        card->respLen = 0;
+        card->respPos = 0;
+        card->lastLen = 0;
+        SimPicc_Answer(answer, ats, sizeof(ats), true);
+        return true;
+    }
+
+    if ((data[0] == PICC_CMD_HLTA) && (len == 4) && (data[1] == 0x00)) {
+        card->state = SIM_PICC_HALT;
+        card->wasHalted = true;
+        return false;
+    }
+
+    SimPicc_Fallback(card);
+    return false;
+}
+
+/* ACTIVE: MIFARE Classic / Ultralight memory commands */
+static bool SimPicc_ReceiveActive(SimCard_t *card, const uint8_t *data, uint16_t bits, bool crypto,
+                                  SimRfAnswer_t *answer) {
+    bool classic = SimPicc_IsClassic(card);
+    uint16_t len = bits / 8;
+    uint16_t units = classic ? card->memSize / 16 : card->memSize / 4;
+    uint8_t nak = classic ? SIM_NAK_CLASSIC : SIM_NAK_UL;
+    uint8_t buff[64];
+
+    // Plain frames to an authenticated card, or encrypted ones to a plain
+    // card, decode as garbage
+    if (((card->authSector >= 0) != crypto) || (bits % 8) || !SimPicc_CrcOk(data, len)) {
+        SimPicc_Fallback(card);
+        return false;
+    }
+    if (card->type == SIM_CARD_DESFIRE) {
+        return SimPicc_ReceiveRats(card, data, len, answer);
+    }
+
+    if (card->writeAddr >= 0) {
+        // Second phase of a two-step WRITE: 16 data bytes
+        uint16_t addr = card->writeAddr;
+        card->writeAddr = -1;
+        if (len != 18) {
+            SimPicc_Nibble(answer, nak);
+            SimPicc_Fallback(card);
+            return true;
+        }
+        if (classic) {
+            memcpy(&card->mem[addr * 16], data, 16);
+        } else {
+            memcpy(&card->mem[addr * 4], data, 4);  // COMPATIBILITY_WRITE keeps 4 bytes
+        }
+        SimPicc_Nibble(answer, SIM_ACK);
+        answer->delayNs = SIM_EEPROM_NS;
+        return true;
+    }
+
+    switch (data[0]) {
+        case PICC_CMD_HLTA:
+            if ((len == 4) && (data[1] == 0x00)) {
+                card->state = SIM_PICC_HALT;
+                card->wasHalted = true;
+                card->authSector = -1;
+                return false;
+            }
+            break;
+
+        case PICC_CMD_MF_READ:
+            if (len != 4) {
+                break;
+            }
+            if (classic) {
+                if ((data[1] >= units) || (SimPicc_Sector(data[1]) != card->authSector)) {
+                    SimPicc_Nibble(answer, nak);
+                    SimPicc_Fallback(card);
+                    return true;
+                }
+                memcpy(buff, &card->mem[data[1] * 16], 16);
+                if (SimPicc_Trailer(card->authSector) == data[1]) {
+                    memset(buff, 0, 6);  // Key A never reads back
+                }
+            } else {
+                if (data[1] >= units) {
+                    SimPicc_Nibble(answer, nak);
+                    SimPicc_Fallback(card);
+                    return true;
+                }
+                // Four pages, rolling over to page 0 past the end
+                for (uint8_t i = 0; i < 16; i++) {
+                    buff[i] = card->mem[((data[1] * 4) + i) % card->memSize];
+                }
+            }
+            SimPicc_Answer(answer, buff, 16, true);
+            return true;
+
+        case PICC_CMD_MF_WRITE:
+            if (len != 4) {
+                break;
+            }
+            if ((data[1] >= units) || (classic ? ((data[1] == 0) || (SimPicc_Sector(data[1]) != card->authSector))
+                                                : (data[1] < 4))) {
+                SimPicc_Nibble(answer, nak);
+                SimPicc_Fallback(card);
+                return true;
+            }
+            card->writeAddr = data[1];
+            SimPicc_Nibble(answer, SIM_ACK);
+            return true;
+
+        case SIM_CMD_UL_WRITE:
+            if (classic || (len != 8)) {
+                break;
+            }
+            if ((data[1] < 2) || (data[1] >= units)) {
+                SimPicc_Nibble(answer, nak);
+                SimPicc_Fallback(card);
+                return true;
+            }
+            if (data[1] < 4) {
+                // Lock and OTP bits can only be set
+                for (uint8_t i = 0; i < 4; i++) {
+                    if ((data[1] == 3) || (i >= 2)) {
+                        card->mem[data[1] * 4 + i] |= data[2 + i];
+                    }
+                }
+            } else {
+                memcpy(&card->mem[data[1] * 4], &data[2], 4);
+            }
+            SimPicc_Nibble(answer, SIM_ACK);
+            answer->delayNs = SIM_EEPROM_NS;
+            return true;
+
+        case SIM_CMD_UL_GET_VERSION:
+            if ((card->type != SIM_CARD_ULTRALIGHT_EV1) || (len != 3)) {
+                break;
+            }
+            {
+                // MF0UL11: vendor NXP, Ultralight EV1, 48 bytes user memory
+                static const uint8_t version[8] = {0x00, 0x04, 0x03, 0x01, 0x01, 0x00, 0x0B, 0x03};
+                SimPicc_Answer(answer, version, 8, true);
+            }
+            return true;
+
+        case SIM_CMD_UL_FAST_READ:
+            if ((card->type != SIM_CARD_ULTRALIGHT_EV1) || (len != 5)) {
+                break;
+            }
+            if ((data[1] > data[2]) || (data[2] >= units)) {
+                SimPicc_Nibble(answer, nak);
+                SimPicc_Fallback(card);
+                return true;
+            }
+            SimPicc_Answer(answer, &card->mem[data[1] * 4], (data[2] - data[1] + 1) * 4, true);
+            return true;
+
+        default:
+            break;
+    }
+
+    SimPicc_Nibble(answer, nak);
+    SimPicc_Fallback(card);
+    return true;
+}
+
+/* Send an ISO-DEP block with CRC_A and keep it for retransmission */
+static void SimPicc_Block(SimCard_t *card, SimRfAnswer_t *answer, const uint8_t *data, uint16_t len) {
+    memmove(card->last, data, len);
+    card->lastLen = len;
+    SimPicc_Answer(answer, card->last, len, true);
+}
+
+static void SimPicc_RAck(SimCard_t *card, SimRfAnswer_t *answer) {
+    uint8_t pcb = SIM_ISO_R_ACK | card->blockNum;
+    SimPicc_Block(card, answer, &pcb, 1);
+}
+
+/* Next I-block of the response, chained while it does not fit FSD */
+static void SimPicc_SendChunk(SimCard_t *card, SimRfAnswer_t *answer) {
+    uint8_t block[SIM_RF_MAX_BYTES];
+    uint16_t chunk = card->respLen - card->respPos;
+
+    if (chunk > card->fsd - 3) {
+        chunk = card->fsd - 3;
+    }
+    block[0] = SIM_ISO_I_BLOCK | card->blockNum;
+    if (card->respPos + chunk < card->respLen) {
+        block[0] |= SIM_ISO_CHAINING;
+    }
+    memcpy(&block[1], &card->resp[card->respPos], chunk);
+    card->respPos += chunk;
+    SimPicc_Block(card, answer, block, chunk + 1);
+}
+
+/* READ BINARY and UPDATE BINARY on the card memory as one file, P1P2 the
+ * offset. UPDATE takes long enough to need a waiting time extension. */
+static void SimPicc_Apdu(SimCard_t *card) {
+    const uint8_t *c = card->apdu;
+    uint16_t len = card->apduLen;
+    uint16_t sw = 0x9000;
+    uint16_t n = 0;
+
+    card->apduLen = 0;
+    card->respPos = 0;
+
+    if (len < 4) {
+        sw = 0x6700;
+    } else {
+        uint16_t offset = (c[2] << 8) | c[3];
+
+        switch (c[1]) {
+            case 0xB0: {
+                uint16_t le = (len == 5) ? (c[4] ? c[4] : 256) : 0;
+                if (le == 0) {
+                    sw = 0x6700;
+                } else if (offset + le > card->memSize) {
+                    sw = 0x6B00;
+                } else {
+                    memcpy(card->resp, &card->mem[offset], le);
+                    n = le;
+                }
+                break;
+            }
+            case 0xD6:
+                if ((len < 6) || (len != 5 + c[4])) {
+                    sw = 0x6700;
+                } else if (offset + c[4] > card->memSize) {
+                    sw = 0x6B00;
+                } else {
+                    memcpy(&card->mem[offset], &c[5], c[4]);
+                    card->wtxPending = true;
+                }
+                break;
+            default:
+                sw = 0x6D00;
+                break;
+        }
+    }
+
+    card->resp[n] = sw >> 8;
+    card->resp[n + 1] = sw & 0xFF;
+    card->respLen = n + 2;
+}
+
+/* PROTOCOL: ISO-DEP block protocol. Damaged frames and frames over FSC
+ * (64) are ignored, the reader recovers with R(NAK). */
+static bool SimPicc_ReceiveProtocol(SimCard_t *card, const uint8_t *data, uint16_t bits, SimRfAnswer_t *answer) {
+    uint16_t len = bits / 8;
+
+    if ((bits % 8) || (len > 64) || !SimPicc_CrcOk(data, len)) {
+        return false;
+    }
+    len -= 2;
+    uint8_t pcb = data[0];
+
+    if (card->ppsAllowed && (pcb == PICC_CMD_PPS) && (len >= 2)) {
+        card->ppsAllowed = false;
+        SimPicc_Answer(answer, &pcb, 1, true);
+        // The answer still goes at 106 kbit/s, the new rates apply after it
+        if ((data[1] & 0x10) && (len == 3)) {
+            card->ds = (data[2] >> 2) & 0x03;
+            card->dr = data[2] & 0x03;
+        }
+        return true;
+    }
+    card->ppsAllowed = false;
+
+    if ((pcb & 0xE2) == SIM_ISO_I_BLOCK) {
+        if ((pcb & 0x0C) || (card->apduLen + len - 1 > SIM_APDU_MAX)) {
+            return false;
+        }
+        card->blockNum ^= 1;
+        memcpy(&card->apdu[card->apduLen], &data[1], len - 1);
+        card->apduLen += len - 1;
+
+        if (pcb & SIM_ISO_CHAINING) {
+            SimPicc_RAck(card, answer);
+            return true;
+        }
+
+        SimPicc_Apdu(card);
+        if (card->wtxPending) {
+            const uint8_t wtx[2] = {SIM_ISO_S_WTX, 0x02};
+            SimPicc_Block(card, answer, wtx, 2);
+        } else {
+            SimPicc_SendChunk(card, answer);
+        }
+        return true;
+    }
+
+    if ((pcb & 0xE6) == SIM_ISO_R_ACK) {
+        if ((pcb & 0x01) == card->blockNum) {
+            // The reader missed our last block
+            SimPicc_Block(card, answer, card->last, card->lastLen);
+        } else if (pcb & 0x10) {
+            // R(NAK) for a block we never got
+            SimPicc_RAck(card, answer);
+        } else if (card->respPos < card->respLen) {
+            card->blockNum ^= 1;
+            SimPicc_SendChunk(card, answer);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    if ((pcb == SIM_ISO_S_DESELECT) && (len == 1)) {
+        SimPicc_Answer(answer, &pcb, 1, true);
+        card->state = SIM_PICC_HALT;
+        card->wasHalted = true;
+        card->dr = 0;
+        card->ds = 0;
+        return true;
+    }
+
+    if ((pcb == SIM_ISO_S_WTX) && (len == 2) && card->wtxPending) {
+        card->wtxPending = false;
+        SimPicc_SendChunk(card, answer);
+        answer->delayNs = SIM_WTX_NS;
+        return true;
+    }
+
+    return false;
+}
+
+/* One reader frame as seen by one card. Returns true and fills answer
+ * if the card answers; bits are LSB first, as on air. A frame at another
+ * bit rate than the card listens to does not reach it. */
+bool SimPicc_Receive(SimCard_t *card, const uint8_t *data, uint16_t bits, bool crypto, uint8_t speed,
+                     SimRfAnswer_t *answer) {
+    bool answered = false;
+
+    answer->bits = 0;
+    answer->speed = card->ds;
+    answer->delayNs = SIM_FDT_NS;
+    answer->fault = SIM_FAULT_NONE;
+
+    if ((card->state == SIM_PICC_OFF) || (speed != card->dr)) {
+        return false;
+    }
+
+    if (bits == 7) {
+        // Short frame: REQA / WUPA
+        uint8_t cmd = data[0] & 0x7F;
+        bool wake = ((cmd == PICC_CMD_REQA) && (card->state == SIM_PICC_IDLE)) ||
+                    ((cmd == PICC_CMD_WUPA) && ((card->state == SIM_PICC_IDLE) || (card->state == SIM_PICC_HALT)));
+        if (wake) {
+            card->wasHalted = (card->state == SIM_PICC_HALT);
+            card->state = SIM_PICC_READY;
+            card->level = 0;
+            SimPicc_Answer(answer, card->atqa, 2, false);
+            answered = true;
+        } else if ((card->state == SIM_PICC_READY) || (card->state == SIM_PICC_ACTIVE)) {
+            SimPicc_Fallback(card);
+        }
+    } else if (card->state == SIM_PICC_READY) {
+        answered = SimPicc_ReceiveReady(card, data, bits, answer);
+    } else if (card->state == SIM_PICC_ACTIVE) {
+        answered = SimPicc_ReceiveActive(card, data, bits, crypto, answer);
+    } else if (card->state == SIM_PICC_PROTOCOL) {
+        answered = SimPicc_ReceiveProtocol(card, data, bits, answer);
+    }
+
+    if (answered) {
+        card->answers++;
+        answer->fault = SimPicc_NextFault(card);
+    }
+
+    return answered;
+}
+
+/* Three-pass MIFARE Classic authentication, without the Crypto1 itself:
+ * the key is compared against the sector trailer */
+bool SimPicc_Authenticate(SimCard_t *card, uint8_t authCmd, uint8_t block, const uint8_t *key) {
+    if ((card->state != SIM_PICC_ACTIVE) || !SimPicc_IsClassic(card) || (block >= card->memSize / 16)) {
+        if (card->state == SIM_PICC_ACTIVE) {
+            SimPicc_Fallback(card);
+        }
+        return false;
+    }
+
+    int16_t sector = SimPicc_Sector(block);
+    const uint8_t *trailer = &card->mem[SimPicc_Trailer(sector) * 16];
+    const uint8_t *stored = (authCmd == PICC_CMD_MF_AUTH_KEY_B) ? &trailer[10] : &trailer[0];
+
+    if (((authCmd != PICC_CMD_MF_AUTH_KEY_A) && (authCmd != PICC_CMD_MF_AUTH_KEY_B)) || (memcmp(stored, key, 6) != 0)) {
+        SimPicc_Fallback(card);
+        return false;
+    }
+
+    card->authSector = sector;
+    return true;
+}